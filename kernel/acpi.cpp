@@ -3,6 +3,7 @@
 #include <cstring>
 #include <cstdlib>
 #include "asmfunc.h"
+#include "hpet.hpp"
 #include "logger.hpp"
 
 namespace {
@@ -67,19 +68,38 @@ size_t XSDT::Count() const {
 }
 
 const FADT* fadt;
+const MADT* madt;
+const HPETTable* hpet_table;
 
 void WaitMilliseconds(unsigned long msec) {
-  const bool pm_timer_32 = (fadt->flags >> 8) & 1;
-  const uint32_t start = IoIn32(fadt->pm_tmr_blk);
-  uint32_t end = start + kPMTimerFreq * msec / 1000;
-  if (!pm_timer_32) {
-    end &= 0x00ffffffu;
+  WaitMicroseconds(msec * 1000);
+}
+
+void WaitMicroseconds(unsigned long usec) {
+  if (hpet::Available()) {
+    hpet::WaitMicroseconds(usec);
+    return;
   }
 
-  if (end < start) { // overflow
-    while (IoIn32(fadt->pm_tmr_blk) >= start);
+  // PM タイマは 24 ビットのこともあり一周が短いので，差分を少しずつ積み上げる
+  const uint64_t wait = static_cast<uint64_t>(kPMTimerFreq) * usec / 1'000'000;
+  uint64_t elapsed = 0;
+  uint32_t prev = ReadPMTimer();
+  while (elapsed < wait) {
+    const uint32_t now = ReadPMTimer();
+    elapsed += PMTimerDiff(prev, now);
+    prev = now;
   }
-  while (IoIn32(fadt->pm_tmr_blk) < end);
+}
+
+uint32_t ReadPMTimer() {
+  return IoIn32(fadt->pm_tmr_blk);
+}
+
+uint32_t PMTimerDiff(uint32_t start, uint32_t end) {
+  const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+  const uint32_t diff = end - start;
+  return pm_timer_32 ? diff : (diff & 0x00ffffffu);
 }
 
 void Initialize(const RSDP& rsdp) {
@@ -95,11 +115,16 @@ void Initialize(const RSDP& rsdp) {
   }
 
   fadt = nullptr;
+  madt = nullptr;
+  hpet_table = nullptr;
   for (int i = 0; i < xsdt.Count(); ++i) {
     const auto& entry = xsdt[i];
     if (entry.IsValid("FACP")) { // FACP is the signature of FADT
       fadt = reinterpret_cast<const FADT*>(&entry);
-      break;
+    } else if (entry.IsValid("APIC")) { // APIC is the signature of MADT
+      madt = reinterpret_cast<const MADT*>(&entry);
+    } else if (entry.IsValid("HPET")) {
+      hpet_table = reinterpret_cast<const HPETTable*>(&entry);
     }
   }
 
@@ -107,6 +132,9 @@ void Initialize(const RSDP& rsdp) {
     Log(kError, "FADT is not found\n");
     exit(1);
   }
+  if (madt == nullptr) {
+    Log(kWarn, "MADT is not found\n");
+  }
 }
 
 } // namespace acpi
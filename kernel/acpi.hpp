@@ -56,10 +56,79 @@ struct FADT {
   char reserved3[276 - 116];
 } __attribute__((packed));
 
+/** @brief MADT（Multiple APIC Description Table）
+ *
+ * ヘッダの後ろに可変長のエントリ（MADTEntryHeader から始まる構造）が並ぶ。
+ */
+struct MADT {
+  DescriptionHeader header;
+  uint32_t local_apic_address;
+  uint32_t flags;
+
+  const uint8_t* EntriesBegin() const {
+    return reinterpret_cast<const uint8_t*>(this + 1);
+  }
+  const uint8_t* EntriesEnd() const {
+    return reinterpret_cast<const uint8_t*>(this) + header.length;
+  }
+} __attribute__((packed));
+
+/** @brief HPET（High Precision Event Timer）の記述テーブル */
+struct HPETTable {
+  DescriptionHeader header;
+  uint32_t event_timer_block_id;
+  // Generic Address Structure
+  uint8_t address_space_id; // 0 = System Memory
+  uint8_t register_bit_width;
+  uint8_t register_bit_offset;
+  uint8_t reserved;
+  uint64_t address;
+  uint8_t hpet_number;
+  uint16_t minimum_tick;
+  uint8_t page_protection;
+} __attribute__((packed));
+
+struct MADTEntryHeader {
+  uint8_t type;
+  uint8_t length;
+} __attribute__((packed));
+
+/** @brief MADT エントリ Type 0: Processor Local APIC */
+struct MADTLocalAPIC {
+  static const uint8_t kType = 0;
+
+  MADTEntryHeader header;
+  uint8_t acpi_processor_uid;
+  uint8_t apic_id;
+  uint32_t flags; // bit 0: Enabled, bit 1: Online Capable
+} __attribute__((packed));
+
+/** @brief MADT エントリ Type 9: Processor Local x2APIC */
+struct MADTLocalX2APIC {
+  static const uint8_t kType = 9;
+
+  MADTEntryHeader header;
+  uint16_t reserved;
+  uint32_t x2apic_id;
+  uint32_t flags; // bit 0: Enabled, bit 1: Online Capable
+  uint32_t acpi_processor_uid;
+} __attribute__((packed));
+
 extern const FADT* fadt;
+/** @brief MADT が見つからなければ nullptr */
+extern const MADT* madt;
+/** @brief HPET のテーブルが見つからなければ nullptr */
+extern const HPETTable* hpet_table;
 const int kPMTimerFreq = 3579545;
 
+/** @brief 指定した時間だけ待つ。HPET があれば HPET，なければ PM タイマを使う。 */
 void WaitMilliseconds(unsigned long msec);
+/** @brief 指定した時間だけ待つ。HPET があれば HPET，なければ PM タイマを使う。 */
+void WaitMicroseconds(unsigned long usec);
+/** @brief ACPI PM タイマの現在値を返す。 */
+uint32_t ReadPMTimer();
+/** @brief PM タイマの 2 つの読み取り値の差を，カウンタの一周を考慮して返す。 */
+uint32_t PMTimerDiff(uint32_t start, uint32_t end);
 void Initialize(const RSDP& rsdp);
 
 } // namespace acpi
@@ -0,0 +1,107 @@
+; apstartup.asm
+;
+; AP（アプリケーションプロセッサ）起動用のトランポリンコード．
+; ap_trampoline_start から ap_trampoline_end までを 1MiB 未満の 4KiB 境界に
+; コピーし，その物理アドレス >> 12 を SIPI のベクタとして送る．
+; AP はリアルモードでここから実行を始め，プロテクトモード，ロングモードと
+; 順に切り替えて ap_param_entry の関数を呼び出す．
+; 自身の配置アドレスは CS から求めるので，コピー先はどこでもよい．
+
+bits 16
+section .text
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_param_cr3
+global ap_param_stack
+global ap_param_entry
+
+%define OFS(label) ((label) - ap_trampoline_start)
+
+ap_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4    ; ebx = トランポリンの物理アドレス
+
+    ; 配置アドレスに依存する値を書き込む
+    lea eax, [ebx + OFS(ap_gdt)]
+    mov [OFS(ap_gdtr) + 2], eax
+    lea eax, [ebx + OFS(ap_protected_mode)]
+    mov [OFS(ap_jump_protected)], eax
+    lea eax, [ebx + OFS(ap_long_mode)]
+    mov [OFS(ap_jump_long)], eax
+
+    o32 lgdt [OFS(ap_gdtr)]
+    mov eax, cr0
+    or eax, 1     ; PE
+    mov cr0, eax
+    jmp far dword [OFS(ap_jump_protected)]
+
+bits 32
+ap_protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, (1 << 5) | (1 << 9) | (1 << 10)  ; PAE, OSFXSR, OSXMMEXCPT
+    mov cr4, eax
+    mov eax, [ebx + OFS(ap_param_cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8       ; LME
+    wrmsr
+
+    ; INIT 直後の CR0 は CD と NW が立っていてキャッシュが効かない。
+    ; CD=0，NW=1 の組は #GP になるので，2 つは同じ書き込みで下ろす
+    wbinvd
+    mov eax, cr0
+    and eax, ~((1 << 30) | (1 << 29) | (1 << 2))  ; CD, NW, EM
+    or eax, (1 << 31) | (1 << 1)  ; PG, MP
+    mov cr0, eax
+    jmp far [ebx + OFS(ap_jump_long)]
+
+bits 64
+ap_long_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov ebx, ebx  ; 上位 32 ビットは不定なのでゼロ拡張する
+    mov rsp, [rbx + OFS(ap_param_stack)]
+    call [rbx + OFS(ap_param_entry)]
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff  ; 0x08: 32 ビットコードセグメント
+    dq 0x00cf92000000ffff  ; 0x10: データセグメント
+    dq 0x00af9a000000ffff  ; 0x18: 64 ビットコードセグメント
+ap_gdtr:
+    dw ap_gdtr - ap_gdt - 1
+    dd 0
+ap_jump_protected:
+    dd 0
+    dw 0x08
+ap_jump_long:
+    dd 0
+    dw 0x18
+
+align 8
+ap_param_cr3:    ; PML4 テーブルの物理アドレス（4GiB 未満）
+    dq 0
+ap_param_stack:  ; AP が使うスタックの終端
+    dq 0
+ap_param_entry:  ; AP が最初に呼び出す関数
+    dq 0
+ap_trampoline_end:
@@ -49,6 +49,11 @@ LoadGDT:
     pop rbp
     ret
 
+global LoadTR  ; void LoadTR(uint16_t sel);
+LoadTR:
+    ltr di
+    ret
+
 global SetCSSS  ; void SetCSSS(uint16_t cs, uint16_t ss);
 SetCSSS:
     push rbp
@@ -81,6 +86,112 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR2  ; uint64_t GetCR2();
+GetCR2:
+    mov rax, cr2
+    ret
+
+global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
+InvalidateTLB:
+    invlpg [rdi]
+    ret
+
+global GetCR0  ; uint64_t GetCR0();
+GetCR0:
+    mov rax, cr0
+    ret
+
+global SetCR0  ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
+global FXSave  ; void FXSave(void* fxsave_area);
+FXSave:
+    fxsave [rdi]
+    ret
+
+global FXRstor  ; void FXRstor(const void* fxsave_area);
+FXRstor:
+    fxrstor [rdi]
+    ret
+
+global ReadCPUID  ; void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+ReadCPUID:  ; regs[0..3] = eax, ebx, ecx, edx
+    push rbx
+    mov r8, rdx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8], eax
+    mov [r8 + 4], ebx
+    mov [r8 + 8], ecx
+    mov [r8 + 12], edx
+    pop rbx
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadMSR  ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR:
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR  ; void WriteMSR(uint32_t msr, uint64_t value);
+WriteMSR:
+    mov ecx, edi
+    mov rax, rsi
+    mov rdx, rsi
+    shr rdx, 32
+    wrmsr
+    ret
+
+extern DeviceNotAvailableOnInterrupt
+
+global IntHandlerDeviceNotAvailable  ; #NM（Device Not Available）例外の入口
+IntHandlerDeviceNotAvailable:
+    ; TS が立ったまま FPU/SSE 命令を実行すると #NM が再発するので，何よりも先に下ろす
+    clts
+    push rbp
+    mov rbp, rsp
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    sub rsp, 512
+    and rsp, -16
+    ; C++ のコードが SSE レジスタを使う前に，割り込まれた時点の状態を退避しておく
+    fxsave [rsp]
+    mov rdi, rsp
+    mov rsi, [rbp + 8]  ; 割り込まれた RIP
+    call DeviceNotAvailableOnInterrupt  ; 復帰すべき FXSAVE 領域を返す
+    fxrstor [rax]
+    lea rsp, [rbp - 8 * 9]
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    pop rbp
+    iretq
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -130,7 +241,7 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
+    ; FPU/SSE の状態は遅延退避する（#NM 例外で TaskManager::SwitchFPU が行う）
 
     ; iret 用のスタックフレーム
     push qword [rdi + 0x28] ; SS
@@ -140,8 +251,6 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     push qword [rdi + 0x08] ; RIP
 
     ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
     mov rax, [rdi + 0x00]
     mov cr3, rax
     mov rax, [rdi + 0x30]
@@ -8,9 +8,21 @@ extern "C" {
   uint16_t GetCS(void);
   void LoadIDT(uint16_t limit, uint64_t offset);
   void LoadGDT(uint16_t limit, uint64_t offset);
+  void LoadTR(uint16_t sel);
   void SetCSSS(uint16_t cs, uint16_t ss);
   void SetDSAll(uint16_t value);
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  uint64_t GetCR2();
+  void InvalidateTLB(uint64_t addr);
+  uint64_t GetCR0();
+  void SetCR0(uint64_t value);
+  void FXSave(void* fxsave_area);
+  void FXRstor(const void* fxsave_area);
+  void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+  uint64_t ReadTSC();
+  uint64_t ReadMSR(uint32_t msr);
+  void WriteMSR(uint32_t msr, uint64_t value);
   void SwitchContext(void* next_ctx, void* current_ctx);
+  void IntHandlerDeviceNotAvailable();
 }
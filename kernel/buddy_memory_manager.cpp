@@ -0,0 +1,263 @@
+#include "memory_manager.hpp"
+
+#include <algorithm>
+
+namespace {
+  int Log2Floor(size_t value) {
+    return 63 - __builtin_clzl(value);
+  }
+
+  int Log2Ceil(size_t value) {
+    return value <= 1 ? 0 : Log2Floor(value - 1) + 1;
+  }
+}
+
+template <class F>
+void BuddyMemoryManager::ForEachBlock(size_t begin, size_t end, F f) {
+  while (begin < end) {
+    int order = std::min(Log2Floor(end - begin), kMaxOrder);
+    if (begin != 0) {
+      order = std::min(order, __builtin_ctzl(begin));
+    }
+    f(begin, order);
+    begin += 1ul << order;
+  }
+}
+
+size_t BuddyMemoryManager::OrderMap::LinesFor(size_t bits) {
+  size_t total = 0;
+  do {
+    bits = (bits + kBitsPerMapLine - 1) / kBitsPerMapLine;
+    total += bits;
+  } while (bits > 1);
+  return total;
+}
+
+void BuddyMemoryManager::OrderMap::Init(MapLineType* storage, size_t bits) {
+  num_levels_ = 0;
+  do {
+    bits = (bits + kBitsPerMapLine - 1) / kBitsPerMapLine;
+    levels_[num_levels_++] = storage;
+    storage += bits;
+  } while (bits > 1);
+}
+
+void BuddyMemoryManager::OrderMap::Set(size_t index) {
+  for (int level = 0; level < num_levels_; ++level) {
+    auto& line = levels_[level][index / kBitsPerMapLine];
+    const bool was_empty = line == 0;
+    line |= static_cast<MapLineType>(1) << (index % kBitsPerMapLine);
+    if (!was_empty) {
+      return;
+    }
+    index /= kBitsPerMapLine;
+  }
+}
+
+void BuddyMemoryManager::OrderMap::Clear(size_t index) {
+  for (int level = 0; level < num_levels_; ++level) {
+    auto& line = levels_[level][index / kBitsPerMapLine];
+    line &= ~(static_cast<MapLineType>(1) << (index % kBitsPerMapLine));
+    if (line != 0) {
+      return;
+    }
+    index /= kBitsPerMapLine;
+  }
+}
+
+size_t BuddyMemoryManager::OrderMap::FindFirst() const {
+  size_t index = 0;
+  for (int level = num_levels_ - 1; level >= 0; --level) {
+    const auto line = levels_[level][index];
+    if (line == 0) {
+      return kNone;
+    }
+    index = index * kBitsPerMapLine + __builtin_ctzl(line);
+  }
+  return index;
+}
+
+bool BuddyMemoryManager::OrderMap::AnyIn(size_t begin, size_t end) const {
+  if (begin >= end) {
+    return false;
+  }
+  const size_t first = begin / kBitsPerMapLine, last = (end - 1) / kBitsPerMapLine;
+  const MapLineType head = ~static_cast<MapLineType>(0) << (begin % kBitsPerMapLine);
+  const MapLineType tail = ~static_cast<MapLineType>(0) >> (kBitsPerMapLine - 1 - (end - 1) % kBitsPerMapLine);
+  if (first == last) {
+    return levels_[0][first] & head & tail;
+  }
+  if (levels_[0][first] & head) {
+    return true;
+  }
+  for (size_t line = first + 1; line < last; ++line) {
+    if (levels_[0][line]) {
+      return true;
+    }
+  }
+  return levels_[0][last] & tail;
+}
+
+size_t BuddyMemoryManager::Capacity(size_t frame_count) {
+  const size_t max_block = 1ul << kMaxOrder;
+  return (frame_count + max_block - 1) / max_block * max_block;
+}
+
+size_t BuddyMemoryManager::MapBytes(size_t frame_count) {
+  size_t lines = 0;
+  for (int order = 0; order <= kMaxOrder; ++order) {
+    lines += OrderMap::LinesFor(Capacity(frame_count) >> order);
+  }
+  return lines * sizeof(MapLineType);
+}
+
+BuddyMemoryManager::BuddyMemoryManager(size_t frame_count, void* map_buf)
+    : frame_count_{frame_count} {
+  const size_t capacity = Capacity(frame_count);
+  auto storage = reinterpret_cast<MapLineType*>(map_buf);
+  std::fill(storage, storage + MapBytes(frame_count) / sizeof(MapLineType), 0);
+  for (int order = 0; order <= kMaxOrder; ++order) {
+    free_maps_[order].Init(storage, capacity >> order);
+    storage += OrderMap::LinesFor(capacity >> order);
+  }
+  for (size_t frame = 0; frame < capacity; frame += 1ul << kMaxOrder) {
+    free_maps_[kMaxOrder].Set(frame >> kMaxOrder);
+  }
+  // 最大のブロックの大きさに切り上げた分は存在しないフレームなので取り除く
+  ForEachBlock(frame_count, capacity, [this](size_t frame, int order) {
+    CarveBlock(frame, order);
+  });
+}
+
+WithError<FrameID> BuddyMemoryManager::Allocate(size_t num_frames, FrameID limit) {
+  if (num_frames == 0 || num_frames > (1ul << kMaxOrder)) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  const int order = Log2Ceil(num_frames);
+  for (int o = order; o <= kMaxOrder; ++o) {
+    // 各 order で最も前のブロックが limit を超えるなら，その order には収まるブロックがない
+    const size_t index = free_maps_[o].FindFirst();
+    if (index == OrderMap::kNone || (index << o) + num_frames > limit.ID()) {
+      continue;
+    }
+
+    // 見つけたブロックの前半を残して，後半を 1 段ずつ空きに戻す
+    const size_t frame = index << o;
+    free_maps_[o].Clear(index);
+    for (int split = o - 1; split >= order; --split) {
+      free_maps_[split].Set((frame >> split) + 1);
+    }
+    // 2 のべき乗に切り上げて余った分を返す
+    const size_t block_end = frame + (1ul << order);
+    ForEachBlock(frame + num_frames, block_end, [this](size_t f, int o) {
+      FreeBlock(f, o);
+    });
+    return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+  }
+  return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+}
+
+Error BuddyMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+  const size_t begin = std::min(start_frame.ID(), frame_count_);
+  const size_t end = begin + std::min(num_frames, frame_count_ - begin);
+  ForEachBlock(begin, end, [this](size_t frame, int order) {
+    FreeBlock(frame, order);
+  });
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BuddyMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+  const size_t begin = std::min(start_frame.ID(), frame_count_);
+  const size_t end = begin + std::min(num_frames, frame_count_ - begin);
+  ForEachBlock(begin, end, [this](size_t frame, int order) {
+    CarveBlock(frame, order);
+  });
+}
+
+bool BuddyMemoryManager::IsFree(FrameID start_frame, size_t num_frames) const {
+  const size_t begin = start_frame.ID();
+  if (begin > frame_count_ || num_frames > frame_count_ - begin) {
+    return false;
+  }
+  bool free = true;
+  ForEachBlock(begin, begin + num_frames, [this, &free](size_t frame, int order) {
+    free = free && IsFreeRange(frame, order);
+  });
+  return free;
+}
+
+void BuddyMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+  MarkAllocated(FrameID{0}, range_begin.ID());
+  if (range_end.ID() < frame_count_) {
+    MarkAllocated(range_end, frame_count_ - range_end.ID());
+  }
+}
+
+void BuddyMemoryManager::FreeBlock(size_t frame, int order) {
+  while (order < kMaxOrder) {
+    const size_t buddy = frame ^ (1ul << order);
+    if (!IsFreeBlock(buddy, order)) {
+      break;
+    }
+    free_maps_[order].Clear(buddy >> order);
+    frame = std::min(frame, buddy);
+    ++order;
+  }
+  free_maps_[order].Set(frame >> order);
+}
+
+void BuddyMemoryManager::CarveBlock(size_t frame, int order) {
+  const int free_order = FindFreeAncestor(frame, order);
+  if (free_order < 0) {
+    // 空きブロックに丸ごと含まれてはいないが，中に小さな空きブロックがあるかもしれない
+    if (order == 0 || !ContainsFreeBlock(frame, order)) {
+      return;
+    }
+    CarveBlock(frame, order - 1);
+    CarveBlock(frame + (1ul << (order - 1)), order - 1);
+    return;
+  }
+
+  // 含んでいる空きブロックを割って，frame を含まない側の半分を空きに戻していく
+  size_t block = frame & ~((1ul << free_order) - 1);
+  free_maps_[free_order].Clear(block >> free_order);
+  for (int o = free_order - 1; o >= order; --o) {
+    const size_t half = 1ul << o;
+    if (frame & half) {
+      free_maps_[o].Set(block >> o);
+      block += half;
+    } else {
+      free_maps_[o].Set((block + half) >> o);
+    }
+  }
+}
+
+bool BuddyMemoryManager::IsFreeRange(size_t frame, int order) const {
+  if (FindFreeAncestor(frame, order) >= 0) {
+    return true;
+  }
+  if (order == 0) {
+    return false;
+  }
+  return IsFreeRange(frame, order - 1) &&
+    IsFreeRange(frame + (1ul << (order - 1)), order - 1);
+}
+
+int BuddyMemoryManager::FindFreeAncestor(size_t frame, int order) const {
+  for (int o = order; o <= kMaxOrder; ++o) {
+    if (IsFreeBlock(frame & ~((1ul << o) - 1), o)) {
+      return o;
+    }
+  }
+  return -1;
+}
+
+bool BuddyMemoryManager::ContainsFreeBlock(size_t frame, int order) const {
+  for (int o = 0; o < order; ++o) {
+    if (free_maps_[o].AnyIn(frame >> o, (frame + (1ul << order)) >> o)) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -8,7 +8,9 @@
 
 #include <cstring>
 #include "font.hpp"
+#include "interrupt.hpp"
 #include "layer.hpp"
+#include "task.hpp"
 
 Console::Console(const PixelColor& fg_color, const PixelColor& bg_color)
     : writer_{nullptr}, window_{}, fg_color_{fg_color}, bg_color_{bg_color},
@@ -16,6 +18,26 @@ Console::Console(const PixelColor& fg_color, const PixelColor& bg_color)
 }
 
 void Console::PutString(const char* s) {
+  if (InterruptsEnabled() && task_manager) {
+    MutexGuard guard{mutex_};
+    PutStringLocked(s);
+    if (layer_manager) {
+      layer_manager->Draw(layer_id_);
+    }
+    return;
+  }
+
+  const bool locked = mutex_.TryLock();
+  PutStringLocked(s);
+  if (layer_manager) {
+    layer_manager->TryDraw(layer_id_);
+  }
+  if (locked) {
+    mutex_.Unlock();
+  }
+}
+
+void Console::PutStringLocked(const char* s) {
   while (*s) {
     if (*s == '\n') {
       Newline();
@@ -26,9 +48,6 @@ void Console::PutString(const char* s) {
     }
     ++s;
   }
-  if (layer_manager) {
-    layer_manager->Draw(layer_id_);
-  }
 }
 
 void Console::SetWriter(PixelWriter* writer) {
@@ -2,6 +2,7 @@
 
 #include <memory>
 #include "graphics.hpp"
+#include "sync.hpp"
 #include "window.hpp"
 
 class Console {
@@ -9,6 +10,11 @@ class Console {
   static const int kRows = 25, kColumns = 80;
 
   Console(const PixelColor& fg_color, const PixelColor& bg_color);
+  /** @brief 文字列を書き込む。
+   *
+   * 割り込み禁止中（例外ハンドラ，スピンロックを持った区間，起動途中の AP）は休止できないので，
+   * ロックが取れなければ排他せずに書き込む。表示が乱れることはあるが止まることはない。
+   */
   void PutString(const char* s);
   void SetWriter(PixelWriter* writer);
   void SetWindow(const std::shared_ptr<Window>& window);
@@ -16,6 +22,7 @@ class Console {
   unsigned int LayerID() const;
 
  private:
+  void PutStringLocked(const char* s);
   void Newline();
   void Refresh();
 
@@ -25,6 +32,8 @@ class Console {
   char buffer_[kRows][kColumns + 1];
   int cursor_row_, cursor_column_;
   unsigned int layer_id_;
+  /** @brief 複数のタスクからの PutString を排他する */
+  Mutex mutex_;
 };
 
 extern Console* console;
@@ -0,0 +1,140 @@
+#include "hpet.hpp"
+
+#include "acpi.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+
+namespace {
+  // レジスタのオフセット
+  const uint64_t kGeneralCapabilities = 0x000;
+  const uint64_t kGeneralConfiguration = 0x010;
+  const uint64_t kMainCounter = 0x0f0;
+  uint64_t TimerConfiguration(int n) { return 0x100 + 0x20 * n; }
+  uint64_t TimerComparator(int n) { return 0x108 + 0x20 * n; }
+  uint64_t TimerFSBRoute(int n) { return 0x110 + 0x20 * n; }
+
+  const uint64_t kCountSize64 = 1u << 13;
+  const uint64_t kEnable = 1u << 0;
+  const uint64_t kLegacyRoute = 1u << 1;
+
+  const uint64_t kTimerIntEnable = 1u << 2;
+  const uint64_t kTimerPeriodic = 1u << 3;
+  const uint64_t kTimerPeriodicCap = 1u << 4;
+  const uint64_t kTimerValueSet = 1u << 6;
+  const uint64_t kTimerFSBEnable = 1u << 14;
+  const uint64_t kTimerFSBCap = 1u << 15;
+
+  const uint64_t kFemtosPerSec = 1'000'000'000'000'000;
+
+  uintptr_t base;
+  uint64_t frequency;
+  bool counter_64;
+  int num_comparators;
+
+  volatile uint64_t& Register(uint64_t offset) {
+    return *reinterpret_cast<volatile uint64_t*>(base + offset);
+  }
+}
+
+namespace hpet {
+
+void Initialize() {
+  const auto table = acpi::hpet_table;
+  if (table == nullptr || table->address_space_id != 0) {
+    Log(kWarn, "HPET is not found: using ACPI PM timer\n");
+    return;
+  }
+
+  base = table->address;
+  const uint64_t cap = Register(kGeneralCapabilities);
+  const uint64_t period_fs = cap >> 32;
+  if (period_fs == 0) {
+    Log(kWarn, "HPET reports zero period: using ACPI PM timer\n");
+    base = 0;
+    return;
+  }
+  frequency = kFemtosPerSec / period_fs;
+  counter_64 = cap & kCountSize64;
+  num_comparators = ((cap >> 8) & 0x1f) + 1;
+
+  for (int n = 0; n < num_comparators; ++n) {
+    StopComparator(n);
+  }
+  Register(kGeneralConfiguration) =
+    (Register(kGeneralConfiguration) & ~kLegacyRoute) | kEnable;
+
+  Log(kWarn, "HPET: %lu kHz, %d comparators, %d-bit counter\n",
+      frequency / 1000, num_comparators, counter_64 ? 64 : 32);
+}
+
+bool Available() {
+  return base != 0;
+}
+
+uint64_t Frequency() {
+  return frequency;
+}
+
+uint64_t ReadCounter() {
+  return Register(kMainCounter);
+}
+
+uint64_t CounterDiff(uint64_t start, uint64_t end) {
+  const uint64_t diff = end - start;
+  return counter_64 ? diff : (diff & 0xffffffffu);
+}
+
+void WaitMicroseconds(unsigned long usec) {
+  const uint64_t wait = frequency * usec / 1'000'000;
+  const uint64_t start = ReadCounter();
+  while (CounterDiff(start, ReadCounter()) < wait);
+}
+
+int NumComparators() {
+  return num_comparators;
+}
+
+bool ComparatorSupportsFSB(int n) {
+  return Register(TimerConfiguration(n)) & kTimerFSBCap;
+}
+
+Error StartComparator(int n, uint64_t ticks, bool periodic,
+                      uint8_t vector, uint32_t apic_id) {
+  if (n < 0 || n >= num_comparators) {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  uint64_t config = Register(TimerConfiguration(n));
+  if ((config & kTimerFSBCap) == 0 ||
+      (periodic && (config & kTimerPeriodicCap) == 0)) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  StopComparator(n);
+
+  // 上位 32 ビットが書き込み先アドレス，下位 32 ビットがデータ（MSI と同じ形式）
+  const auto [ msi_addr, err ] = MSIAddress(apic_id);
+  if (err) {
+    return err;
+  }
+  const uint64_t msi_data = vector; // Fixed, edge
+  Register(TimerFSBRoute(n)) = (static_cast<uint64_t>(msi_addr) << 32) | msi_data;
+
+  config = (config & ~kTimerPeriodic) | kTimerFSBEnable | kTimerIntEnable;
+  if (periodic) {
+    // 周期モードでは 1 回目の書き込みが比較値，2 回目が周期になる
+    Register(TimerConfiguration(n)) = config | kTimerPeriodic | kTimerValueSet;
+    Register(TimerComparator(n)) = ReadCounter() + ticks;
+    Register(TimerComparator(n)) = ticks;
+  } else {
+    Register(TimerConfiguration(n)) = config;
+    Register(TimerComparator(n)) = ReadCounter() + ticks;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void StopComparator(int n) {
+  Register(TimerConfiguration(n)) &=
+    ~(kTimerIntEnable | kTimerPeriodic | kTimerFSBEnable);
+}
+
+} // namespace hpet
@@ -0,0 +1,50 @@
+/**
+ * @file hpet.hpp
+ *
+ * HPET（High Precision Event Timer）のドライバ。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+namespace hpet {
+
+/** @brief acpi::hpet_table が示す HPET を有効にする。acpi::Initialize の後に呼ぶこと。
+ *
+ * HPET がなければ何もせず，Available() は false のままになる。
+ */
+void Initialize();
+/** @brief HPET が使えるなら true */
+bool Available();
+
+/** @brief メインカウンタの周波数（Hz） */
+uint64_t Frequency();
+/** @brief メインカウンタの現在値 */
+uint64_t ReadCounter();
+/** @brief メインカウンタの 2 つの読み取り値の差を，32 ビットカウンタの一周も考慮して返す。 */
+uint64_t CounterDiff(uint64_t start, uint64_t end);
+/** @brief 指定した時間だけメインカウンタを見ながら待つ。 */
+void WaitMicroseconds(unsigned long usec);
+
+/** @brief コンパレータ（タイマ）の数 */
+int NumComparators();
+/** @brief コンパレータ n が FSB（MSI）で割り込みを配送できるなら true */
+bool ComparatorSupportsFSB(int n);
+/** @brief コンパレータ n を動かし，FSB（MSI）で割り込みを発生させる。
+ *
+ * @param n  コンパレータの番号
+ * @param ticks  最初の割り込みまでのメインカウンタのカウント数。periodic なら周期も兼ねる。
+ * @param periodic  true なら ticks ごとに繰り返す
+ * @param vector  割り込みベクタ番号
+ * @param apic_id  割り込みを受ける CPU の Local APIC ID
+ * @return kIndexOutOfRange（n が範囲外），kNotImplemented（FSB 配送，周期モードに非対応）
+ */
+Error StartComparator(int n, uint64_t ticks, bool periodic,
+                      uint8_t vector, uint32_t apic_id);
+/** @brief コンパレータ n の割り込みを止める。 */
+void StopComparator(int n);
+
+} // namespace hpet
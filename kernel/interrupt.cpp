@@ -7,7 +7,12 @@
 #include "interrupt.hpp"
 
 #include "asmfunc.h"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
+#include "softirq.hpp"
 #include "timer.hpp"
 #include "task.hpp"
 
@@ -25,24 +30,99 @@ void SetIDTEntry(InterruptDescriptor& desc,
 }
 
 void NotifyEndOfInterrupt() {
-  volatile auto end_of_interrupt = reinterpret_cast<uint32_t*>(0xfee000b0);
-  *end_of_interrupt = 0;
+  LAPICEndOfInterrupt();
 }
 
 namespace {
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+    IRQTraceScope trace{InterruptVector::kXHCI, frame->rip};
+    RaiseSoftIRQ(SoftIRQ::kXHCI);
     NotifyEndOfInterrupt();
+    RunSoftIRQs();
   }
 
   __attribute__((interrupt))
   void IntHandlerLAPICTimer(InterruptFrame* frame) {
+    IRQTraceScope trace{InterruptVector::kLAPICTimer, frame->rip};
     LAPICTimerOnInterrupt();
   }
+
+  /** @brief 他の CPU が実行キューを変更したことを知らせる CPU 間割り込みのハンドラ． */
+  __attribute__((interrupt))
+  void IntHandlerReschedule(InterruptFrame* frame) {
+    IRQTraceScope trace{InterruptVector::kReschedule, frame->rip};
+    NotifyEndOfInterrupt();
+    task_manager->Reschedule();
+  }
+
+  /** @brief 他の CPU からの TLB 破棄の依頼を知らせる CPU 間割り込みのハンドラ． */
+  __attribute__((interrupt))
+  void IntHandlerTLBFlush(InterruptFrame* frame) {
+    IRQTraceScope trace{InterruptVector::kTLBFlush, frame->rip};
+    ServiceTLBFlush();
+    NotifyEndOfInterrupt();
+  }
+
+  [[noreturn]] void Halt() {
+    while (true) __asm__("hlt");
+  }
+
+  /** @brief #PF（Page Fault）例外ハンドラ．
+   *
+   * スタックがガードページに達した場合も #PF になるので，IST の別スタックで動かす．
+   * 回復はせず，原因を記録して CPU を止める．
+   */
+  __attribute__((interrupt))
+  void IntHandlerPageFault(InterruptFrame* frame, uint64_t error_code) {
+    const uint64_t cr2 = GetCR2();
+    // 直前のスタックポインタのすぐ下で起きたならスタックの溢れ
+    const bool stack_overflow = cr2 < frame->rsp && frame->rsp - cr2 <= kBytesPerFrame;
+    Log(kError, "#PF at %016lx: rip %016lx, rsp %016lx, error %lx%s\n",
+        cr2, frame->rip, frame->rsp, error_code,
+        stack_overflow ? " (stack overflow)" : "");
+    Halt();
+  }
+
+  /** @brief #DF（Double Fault）例外ハンドラ．IST の別スタックで動かす． */
+  __attribute__((interrupt))
+  void IntHandlerDoubleFault(InterruptFrame* frame, uint64_t error_code) {
+    Log(kError, "#DF: rip %016lx, rsp %016lx\n", frame->rip, frame->rsp);
+    Halt();
+  }
+}
+
+/** @brief #NM（Device Not Available）例外ハンドラの本体．
+ *
+ * CR0.TS が立った状態で FPU/SSE 命令が実行されると発生する．
+ * ここで初めて FPU/SSE の状態を現在のタスクのものに入れ替える．
+ *
+ * __attribute__((interrupt)) の関数はプロローグで SSE レジスタを退避するので，
+ * TS が立ったままだと #NM が再帰する．そのため入口は asmfunc.asm の
+ * IntHandlerDeviceNotAvailable に置き，CR0.TS を下ろして割り込まれた時点の状態を
+ * fxsave_area に退避してからこの関数を呼ぶ．
+ *
+ * @return 例外から戻る前に FXRSTOR する領域
+ */
+extern "C" const void* DeviceNotAvailableOnInterrupt(const void* fxsave_area,
+                                                     uint64_t rip) {
+  IRQTraceScope trace{InterruptVector::kDeviceNotAvailable, rip};
+  return task_manager->SwitchFPU(fxsave_area);
 }
 
 void InitializeInterrupt() {
+  SetIDTEntry(idt[InterruptVector::kDoubleFault],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForDoubleFault),
+              reinterpret_cast<uint64_t>(IntHandlerDoubleFault),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kPageFault],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForPageFault),
+              reinterpret_cast<uint64_t>(IntHandlerPageFault),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kDeviceNotAvailable],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerDeviceNotAvailable),
+              kKernelCS);
   SetIDTEntry(idt[InterruptVector::kXHCI],
               MakeIDTAttr(DescriptorType::kInterruptGate, 0),
               reinterpret_cast<uint64_t>(IntHandlerXHCI),
@@ -51,5 +131,13 @@ void InitializeInterrupt() {
               MakeIDTAttr(DescriptorType::kInterruptGate, 0),
               reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
               kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kReschedule],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerReschedule),
+              kKernelCS);
+  SetIDTEntry(idt[InterruptVector::kTLBFlush],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerTLBFlush),
+              kKernelCS);
   LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
@@ -10,6 +10,7 @@
 #include <cstdint>
 #include <deque>
 
+#include "irqtrace.hpp"
 #include "x86_descriptor.hpp"
 #include "message.hpp"
 
@@ -57,8 +58,13 @@ void SetIDTEntry(InterruptDescriptor& desc,
 class InterruptVector {
  public:
   enum Number {
+    kDeviceNotAvailable = 0x07,
+    kDoubleFault = 0x08,
+    kPageFault = 0x0e,
     kXHCI = 0x40,
     kLAPICTimer = 0x41,
+    kReschedule = 0x42,
+    kTLBFlush = 0x43,
   };
 };
 
@@ -72,4 +78,38 @@ struct InterruptFrame {
 
 void NotifyEndOfInterrupt();
 
+/** @brief 割り込みが許可されている（RFLAGS.IF が立っている）なら true． */
+inline bool InterruptsEnabled() {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpop %0" : "=r"(rflags));
+  return rflags & 0x200;
+}
+
+/** @brief スコープの間だけ割り込みを禁止する．
+ *
+ * 生成時の RFLAGS.IF を保存してから割り込みを禁止し，破棄時に元の状態へ戻す．
+ * 割り込みハンドラ内（既に割り込み禁止）で使っても安全である．
+ * IRQ_TRACE を定義したビルドでは，割り込みを禁止していた時間を計測する．
+ */
+class InterruptGuard {
+ public:
+  InterruptGuard() {
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags_) :: "memory");
+    if (rflags_ & 0x200) {
+      IRQTraceIRQsOff(IRQTraceRIP());
+    }
+  }
+  ~InterruptGuard() {
+    if (rflags_ & 0x200) {
+      IRQTraceIRQsOn();
+      __asm__ volatile("sti" ::: "memory");
+    }
+  }
+  InterruptGuard(const InterruptGuard&) = delete;
+  InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+ private:
+  uint64_t rflags_;
+};
+
 void InitializeInterrupt();
@@ -0,0 +1,155 @@
+#include "irqtrace.hpp"
+
+#ifdef IRQ_TRACE
+
+#include <array>
+#include <cstdio>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+#include "tsc.hpp"
+
+namespace {
+  /** @brief 計測した区間の分布と最悪値 */
+  struct Span {
+    LatencyHistogram histogram;
+    uint64_t max;
+    /** @brief 最悪値を記録した区間の RIP */
+    uint64_t max_rip;
+
+    void Add(uint64_t cycles, uint64_t rip) {
+      histogram.Add(cycles);
+      if (cycles > max) {
+        max = cycles;
+        max_rip = rip;
+      }
+    }
+  };
+
+  /** @brief CPU ごとの計測中の区間 */
+  struct CPUTrace {
+    bool in_handler;
+    uint8_t vector;
+    uint64_t handler_rip;
+    uint64_t handler_start;
+
+    bool irqs_off;
+    uint64_t off_rip;
+    uint64_t off_start;
+  };
+
+  std::array<CPUTrace, kMaxCPUs> cpus{};
+  /** @brief 以下の統計を守る。割り込み禁止の状態でしか取らない。 */
+  SpinLock trace_lock;
+  std::array<Span, 256> handlers{};
+  Span irqs_off;
+  /** @brief LAPIC タイマ割り込みが予定より遅れた時間 */
+  Span timer_lateness;
+  /** @brief LAPIC タイマ割り込みが予定より早く来た回数 */
+  uint64_t timer_early;
+
+  void AddSpan(Span& span, uint64_t cycles, uint64_t rip) {
+    trace_lock.Lock();
+    span.Add(cycles, rip);
+    trace_lock.Unlock();
+  }
+
+  void EndHandler(CPUTrace& cpu) {
+    cpu.in_handler = false;
+    AddSpan(handlers[cpu.vector], ReadTSC() - cpu.handler_start, cpu.handler_rip);
+  }
+
+  void PrintSpan(const char* name, const Span& span) {
+    const uint64_t total = span.histogram.Total();
+    if (total == 0) {
+      return;
+    }
+    Log(kWarn, "%-12s %8lu %7lu %7lu %7lu  %016lx\n", name, total,
+        TSCToNs(span.histogram.Percentile(50)),
+        TSCToNs(span.histogram.Percentile(99)),
+        TSCToNs(span.max), span.max_rip);
+  }
+}
+
+bool IRQTraceEnter(uint8_t vector, uint64_t rip) {
+  auto& cpu = cpus[CurrentCPU()];
+  if (cpu.in_handler) {
+    return false;
+  }
+  cpu.in_handler = true;
+  cpu.vector = vector;
+  cpu.handler_rip = rip;
+  cpu.handler_start = ReadTSC();
+  return true;
+}
+
+void IRQTraceExit() {
+  auto& cpu = cpus[CurrentCPU()];
+  if (cpu.in_handler) {
+    EndHandler(cpu);
+  }
+}
+
+void IRQTraceContextSwitch() {
+  // 切り替え先から戻るまでの時間はハンドラの実行時間に含めない
+  auto& cpu = cpus[CurrentCPU()];
+  if (cpu.in_handler) {
+    EndHandler(cpu);
+  }
+}
+
+void IRQTraceIRQsOff(uint64_t rip) {
+  auto& cpu = cpus[CurrentCPU()];
+  cpu.irqs_off = true;
+  cpu.off_rip = rip;
+  cpu.off_start = ReadTSC();
+}
+
+void IRQTraceIRQsOn() {
+  // 禁止したタスクと許可するタスクが違っても（タスク切り替えを挟んでも），
+  // この CPU で割り込みが禁止されていた区間として数える
+  auto& cpu = cpus[CurrentCPU()];
+  if (cpu.irqs_off) {
+    cpu.irqs_off = false;
+    AddSpan(irqs_off, ReadTSC() - cpu.off_start, cpu.off_rip);
+  }
+}
+
+void IRQTraceTimerFired(uint64_t expected_tsc) {
+  const uint64_t now = ReadTSC();
+  if (expected_tsc == 0) {
+    return;
+  }
+  trace_lock.Lock();
+  if (now < expected_tsc) {
+    ++timer_early;
+  } else {
+    timer_lateness.Add(now - expected_tsc, cpus[CurrentCPU()].handler_rip);
+  }
+  trace_lock.Unlock();
+}
+
+void IRQTraceReport() {
+  InterruptGuard guard;
+  trace_lock.Lock();
+  const auto handlers_copy = handlers;
+  const auto irqs_off_copy = irqs_off;
+  const auto lateness_copy = timer_lateness;
+  const uint64_t early = timer_early;
+  trace_lock.Unlock();
+
+  Log(kWarn, "span            count  p50 ns  p99 ns  max ns  max rip\n");
+  char name[16];
+  for (int v = 0; v < 256; ++v) {
+    sprintf(name, "vector 0x%02x", v);
+    PrintSpan(name, handlers_copy[v]);
+  }
+  PrintSpan("irqs off", irqs_off_copy);
+  PrintSpan("timer late", lateness_copy);
+  Log(kWarn, "timer early: %lu\n", early);
+}
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * @file irqtrace.hpp
+ *
+ * 割り込みハンドラの実行時間と割り込み禁止区間の長さを TSC で測る仕組み。
+ *
+ * IRQ_TRACE を定義してビルドしたときだけ有効になる（make IRQ_TRACE=1）。
+ * 定義しなければ各関数は空のインライン関数になり，コードは生成されない。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#ifdef IRQ_TRACE
+
+/** @brief 割り込みハンドラの入口で呼ぶ。rip は割り込まれた命令のアドレス。
+ *
+ * @return この呼び出しが計測を始めたら true（ネストした例外などでは false）
+ */
+bool IRQTraceEnter(uint8_t vector, uint64_t rip);
+/** @brief IRQTraceEnter が true を返したハンドラの出口で呼ぶ。 */
+void IRQTraceExit();
+/** @brief ハンドラからタスクを切り替える直前に呼ぶ。実行中のハンドラの計測をここで終える。 */
+void IRQTraceContextSwitch();
+
+/** @brief 割り込みを許可された状態から禁止したときに呼ぶ。rip は禁止した場所。 */
+void IRQTraceIRQsOff(uint64_t rip);
+/** @brief 割り込みを再び許可する直前に呼ぶ。 */
+void IRQTraceIRQsOn();
+
+/** @brief LAPIC タイマ割り込みが来たときに，割り込みが来るはずだった時刻（TSC）を渡す。 */
+void IRQTraceTimerFired(uint64_t expected_tsc);
+
+/** @brief これまでの計測結果を表示する。 */
+void IRQTraceReport();
+
+/** @brief 現在の命令のアドレス */
+inline uint64_t IRQTraceRIP() {
+  uint64_t rip;
+  __asm__ volatile("lea 0(%%rip), %0" : "=r"(rip));
+  return rip;
+}
+
+#else
+
+inline bool IRQTraceEnter(uint8_t, uint64_t) { return false; }
+inline void IRQTraceExit() {}
+inline void IRQTraceContextSwitch() {}
+inline void IRQTraceIRQsOff(uint64_t) {}
+inline void IRQTraceIRQsOn() {}
+inline void IRQTraceTimerFired(uint64_t) {}
+inline void IRQTraceReport() {}
+inline uint64_t IRQTraceRIP() { return 0; }
+
+#endif
+
+/** @brief 割り込みハンドラの本体をこのオブジェクトのスコープに入れて実行時間を測る。 */
+class IRQTraceScope {
+ public:
+  IRQTraceScope(uint8_t vector, uint64_t rip)
+    : owner_{IRQTraceEnter(vector, rip)} {
+  }
+  ~IRQTraceScope() {
+    if (owner_) {
+      IRQTraceExit();
+    }
+  }
+  IRQTraceScope(const IRQTraceScope&) = delete;
+  IRQTraceScope& operator=(const IRQTraceScope&) = delete;
+
+ private:
+  bool owner_;
+};
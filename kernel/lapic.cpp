@@ -0,0 +1,106 @@
+#include "lapic.hpp"
+
+#include "asmfunc.h"
+
+namespace {
+  const uint32_t kMSRAPICBase = 0x1b;
+  const uint64_t kAPICBaseX2APICEnable = 1u << 10;
+  const uint64_t kAPICBaseGlobalEnable = 1u << 11;
+  /** @brief x2APIC のレジスタが並ぶ MSR の先頭 */
+  const uint32_t kX2APICMSRBase = 0x800;
+  const uintptr_t kXAPICBase = 0xfee00000;
+
+  const uint32_t kAPICSoftwareEnable = 1u << 8;
+  const uint32_t kICRDeliveryStatus = 1u << 12;
+  const uint32_t kCPUIDX2APIC = 1u << 21; // CPUID.01h:ECX
+
+  bool probed = false;
+  bool x2apic = false;
+
+  volatile uint32_t& XAPICRegister(LAPICRegister reg) {
+    return *reinterpret_cast<volatile uint32_t*>(
+        kXAPICBase + static_cast<uint32_t>(reg));
+  }
+
+  uint32_t X2APICMSR(LAPICRegister reg) {
+    return kX2APICMSRBase + (static_cast<uint32_t>(reg) >> 4);
+  }
+}
+
+void InitializeLocalAPIC() {
+  if (!probed) {
+    // 最初に呼ぶのは BSP。AP は BSP と同じモードに揃える。
+    probed = true;
+    uint32_t regs[4];
+    ReadCPUID(1, 0, regs);
+    x2apic = regs[2] & kCPUIDX2APIC;
+  }
+
+  if (x2apic) {
+    // xAPIC から x2APIC へは，グローバル有効のまま EXTD ビットを立てるだけで移れる
+    const uint64_t base = ReadMSR(kMSRAPICBase);
+    WriteMSR(kMSRAPICBase, base | kAPICBaseGlobalEnable | kAPICBaseX2APICEnable);
+  }
+
+  WriteLAPIC(LAPICRegister::kSpuriousInterruptVector,
+             ReadLAPIC(LAPICRegister::kSpuriousInterruptVector) | kAPICSoftwareEnable);
+}
+
+bool X2APICEnabled() {
+  return x2apic;
+}
+
+uint32_t ReadLAPIC(LAPICRegister reg) {
+  if (x2apic) {
+    return ReadMSR(X2APICMSR(reg));
+  }
+  return XAPICRegister(reg);
+}
+
+void WriteLAPIC(LAPICRegister reg, uint32_t value) {
+  if (x2apic) {
+    WriteMSR(X2APICMSR(reg), value);
+    return;
+  }
+  XAPICRegister(reg) = value;
+}
+
+uint32_t LocalAPICID() {
+  if (x2apic) {
+    return ReadMSR(X2APICMSR(LAPICRegister::kID));
+  }
+  return XAPICRegister(LAPICRegister::kID) >> 24;
+}
+
+void LAPICEndOfInterrupt() {
+  WriteLAPIC(LAPICRegister::kEOI, 0);
+}
+
+void SendLAPICIPI(uint32_t apic_id, uint32_t command) {
+  if (x2apic) {
+    // x2APIC の MSR への書き込みは命令の順序を保証しないので，
+    // 先行するメモリへの書き込みが相手の CPU から見えるようにしてから送る
+    __asm__ volatile("mfence; lfence" ::: "memory");
+    WriteMSR(X2APICMSR(LAPICRegister::kICR),
+             (static_cast<uint64_t>(apic_id) << 32) | command);
+    return;
+  }
+
+  volatile uint32_t& icr_low = XAPICRegister(LAPICRegister::kICR);
+  volatile uint32_t& icr_high = *(&icr_low + 4); // ICR の上位 32 ビットは 0x310
+  while (icr_low & kICRDeliveryStatus) {
+    __asm__("pause");
+  }
+  icr_high = apic_id << 24;
+  icr_low = command;
+  while (icr_low & kICRDeliveryStatus) {
+    __asm__("pause");
+  }
+}
+
+WithError<uint32_t> MSIAddress(uint32_t apic_id) {
+  if (apic_id > 0xff) {
+    return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+  }
+  return {0xfee00000u | (apic_id << 12), MAKE_ERROR(Error::kSuccess)};
+}
@@ -0,0 +1,58 @@
+/**
+ * @file lapic.hpp
+ *
+ * Local APIC のレジスタを xAPIC（MMIO）と x2APIC（MSR）のどちらのモードでも同じように扱う。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief Local APIC のレジスタ。値は xAPIC モードでの MMIO のオフセット。
+ *
+ * x2APIC モードでは MSR 0x800 + (オフセット >> 4) に対応する。
+ */
+enum class LAPICRegister : uint32_t {
+  kID = 0x020,
+  kEOI = 0x0b0,
+  kSpuriousInterruptVector = 0x0f0,
+  kICR = 0x300,
+  kLVTTimer = 0x320,
+  kInitialCount = 0x380,
+  kCurrentCount = 0x390,
+  kDivideConfig = 0x3e0,
+};
+
+/** @brief 実行中の CPU の Local APIC を有効にする。各 CPU で 1 回ずつ呼ぶ。
+ *
+ * BSP で最初に呼んだときに CPUID で x2APIC に対応しているかを調べ，
+ * 対応していれば以降はすべての CPU を x2APIC モードで動かす。
+ */
+void InitializeLocalAPIC();
+/** @brief x2APIC モードで動いていれば true */
+bool X2APICEnabled();
+
+uint32_t ReadLAPIC(LAPICRegister reg);
+void WriteLAPIC(LAPICRegister reg, uint32_t value);
+
+/** @brief 実行中の CPU の Local APIC ID。x2APIC モードでは 32 ビットの ID。
+ *
+ * newlib_support.c の malloc ロックからも呼ぶので C リンケージにする。
+ */
+extern "C" uint32_t LocalAPICID();
+/** @brief 割り込み処理の終了（EOI）を通知する。 */
+void LAPICEndOfInterrupt();
+/** @brief 指定した Local APIC ID の CPU に物理宛先モードで CPU 間割り込みを送る。
+ *
+ * @param command  ICR の下位 32 ビット（配送モード，ベクタ番号など）
+ */
+void SendLAPICIPI(uint32_t apic_id, uint32_t command);
+
+/** @brief apic_id の CPU を宛先とする MSI のメッセージアドレスを作る。
+ *
+ * 宛先フィールドは 8 ビットなので，割り込みリマッピングなしでは
+ * 255 を超える x2APIC ID を宛先にできない。その場合は kIndexOutOfRange を返す。
+ */
+WithError<uint32_t> MSIAddress(uint32_t apic_id);
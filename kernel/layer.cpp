@@ -4,6 +4,31 @@
 #include "console.hpp"
 #include "logger.hpp"
 
+namespace {
+  /** @brief プールに確保しておくレイヤーの数 */
+  const size_t kPooledLayers = 64;
+  ObjectPool<Layer, kPooledLayers> layer_pool;
+}
+
+void* Layer::operator new(size_t size) {
+  if (void* p = layer_pool.Allocate()) {
+    return p;
+  }
+  return ::operator new(size);
+}
+
+void Layer::operator delete(void* p) noexcept {
+  if (layer_pool.Contains(p)) {
+    layer_pool.Free(p);
+  } else {
+    ::operator delete(p);
+  }
+}
+
+ObjectPoolStats Layer::PoolStats() {
+  return layer_pool.GetStats();
+}
+
 Layer::Layer(unsigned int id) : id_{id} {
 }
 
@@ -59,18 +84,38 @@ void LayerManager::SetWriter(FrameBuffer* screen) {
 }
 
 Layer& LayerManager::NewLayer() {
+  MutexGuard guard{mutex_};
   ++latest_id_;
   return *layers_.emplace_back(new Layer{latest_id_});
 }
 
 void LayerManager::Draw(const Rectangle<int>& area) const {
+  MutexGuard guard{mutex_};
+  DrawLocked(area);
+}
+
+void LayerManager::Draw(unsigned int id) const {
+  MutexGuard guard{mutex_};
+  DrawLocked(id);
+}
+
+bool LayerManager::TryDraw(unsigned int id) const {
+  if (!mutex_.TryLock()) {
+    return false;
+  }
+  DrawLocked(id);
+  mutex_.Unlock();
+  return true;
+}
+
+void LayerManager::DrawLocked(const Rectangle<int>& area) const {
   for (auto layer : layer_stack_) {
     layer->DrawTo(back_buffer_, area);
   }
   screen_->Copy(area.pos, back_buffer_, area);
 }
 
-void LayerManager::Draw(unsigned int id) const {
+void LayerManager::DrawLocked(unsigned int id) const {
   bool draw = false;
   Rectangle<int> window_area;
   for (auto layer : layer_stack_) {
@@ -87,26 +132,29 @@ void LayerManager::Draw(unsigned int id) const {
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
+  MutexGuard guard{mutex_};
   auto layer = FindLayer(id);
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
   layer->Move(new_pos);
-  Draw({old_pos, window_size});
-  Draw(id);
+  DrawLocked({old_pos, window_size});
+  DrawLocked(id);
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
+  MutexGuard guard{mutex_};
   auto layer = FindLayer(id);
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
   layer->MoveRelative(pos_diff);
-  Draw({old_pos, window_size});
-  Draw(id);
+  DrawLocked({old_pos, window_size});
+  DrawLocked(id);
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height) {
+  MutexGuard guard{mutex_};
   if (new_height < 0) {
-    Hide(id);
+    HideLocked(id);
     return;
   }
   if (new_height > layer_stack_.size()) {
@@ -130,6 +178,11 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
 }
 
 void LayerManager::Hide(unsigned int id) {
+  MutexGuard guard{mutex_};
+  HideLocked(id);
+}
+
+void LayerManager::HideLocked(unsigned int id) {
   auto layer = FindLayer(id);
   auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
   if (pos != layer_stack_.end()) {
@@ -138,6 +191,7 @@ void LayerManager::Hide(unsigned int id) {
 }
 
 Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const {
+  MutexGuard guard{mutex_};
   auto pred = [pos, exclude_id](Layer* layer) {
     if (layer->ID() == exclude_id) {
       return false;
@@ -11,6 +11,8 @@
 #include <vector>
 
 #include "graphics.hpp"
+#include "object_pool.hpp"
+#include "sync.hpp"
 #include "window.hpp"
 
 /** @brief Layer は 1 つの層を表す。
@@ -20,6 +22,12 @@
  */
 class Layer {
  public:
+  /** @brief レイヤーの領域はプールから割り当てる。プールを使い切ったら一般のヒープを使う。 */
+  static void* operator new(size_t size);
+  static void operator delete(void* p) noexcept;
+  /** @brief レイヤー用のプールの統計情報 */
+  static ObjectPoolStats PoolStats();
+
   /** @brief 指定された ID を持つレイヤーを生成する。 */
   Layer(unsigned int id = 0);
   /** @brief このインスタンスの ID を返す。 */
@@ -51,7 +59,11 @@ class Layer {
   bool draggable_{false};
 };
 
-/** @brief LayerManager は複数のレイヤーを管理する。 */
+/** @brief LayerManager は複数のレイヤーを管理する。
+ *
+ * 各メソッドは内部の Mutex で排他するので，複数のタスクから同時に呼び出せる。
+ * 割り込みハンドラから呼び出してはならない。
+ */
 class LayerManager {
  public:
   /** @brief Draw メソッドなどで描画する際の描画先を設定する。 */
@@ -66,6 +78,12 @@ class LayerManager {
   void Draw(const Rectangle<int>& area) const;
   /** @brief 指定したレイヤーに設定されているウィンドウの描画領域内を再描画する。 */
   void Draw(unsigned int id) const;
+  /** @brief 休止せずに Draw(id) する。
+   *
+   * 割り込み禁止中など休止できないところから使う。
+   * ロックが取れなければ描画せずに false を返す。
+   */
+  bool TryDraw(unsigned int id) const;
 
   /** @brief レイヤーの位置情報を指定された絶対座標へと更新する。再描画する。 */
   void Move(unsigned int id, Vector2D<int> new_pos);
@@ -92,7 +110,14 @@ class LayerManager {
   std::vector<Layer*> layer_stack_{};
   unsigned int latest_id_{0};
 
+  /** @brief layers_ と layer_stack_，back_buffer_ を守るロック */
+  mutable Mutex mutex_;
+
   Layer* FindLayer(unsigned int id);
+  // 以下は mutex_ をロックした状態で呼ぶ
+  void DrawLocked(const Rectangle<int>& area) const;
+  void DrawLocked(unsigned int id) const;
+  void HideLocked(unsigned int id);
 };
 
 extern LayerManager* layer_manager;
@@ -1,5 +1,4 @@
 #include <new>
-#include <cerrno>
 
 int printk(const char* format, ...);
 
@@ -9,7 +8,3 @@ std::new_handler std::get_new_handler() noexcept {
     exit(1);
   };
 }
-
-extern "C" int posix_memalign(void**, size_t, size_t) {
-  return ENOMEM;
-}
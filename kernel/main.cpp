@@ -21,19 +21,27 @@
 #include "console.hpp"
 #include "pci.hpp"
 #include "logger.hpp"
+#include "usb/memory.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "interrupt.hpp"
+#include "lapic.hpp"
 #include "asmfunc.h"
 #include "segment.hpp"
 #include "paging.hpp"
 #include "memory_manager.hpp"
+#include "slab.hpp"
+#include "stack_pool.hpp"
 #include "window.hpp"
 #include "layer.hpp"
 #include "message.hpp"
 #include "timer.hpp"
+#include "tsc.hpp"
 #include "acpi.hpp"
+#include "hpet.hpp"
 #include "keyboard.hpp"
 #include "task.hpp"
+#include "smp.hpp"
+#include "softirq.hpp"
 
 int printk(const char* format, ...) {
   va_list ap;
@@ -144,12 +152,77 @@ void TaskB(uint64_t task_id, int64_t data) {
   }
 }
 
+std::shared_ptr<Window> top_window;
+unsigned int top_window_layer_id;
+const int kTopRows = 8;
+void InitializeTopWindow() {
+  top_window = std::make_shared<Window>(
+      8 * 40 + 16, 24 + 16 * (kTopRows + 1) + 8, screen_config.pixel_format);
+  DrawWindow(*top_window->Writer(), "Top");
+
+  top_window_layer_id = layer_manager->NewLayer()
+    .SetWindow(top_window)
+    .SetDraggable(true)
+    .Move({500, 300})
+    .ID();
+
+  layer_manager->UpDown(top_window_layer_id, std::numeric_limits<int>::max());
+}
+
+/** @brief 前回から今回までの各タスクの CPU 使用率などを Top ウィンドウに描画する。 */
+void DrawTopWindow() {
+  static std::array<TaskStats, kTopRows> prev_stats;
+  static size_t num_prev = 0;
+  static uint64_t prev_tsc = 0;
+
+  std::array<TaskStats, kTopRows> stats;
+  const size_t num_stats = task_manager->GetStats(stats.data(), stats.size());
+  const uint64_t now = ReadTSC();
+  const uint64_t elapsed = now - prev_tsc;
+
+  auto& writer = *top_window->Writer();
+  FillRectangle(writer, {8, 24}, {8 * 40, 16 * (kTopRows + 1)}, {0xc6, 0xc6, 0xc6});
+  WriteString(writer, {8, 24}, " ID LV CPU  %CPU    VOL  INVOL LAT50us", {0, 0, 0});
+
+  char line[64];
+  for (size_t i = 0; i < num_stats; ++i) {
+    const auto& s = stats[i];
+    uint64_t prev_runtime = 0;
+    for (size_t j = 0; j < num_prev; ++j) {
+      if (prev_stats[j].id == s.id) {
+        prev_runtime = prev_stats[j].runtime;
+      }
+    }
+    // 0.1% 単位
+    const uint64_t permille = prev_tsc == 0 || elapsed == 0 ?
+      0 : (s.runtime - prev_runtime) * 1000 / elapsed;
+    sprintf(line, "%3lu %2d %3c %3lu.%lu %6lu %6lu %7lu",
+            s.id, s.level, s.on_cpu >= 0 ? '0' + s.on_cpu : (s.running ? 'R' : 'S'),
+            permille / 10, permille % 10,
+            s.voluntary_switches, s.involuntary_switches,
+            TSCToNs(s.wakeup_latency.Percentile(50)) / 1000);
+    WriteString(writer, {8, 24 + 16 * static_cast<int>(i + 1)}, line, {0, 0, 0});
+  }
+
+  prev_stats = stats;
+  num_prev = num_stats;
+  prev_tsc = now;
+  layer_manager->Draw(top_window_layer_id);
+}
+
+/** @brief Top ウィンドウを 1 秒ごとに更新するタイマのコールバック。ソフト割り込み用のタスクで動く。 */
+void TopWindowTimer(unsigned long timeout, int value) {
+  DrawTopWindow();
+  timer_manager->AddTimer(Timer{timeout + kTimerFreq, value, TopWindowTimer});
+}
+
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 
 extern "C" void KernelMainNewStack(
     const FrameBufferConfig& frame_buffer_config_ref,
     const MemoryMap& memory_map_ref,
     const acpi::RSDP& acpi_table) {
+  InitializeCPULocal(kBSPCPU);
   MemoryMap memory_map{memory_map_ref};
 
   InitializeGraphics(frame_buffer_config_ref);
@@ -161,7 +234,14 @@ extern "C" void KernelMainNewStack(
   InitializeSegmentation();
   InitializePaging();
   InitializeMemoryManager(memory_map);
+  InitializeSlabAllocator();
+  InitializeStackPool();
+  if (auto err = InitializeTSS(kBSPCPU)) {
+    Log(kError, "failed to initialize TSS: %s\n", err.Name());
+    exit(1);
+  }
   InitializeInterrupt();
+  InitializeLocalAPIC();
 
   InitializePCI();
 
@@ -169,76 +249,93 @@ extern "C" void KernelMainNewStack(
   InitializeMainWindow();
   InitializeTextWindow();
   InitializeTaskBWindow();
+  InitializeTopWindow();
   layer_manager->Draw({{0, 0}, ScreenSize()});
 
   acpi::Initialize(acpi_table);
+  // ローダから受け取ったものはここまでで使い終わる
+  ReclaimBootMemory(memory_map);
+  hpet::Initialize();
+  InitializeTSC();
   InitializeLAPICTimer();
 
-  const int kTextboxCursorTimer = 1;
-  const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
-  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer});
-  bool textbox_cursor_visible = false;
-
   // #@@range_begin(init_tasks)
   InitializeTask();
   Task& main_task = task_manager->CurrentTask();
-  const uint64_t taskb_id = task_manager->NewTask()
-    .InitContext(TaskB, 45)
-    .Wakeup()
-    .ID();
+  InitializeSoftIRQ();
+  auto [ taskb, taskb_err ] = task_manager->NewTask(TaskB, 45, 16_KiB); // sprintf を使うので大きめに取る
+  if (taskb_err) {
+    Log(kError, "failed to create TaskB: %s\n", taskb_err.Name());
+    exit(1);
+  }
+  const uint64_t taskb_id = taskb->Wakeup().ID();
   // #@@range_end(init_tasks)
 
+  const int kTextboxCursorTimer = 1;
+  const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
+  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, main_task.ID()});
+  bool textbox_cursor_visible = false;
+  timer_manager->AddTimer(Timer{kTimerFreq, 0, TopWindowTimer});
+
+  InitializeSMP();
+
   usb::xhci::Initialize();
+  RegisterSoftIRQ(SoftIRQ::kXHCI, usb::xhci::ProcessEvents, true);
   InitializeKeyboard();
   InitializeMouse();
 
   char str[128];
+  // 1 回の起床で溜まっているメッセージをまとめて処理する
+  std::array<Message, 16> msgs;
 
   while (true) {
-    __asm__("cli");
     const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
 
     sprintf(str, "%010lu", tick);
     FillRectangle(*main_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
     WriteString(*main_window->Writer(), {24, 28}, str, {0, 0, 0});
     layer_manager->Draw(main_window_layer_id);
 
-    __asm__("cli");
-    auto msg = main_task.ReceiveMessage();
-    if (!msg) {
-      main_task.Sleep();
-      __asm__("sti");
-      continue;
-    }
-
-    __asm__("sti");
-
-    switch (msg->type) {
-    case Message::kInterruptXHCI:
-      usb::xhci::ProcessEvents();
-      break;
-    case Message::kTimerTimeout:
-      if (msg->arg.timer.value == kTextboxCursorTimer) {
-        __asm__("cli");
-        timer_manager->AddTimer(
-            Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer});
-        __asm__("sti");
-        textbox_cursor_visible = !textbox_cursor_visible;
-        DrawTextCursor(textbox_cursor_visible);
-        layer_manager->Draw(text_window_layer_id);
-      }
-      break;
-    case Message::kKeyPush:
-      InputTextWindow(msg->arg.keyboard.ascii);
-      if (msg->arg.keyboard.ascii == 's') {
-        printk("sleep TaskB: %s\n", task_manager->Sleep(taskb_id).Name());
-      } else if (msg->arg.keyboard.ascii == 'w') {
-        printk("wakeup TaskB: %s\n", task_manager->Wakeup(taskb_id).Name());
+    const size_t num_msgs = main_task.WaitMessages(msgs.data(), msgs.size());
+
+    for (size_t i = 0; i < num_msgs; ++i) {
+      const Message* msg = &msgs[i];
+      switch (msg->type) {
+      case Message::kTimerTimeout:
+        if (msg->arg.timer.value == kTextboxCursorTimer) {
+          timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05Sec,
+                                        kTextboxCursorTimer, main_task.ID()});
+          textbox_cursor_visible = !textbox_cursor_visible;
+          DrawTextCursor(textbox_cursor_visible);
+          layer_manager->Draw(text_window_layer_id);
+        }
+        break;
+      case Message::kKeyPush:
+        InputTextWindow(msg->arg.keyboard.ascii);
+        if (msg->arg.keyboard.ascii == 's') {
+          printk("sleep TaskB: %s\n", task_manager->Sleep(taskb_id).Name());
+        } else if (msg->arg.keyboard.ascii == 'w') {
+          printk("wakeup TaskB: %s\n", task_manager->Wakeup(taskb_id).Name());
+        } else if (msg->arg.keyboard.ascii == 'p') {
+          task_manager->ReportStackUsage();
+        } else if (msg->arg.keyboard.ascii == 'i') {
+          IRQTraceReport();
+        } else if (msg->arg.keyboard.ascii == 'h') {
+          slab_allocator->Report();
+          LogObjectPoolStats("Layer", Layer::PoolStats());
+          LogObjectPoolStats("Task", Task::PoolStats());
+          LogObjectPoolStats("Message", Task::MessagePoolStats());
+          LogObjectPoolStats("TimerNode", timer_manager->NodePoolStats());
+          usb::ReportMem();
+        } else if (msg->arg.keyboard.ascii == 'm') {
+          const bool mlfq = task_manager->Policy() == SchedPolicy::kMLFQ;
+          task_manager->SetPolicy(mlfq ? SchedPolicy::kRoundRobin : SchedPolicy::kMLFQ);
+          printk("scheduler: %s\n", mlfq ? "round robin" : "MLFQ");
+        }
+        break;
+      default:
+        Log(kError, "Unknown message type: %d\n", msg->type);
       }
-      break;
-    default:
-      Log(kError, "Unknown message type: %d\n", msg->type);
     }
   }
 }
@@ -1,53 +1,91 @@
 #include "memory_manager.hpp"
 
+#include <algorithm>
+
 #include "logger.hpp"
+#include "spinlock.hpp"
 
-BitmapMemoryManager::BitmapMemoryManager()
-  : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+size_t BitmapMemoryManager::MapBytes(size_t frame_count) {
+  const size_t full_lines = (frame_count + kFramesPerFullLine - 1) / kFramesPerFullLine;
+  return (full_lines * kBitsPerMapLine + full_lines) * sizeof(MapLineType);
 }
 
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-  size_t start_frame_id = range_begin_.ID();
-  while (true) {
-    size_t i = 0;
-    for (; i < num_frames; ++i) {
-      if (start_frame_id + i >= range_end_.ID()) {
-        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-      }
-      if (GetBit(FrameID{start_frame_id + i})) {
-        // "start_frame_id + i" にあるフレームは割り当て済み
-        break;
-      }
-    }
-    if (i == num_frames) {
-      // num_frames 分の空きが見つかった
-      MarkAllocated(FrameID{start_frame_id}, num_frames);
-      return {
-        FrameID{start_frame_id},
-        MAKE_ERROR(Error::kSuccess),
-      };
-    }
-    // 次のフレームから再検索
-    start_frame_id += i + 1;
+BitmapMemoryManager::BitmapMemoryManager(size_t frame_count, void* map_buf)
+  : frame_count_{frame_count},
+    map_line_count_{(frame_count + kFramesPerFullLine - 1) / kFramesPerFullLine * kBitsPerMapLine},
+    alloc_map_{reinterpret_cast<MapLineType*>(map_buf)},
+    full_map_{alloc_map_ + map_line_count_}, hint_line_{0},
+    range_begin_{FrameID{0}}, range_end_{FrameID{frame_count}} {
+  std::fill(alloc_map_, full_map_ + map_line_count_ / kBitsPerMapLine, 0);
+  // 要素数の切り上げで増えたビットは存在しないフレームなので使用中にしておく
+  SetBits(frame_count_, map_line_count_ * kBitsPerMapLine, true);
+}
+
+WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames, FrameID limit) {
+  const size_t hint_frame = hint_line_ * kBitsPerMapLine;
+  const size_t first_free = FindFree(std::max(range_begin_.ID(), hint_frame));
+  // 最初の空きフレームより前の要素は全フレームが使用中
+  hint_line_ = first_free / kBitsPerMapLine;
+
+  const size_t start_frame_id =
+    num_frames <= 1 ? first_free : FindRun(first_free, num_frames);
+  // first-fit なので，最初に見つかった領域が limit を超えれば limit 未満に空きはない
+  const size_t end = std::min(range_end_.ID(), limit.ID());
+  if (start_frame_id >= end || num_frames > end - start_frame_id) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
   }
+
+  MarkAllocated(FrameID{start_frame_id}, num_frames);
+  return {
+    FrameID{start_frame_id},
+    MAKE_ERROR(Error::kSuccess),
+  };
 }
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, false);
-  }
+  const size_t begin = std::min(start_frame.ID(), frame_count_);
+  SetBits(begin, begin + std::min(num_frames, frame_count_ - begin), false);
+  hint_line_ = std::min(hint_line_, start_frame.ID() / kBitsPerMapLine);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
-  for (size_t i = 0; i < num_frames; ++i) {
-    SetBit(FrameID{start_frame.ID() + i}, true);
+  const size_t begin = std::min(start_frame.ID(), frame_count_);
+  SetBits(begin, begin + std::min(num_frames, frame_count_ - begin), true);
+}
+
+bool BitmapMemoryManager::IsFree(FrameID start_frame, size_t num_frames) const {
+  const size_t begin = start_frame.ID();
+  if (begin > frame_count_ || num_frames > frame_count_ - begin) {
+    return false;
   }
+  const size_t end = begin + num_frames;
+  if (begin == end) {
+    return true;
+  }
+
+  const auto all = ~static_cast<MapLineType>(0);
+  const size_t first_line = begin / kBitsPerMapLine;
+  const size_t last_line = (end - 1) / kBitsPerMapLine;
+  for (size_t line = first_line; line <= last_line; ++line) {
+    MapLineType mask = all;
+    if (line == first_line) {
+      mask &= all << (begin % kBitsPerMapLine);
+    }
+    if (line == last_line) {
+      mask &= all >> (kBitsPerMapLine - 1 - (end - 1) % kBitsPerMapLine);
+    }
+    if (alloc_map_[line] & mask) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
   range_begin_ = range_begin;
   range_end_ = range_end;
+  hint_line_ = range_begin.ID() / kBitsPerMapLine;
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
@@ -66,57 +104,351 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
   } else {
     alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
   }
+  UpdateFullMap(line_index);
+}
+
+void BitmapMemoryManager::UpdateFullMap(size_t line) {
+  const auto bit = static_cast<MapLineType>(1) << (line % kBitsPerMapLine);
+  if (alloc_map_[line] == ~static_cast<MapLineType>(0)) {
+    full_map_[line / kBitsPerMapLine] |= bit;
+  } else {
+    full_map_[line / kBitsPerMapLine] &= ~bit;
+  }
+}
+
+void BitmapMemoryManager::SetBits(size_t begin, size_t end, bool allocated) {
+  if (begin >= end) {
+    return;
+  }
+
+  const auto all = ~static_cast<MapLineType>(0);
+  const size_t first_line = begin / kBitsPerMapLine;
+  const size_t last_line = (end - 1) / kBitsPerMapLine;
+  const MapLineType head_mask = all << (begin % kBitsPerMapLine);
+  const MapLineType tail_mask = all >> (kBitsPerMapLine - 1 - (end - 1) % kBitsPerMapLine);
+
+  auto set_masked = [&](size_t line, MapLineType mask) {
+    if (allocated) {
+      alloc_map_[line] |= mask;
+    } else {
+      alloc_map_[line] &= ~mask;
+    }
+    UpdateFullMap(line);
+  };
+
+  if (first_line == last_line) {
+    set_masked(first_line, head_mask & tail_mask);
+    return;
+  }
+  set_masked(first_line, head_mask);
+  set_masked(last_line, tail_mask);
+
+  // 間の要素は全ビットが同じ値になるので，要約ビットマップのビットも同じ値にする
+  const size_t mid_begin = first_line + 1, mid_end = last_line;
+  if (mid_begin == mid_end) {
+    return;
+  }
+  std::fill(&alloc_map_[mid_begin], &alloc_map_[0] + mid_end, allocated ? all : 0);
+
+  const size_t first_full = mid_begin / kBitsPerMapLine;
+  const size_t last_full = (mid_end - 1) / kBitsPerMapLine;
+  for (size_t i = first_full; i <= last_full; ++i) {
+    MapLineType mask = all;
+    if (i == first_full) {
+      mask &= all << (mid_begin % kBitsPerMapLine);
+    }
+    if (i == last_full) {
+      mask &= all >> (kBitsPerMapLine - 1 - (mid_end - 1) % kBitsPerMapLine);
+    }
+    if (allocated) {
+      full_map_[i] |= mask;
+    } else {
+      full_map_[i] &= ~mask;
+    }
+  }
+}
+
+size_t BitmapMemoryManager::FindFree(size_t frame) const {
+  const size_t end = range_end_.ID();
+  if (frame >= end) {
+    return end;
+  }
+
+  size_t line = frame / kBitsPerMapLine;
+  // frame より前のビットは使用中とみなす
+  MapLineType free_bits =
+    ~alloc_map_[line] & (~static_cast<MapLineType>(0) << (frame % kBitsPerMapLine));
+  while (free_bits == 0) {
+    // 要約ビットマップで全フレームが使用中の要素を読み飛ばす
+    ++line;
+    size_t full_index = line / kBitsPerMapLine;
+    if (full_index >= map_line_count_ / kBitsPerMapLine) {
+      return end;
+    }
+    MapLineType not_full =
+      ~full_map_[full_index] & (~static_cast<MapLineType>(0) << (line % kBitsPerMapLine));
+    while (not_full == 0) {
+      if (++full_index >= map_line_count_ / kBitsPerMapLine ||
+          full_index * kBitsPerMapLine * kBitsPerMapLine >= end) {
+        return end;
+      }
+      not_full = ~full_map_[full_index];
+    }
+    line = full_index * kBitsPerMapLine + __builtin_ctzl(not_full);
+    free_bits = ~alloc_map_[line];
+  }
+
+  return std::min(end, line * kBitsPerMapLine + __builtin_ctzl(free_bits));
 }
 
-extern "C" caddr_t program_break, program_break_end;
+size_t BitmapMemoryManager::FindRun(size_t frame, size_t num_frames) const {
+  const size_t end = range_end_.ID();
+  const auto all = ~static_cast<MapLineType>(0);
+
+  // 前の要素から続く空きの範囲 [run_start, run_start + run_len)
+  size_t run_start = frame, run_len = 0;
+  size_t line = frame / kBitsPerMapLine;
+  // frame より前のビットは使用中とみなす
+  MapLineType used = alloc_map_[line] | ~(all << (frame % kBitsPerMapLine));
+  while (true) {
+    const size_t base = line * kBitsPerMapLine;
+    if (base >= end) {
+      return end;
+    }
+    if (end - base < kBitsPerMapLine) {
+      used |= all << (end - base);
+    }
+
+    if (used == all) {
+      // 全フレームが使用中の要素が続く間は要約ビットマップで読み飛ばす
+      run_len = 0;
+      const size_t next = FindFree(base + kBitsPerMapLine);
+      if (next >= end) {
+        return end;
+      }
+      line = next / kBitsPerMapLine;
+      used = alloc_map_[line];
+      continue;
+    }
+
+    const size_t low_free = used == 0 ? kBitsPerMapLine : __builtin_ctzl(used);
+    if (run_len == 0) {
+      run_start = base;
+    }
+    if (run_len + low_free >= num_frames) {
+      return run_start;
+    }
+    if (used == 0) {
+      run_len += kBitsPerMapLine;
+    } else {
+      if (num_frames <= kBitsPerMapLine) {
+        // starts の i ビット目は，i ビット目から num_frames 個の空きが要素内に続くことを表す
+        MapLineType starts = ~used;
+        size_t len = 1;
+        while (len < num_frames) {
+          const size_t shift = std::min(len, num_frames - len);
+          starts &= starts >> shift;
+          len += shift;
+        }
+        if (starts) {
+          return base + __builtin_ctzl(starts);
+        }
+      }
+      run_len = __builtin_clzl(used);
+      run_start = base + kBitsPerMapLine - run_len;
+    }
+
+    if (++line >= map_line_count_) {
+      return end;
+    }
+    used = alloc_map_[line];
+  }
+}
+
+FrameManager* memory_manager;
 
 namespace {
-  char memory_manager_buf[sizeof(BitmapMemoryManager)];
-  BitmapMemoryManager* memory_manager;
+  alignas(FrameManager) char memory_manager_buf[sizeof(FrameManager)];
+  SpinLock frame_lock;
+  /** @brief TakeLowMemoryFrame で渡すフレーム．0 なら取り置いていないか，渡し済み． */
+  size_t low_memory_frame;
+
+  /** @brief すぐに，または ReclaimBootMemory の後で使えるようになるメモリ */
+  bool IsUsable(MemoryType type) {
+    return IsAvailable(type) || IsReclaimable(type);
+  }
 
-  Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-    const int kHeapFrames = 64 * 512;
-    const auto heap_start = memory_manager.Allocate(kHeapFrames);
-    if (heap_start.error) {
-      return heap_start.error;
+  template <class F>
+  void ForEachDescriptor(const MemoryMap& memory_map, F f) {
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    for (uintptr_t iter = memory_map_base;
+         iter < memory_map_base + memory_map.map_size;
+         iter += memory_map.descriptor_size) {
+      f(*reinterpret_cast<const MemoryDescriptor*>(iter));
     }
+  }
 
-    program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-    program_break_end = program_break + kHeapFrames * kBytesPerFrame;
-    return MAKE_ERROR(Error::kSuccess);
+  /** @brief 管理領域 bytes バイトを置くアドレスを EfiConventionalMemory の中から探す．
+   *
+   * EfiBootServicesData にはまだ読んでいるメモリマップ自体が置かれているので使わない．
+   * フレーム 0 は kNullFrame と紛らわしいので避ける．
+   */
+  WithError<uintptr_t> FindMapArea(const MemoryMap& memory_map, size_t bytes) {
+    uintptr_t area = 0;
+    ForEachDescriptor(memory_map, [&](const MemoryDescriptor& desc) {
+      if (area != 0 || !(desc.type == MemoryType::kEfiConventionalMemory)) {
+        return;
+      }
+      const uintptr_t start = std::max<uintptr_t>(desc.physical_start, kBytesPerFrame);
+      const uintptr_t end = desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+      if (start < end && bytes <= end - start) {
+        area = start;
+      }
+    });
+    if (area == 0) {
+      return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    return {area, MAKE_ERROR(Error::kSuccess)};
   }
+
+  /** @brief kLowMemoryLimit 未満の EfiConventionalMemory から，管理領域と重ならない
+   * フレームを探す．見つからなければ 0 を返す．
+   */
+  size_t FindLowMemoryFrame(const MemoryMap& memory_map,
+                            uintptr_t map_area, size_t map_bytes) {
+    size_t frame = 0;
+    ForEachDescriptor(memory_map, [&](const MemoryDescriptor& desc) {
+      if (frame != 0 || !(desc.type == MemoryType::kEfiConventionalMemory)) {
+        return;
+      }
+      const uintptr_t start = std::max<uintptr_t>(desc.physical_start, kBytesPerFrame);
+      const uintptr_t end = std::min<uintptr_t>(
+          desc.physical_start + desc.number_of_pages * kUEFIPageSize, kLowMemoryLimit);
+      for (uintptr_t addr = start; addr + kBytesPerFrame <= end; addr += kBytesPerFrame) {
+        if (addr + kBytesPerFrame <= map_area || map_area + map_bytes <= addr) {
+          frame = addr / kBytesPerFrame;
+          return;
+        }
+      }
+    });
+    return frame;
+  }
+}
+
+WithError<FrameID> TakeLowMemoryFrame() {
+  SpinLockGuard guard{frame_lock};
+  if (low_memory_frame == 0) {
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+  const FrameID frame{low_memory_frame};
+  low_memory_frame = 0;
+  return {frame, MAKE_ERROR(Error::kSuccess)};
+}
+
+WithError<FrameID> AllocateFrames(size_t num_frames, FrameID limit) {
+  SpinLockGuard guard{frame_lock};
+  return memory_manager->Allocate(num_frames, limit);
+}
+
+Error FreeFrames(FrameID start_frame, size_t num_frames) {
+  SpinLockGuard guard{frame_lock};
+  return memory_manager->Free(start_frame, num_frames);
 }
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
-  ::memory_manager = new(memory_manager_buf) BitmapMemoryManager;
+  // 管理するフレーム数は，利用可能なメモリの最も高いアドレスで決める
+  uintptr_t available_max = 0;
+  ForEachDescriptor(memory_map, [&](const MemoryDescriptor& desc) {
+    if (IsUsable(static_cast<MemoryType>(desc.type))) {
+      available_max = std::max<uintptr_t>(
+          available_max, desc.physical_start + desc.number_of_pages * kUEFIPageSize);
+    }
+  });
+  const size_t frame_count = available_max / kBytesPerFrame;
+
+  const size_t map_bytes = FrameManager::MapBytes(frame_count);
+  const auto map_area = FindMapArea(memory_map, map_bytes);
+  if (map_area.error) {
+    Log(kError, "no memory for frame map (%lu bytes): %s at %s:%d\n", map_bytes,
+        map_area.error.Name(), map_area.error.File(), map_area.error.Line());
+    exit(1);
+  }
+  ::memory_manager = new(memory_manager_buf)
+    FrameManager{frame_count, reinterpret_cast<void*>(map_area.value)};
 
-  const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
   uintptr_t available_end = 0;
-  for (uintptr_t iter = memory_map_base;
-       iter < memory_map_base + memory_map.map_size;
-       iter += memory_map.descriptor_size) {
-    auto desc = reinterpret_cast<const MemoryDescriptor*>(iter);
-    if (available_end < desc->physical_start) {
+  ForEachDescriptor(memory_map, [&](const MemoryDescriptor& desc) {
+    if (available_end < desc.physical_start) {
       memory_manager->MarkAllocated(
           FrameID{available_end / kBytesPerFrame},
-          (desc->physical_start - available_end) / kBytesPerFrame);
+          (desc.physical_start - available_end) / kBytesPerFrame);
     }
 
     const auto physical_end =
-      desc->physical_start + desc->number_of_pages * kUEFIPageSize;
-    if (IsAvailable(static_cast<MemoryType>(desc->type))) {
+      desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+    if (IsUsable(static_cast<MemoryType>(desc.type))) {
       available_end = physical_end;
-    } else {
+    }
+    if (!(desc.type == MemoryType::kEfiConventionalMemory)) {
       memory_manager->MarkAllocated(
-          FrameID{desc->physical_start / kBytesPerFrame},
-          desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+          FrameID{desc.physical_start / kBytesPerFrame},
+          desc.number_of_pages * kUEFIPageSize / kBytesPerFrame);
     }
+  });
+  memory_manager->MarkAllocated(FrameID{map_area.value / kBytesPerFrame},
+                                (map_bytes + kBytesPerFrame - 1) / kBytesPerFrame);
+
+  // 以降の Allocate に使われる前に，1MiB 未満のフレームを 1 つ取り置く
+  low_memory_frame = FindLowMemoryFrame(memory_map, map_area.value, map_bytes);
+  if (low_memory_frame != 0) {
+    memory_manager->MarkAllocated(FrameID{low_memory_frame}, 1);
+  } else {
+    Log(kWarn, "no free frame below 1MiB\n");
   }
   memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
 
-  if (auto err = InitializeHeap(*memory_manager)) {
-    Log(kError, "failed to allocate pages: %s at %s:%d\n",
-        err.Name(), err.File(), err.Line());
-    exit(1);
+  Log(kInfo, "frame map: %lu frames, %lu bytes at %08lx\n",
+      frame_count, map_bytes, map_area.value);
+}
+
+void ReclaimBootMemory(const MemoryMap& memory_map) {
+  // カーネル自身を読み込んだ EfiLoaderData の記述子は残す
+  const auto kernel_text = reinterpret_cast<uintptr_t>(&ReclaimBootMemory);
+  const auto kernel_bss = reinterpret_cast<uintptr_t>(memory_manager_buf);
+  auto contains_kernel = [&](uintptr_t start, uintptr_t end) {
+    return (start <= kernel_text && kernel_text < end) ||
+           (start <= kernel_bss && kernel_bss < end);
+  };
+
+  std::array<size_t, static_cast<int>(MemoryType::kEfiMaxMemoryType)> reclaimed_frames{};
+  ForEachDescriptor(memory_map, [&](const MemoryDescriptor& desc) {
+    const auto type = static_cast<MemoryType>(desc.type);
+    const uintptr_t end = desc.physical_start + desc.number_of_pages * kUEFIPageSize;
+    if (!IsReclaimable(type) ||
+        (type == MemoryType::kEfiLoaderData && contains_kernel(desc.physical_start, end))) {
+      return;
+    }
+    // フレーム 0 は kNullFrame と紛らわしいので使わない
+    const size_t begin_frame = std::max<size_t>(desc.physical_start / kBytesPerFrame, 1);
+    const size_t end_frame = end / kBytesPerFrame;
+    if (begin_frame >= end_frame) {
+      return;
+    }
+    FreeFrames(FrameID{begin_frame}, end_frame - begin_frame);
+    reclaimed_frames[desc.type] += end_frame - begin_frame;
+  });
+
+  const std::array<std::pair<MemoryType, const char*>, 4> kReclaimableTypes{{
+    {MemoryType::kEfiLoaderCode, "loader code"},
+    {MemoryType::kEfiLoaderData, "loader data"},
+    {MemoryType::kEfiBootServicesCode, "boot services code"},
+    {MemoryType::kEfiBootServicesData, "boot services data"},
+  }};
+  size_t total = 0;
+  for (const auto& [type, name] : kReclaimableTypes) {
+    const size_t frames = reclaimed_frames[static_cast<int>(type)];
+    Log(kWarn, "reclaimed %-18s %6lu KiB\n", name, frames * kBytesPerFrame / 1024);
+    total += frames;
   }
+  Log(kWarn, "reclaimed %lu KiB of boot memory\n", total * kBytesPerFrame / 1024);
 }
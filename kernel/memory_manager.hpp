@@ -47,26 +47,48 @@ static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
  * 配列 alloc_map の各ビットがフレームに対応し，0 なら空き，1 なら使用中．
  * alloc_map[n] の m ビット目が対応する物理アドレスは次の式で求まる：
  *   kFrameBytes * (n * kBitsPerMapLine + m)
+ *
+ * 空きフレームの検索はビットマップを 1 要素（64 フレーム）ずつ調べる．
+ * さらに要素ごとに「全フレームが使用中か」を 1 ビットで表す要約ビットマップを持ち，
+ * 使用中の要素は 64 個ずつまとめて読み飛ばす．
+ *
+ * ビットマップの領域は呼び出し側が用意する．大きさは管理するフレーム数で決まり，
+ * MapBytes で求める．
  */
 class BitmapMemoryManager {
  public:
-  /** @brief このメモリ管理クラスで扱える最大の物理メモリ量（バイト） */
-  static const auto kMaxPhysicalMemoryBytes{128_GiB};
-  /** @brief kMaxPhysicalMemoryBytes までの物理メモリを扱うために必要なフレーム数 */
-  static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
-
   /** @brief ビットマップ配列の要素型 */
   using MapLineType = unsigned long;
   /** @brief ビットマップ配列の 1 つの要素のビット数 == フレーム数 */
   static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
-  /** @brief インスタンスを初期化する． */
-  BitmapMemoryManager();
+  /** @brief frame_count フレームを管理するのに必要なビットマップの大きさ（バイト） */
+  static size_t MapBytes(size_t frame_count);
 
-  /** @brief 要求されたフレーム数の領域を確保して先頭のフレーム ID を返す */
-  WithError<FrameID> Allocate(size_t num_frames);
+  /** @brief フレーム 0 から frame_count - 1 までを管理するように初期化する．全フレームを空きとする．
+   *
+   * @param map_buf  ビットマップに使う MapBytes(frame_count) バイトの領域．8 バイト境界に置く．
+   */
+  BitmapMemoryManager(size_t frame_count, void* map_buf);
+  BitmapMemoryManager(const BitmapMemoryManager&) = delete;
+  BitmapMemoryManager& operator=(const BitmapMemoryManager&) = delete;
+
+  /** @brief 要求されたフレーム数の領域を確保して先頭のフレーム ID を返す．
+   *
+   * 空き領域のうち最も前にあるものを返す（first-fit）．
+   * limit を指定すると，領域の終わりが limit を超えないものだけから選ぶ．
+   */
+  WithError<FrameID> Allocate(size_t num_frames, FrameID limit = kNullFrame);
+  /** @brief 指定した範囲のフレームを空きにする．
+   *
+   * 範囲の両端の要素はマスクで，間の要素はまとめて書き換えるので，
+   * 大きな範囲でも要素数に比例する手間で済む．FrameCount() を超える部分は無視する．
+   */
   Error Free(FrameID start_frame, size_t num_frames);
+  /** @brief 指定した範囲のフレームを使用中にする．手間は Free と同じ． */
   void MarkAllocated(FrameID start_frame, size_t num_frames);
+  /** @brief 指定した範囲のフレームがすべて空きなら true．FrameCount() を超える範囲は使用中とみなす． */
+  bool IsFree(FrameID start_frame, size_t num_frames) const;
 
   /** @brief このメモリマネージャで扱うメモリ範囲を設定する．
    * この呼び出し以降，Allocate によるメモリ割り当ては設定された範囲内でのみ行われる．
@@ -76,8 +98,23 @@ class BitmapMemoryManager {
    */
   void SetMemoryRange(FrameID range_begin, FrameID range_end);
 
+  /** @brief 管理しているフレーム数 */
+  size_t FrameCount() const { return frame_count_; }
+
  private:
-  std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+  /** @brief ビットマップ配列の要素数を kBitsPerMapLine の倍数に切り上げるためのフレーム数の単位 */
+  static const size_t kFramesPerFullLine{kBitsPerMapLine * kBitsPerMapLine};
+
+  size_t frame_count_;
+  /** @brief ビットマップ配列の要素数 */
+  size_t map_line_count_;
+  MapLineType* alloc_map_;
+  /** @brief alloc_map_[n] の全ビットが 1 なら n ビット目が 1 になる要約ビットマップ．
+   * 要素数は map_line_count_ / kBitsPerMapLine．
+   */
+  MapLineType* full_map_;
+  /** @brief 検索を始める要素．range_begin_ からこの要素の手前までは全フレームが使用中． */
+  size_t hint_line_;
   /** @brief このメモリマネージャで扱うメモリ範囲の始点． */
   FrameID range_begin_;
   /** @brief このメモリマネージャで扱うメモリ範囲の終点．最終フレームの次のフレーム． */
@@ -85,6 +122,177 @@ class BitmapMemoryManager {
 
   bool GetBit(FrameID frame) const;
   void SetBit(FrameID frame, bool allocated);
+  /** @brief alloc_map_[line] の変更を要約ビットマップに反映する． */
+  void UpdateFullMap(size_t line);
+  /** @brief フレーム [begin, end) のビットをまとめて設定し，要約ビットマップも更新する． */
+  void SetBits(size_t begin, size_t end, bool allocated);
+  /** @brief frame 以降で最初の空きフレームを返す．range_end_ までになければ range_end_． */
+  size_t FindFree(size_t frame) const;
+  /** @brief 空きフレーム frame 以降で，num_frames 個の空きが続く最初の位置を返す．
+   * range_end_ までになければ range_end_．
+   *
+   * 要素ごとに，前の要素から続く空き，要素内の空き，次の要素へ続く空きを
+   * ビット演算でまとめて調べるので，断片化していても 1 要素あたりの手間は一定．
+   */
+  size_t FindRun(size_t frame, size_t num_frames) const;
+};
+
+/** @brief バディシステムでフレーム単位にメモリ管理するクラス．
+ *
+ * 2^order フレームの大きさで，先頭が 2^order フレーム境界に揃ったブロックを単位に管理する．
+ * order ごとに「空きブロックの先頭か」を 1 ビットで表すビットマップを持つ．
+ * ビットマップは上位の階層を重ねた木になっていて，空きブロックの検索は
+ * 階層の数（64 分木の高さ）に比例する手間で済む．
+ *
+ * 確保した領域の先頭は，要求したフレーム数を 2 のべき乗に切り上げた大きさの境界に揃う．
+ * 切り上げで余った後半のフレームはすぐに空きへ戻す．
+ * 解放したブロックは相方（バディ）も空きなら順に併合する．
+ * 管理情報は呼び出し側が用意した領域に置き，管理するフレーム自体には書き込まない．
+ */
+class BuddyMemoryManager {
+ public:
+  /** @brief 最大のブロックの order．2^18 フレーム == 1 GiB． */
+  static constexpr int kMaxOrder{18};
+
+  /** @brief ビットマップ配列の要素型 */
+  using MapLineType = unsigned long;
+  /** @brief ビットマップ配列の 1 つの要素のビット数 */
+  static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
+
+  /** @brief frame_count フレームを管理するのに必要な管理領域の大きさ（バイト） */
+  static size_t MapBytes(size_t frame_count);
+
+  /** @brief フレーム 0 から frame_count - 1 までを管理するように初期化する．全フレームを空きとする．
+   *
+   * @param map_buf  管理情報に使う MapBytes(frame_count) バイトの領域．8 バイト境界に置く．
+   */
+  BuddyMemoryManager(size_t frame_count, void* map_buf);
+  BuddyMemoryManager(const BuddyMemoryManager&) = delete;
+  BuddyMemoryManager& operator=(const BuddyMemoryManager&) = delete;
+
+  /** @brief 要求されたフレーム数の領域を確保して先頭のフレーム ID を返す．
+   *
+   * 足りる大きさの空きブロックのうち最も小さい order のものから，最も前にあるものを割る．
+   * 2^kMaxOrder フレームを超える要求は kNoEnoughMemory を返す．
+   * limit を指定すると，確保する領域の終わりが limit を超えるブロックは使わない．
+   */
+  WithError<FrameID> Allocate(size_t num_frames, FrameID limit = kNullFrame);
+  /** @brief 指定した範囲のフレームを空きにする．
+   *
+   * 範囲を境界に揃ったブロックに分けて，それぞれを相方と併合しながら空きにする．
+   * 空いているフレームを含む範囲を渡してはならない．FrameCount() を超える部分は無視する．
+   */
+  Error Free(FrameID start_frame, size_t num_frames);
+  /** @brief 指定した範囲のフレームを使用中にする．範囲を含む空きブロックは割って残りを空きに戻す． */
+  void MarkAllocated(FrameID start_frame, size_t num_frames);
+  /** @brief 指定した範囲のフレームがすべて空きなら true．FrameCount() を超える範囲は使用中とみなす． */
+  bool IsFree(FrameID start_frame, size_t num_frames) const;
+
+  /** @brief このメモリマネージャで扱うメモリ範囲を設定する．
+   * 範囲外の空きフレームを空きブロックから取り除くので，以降は範囲内でのみ割り当てる．
+   * 起動時に 1 回だけ呼ぶことを想定していて，範囲を広げることはできない．
+   *
+   * @param range_begin_ メモリ範囲の始点
+   * @param range_end_   メモリ範囲の終点．最終フレームの次のフレーム．
+   */
+  void SetMemoryRange(FrameID range_begin, FrameID range_end);
+
+  /** @brief 管理しているフレーム数 */
+  size_t FrameCount() const { return frame_count_; }
+
+ private:
+  /** @brief 階層化したビットマップ．上位の階層の各ビットは下位の 1 要素が 0 でないことを表す． */
+  class OrderMap {
+   public:
+    /** @brief 0 で埋められた LinesFor(bits) 要素の領域 storage を使うように初期化する． */
+    void Init(MapLineType* storage, size_t bits);
+    /** @brief bits ビットを扱うのに必要な，全階層を合わせた要素数 */
+    static size_t LinesFor(size_t bits);
+    bool Test(size_t index) const {
+      return (levels_[0][index / kBitsPerMapLine] >> (index % kBitsPerMapLine)) & 1;
+    }
+    void Set(size_t index);
+    void Clear(size_t index);
+    /** @brief 立っている最初のビットの位置．なければ kNone． */
+    size_t FindFirst() const;
+    /** @brief [begin, end) に立っているビットがあれば true */
+    bool AnyIn(size_t begin, size_t end) const;
+
+    static const size_t kNone{std::numeric_limits<size_t>::max()};
+
+   private:
+    static const int kMaxLevels{6};
+    std::array<MapLineType*, kMaxLevels> levels_;
+    int num_levels_;
+  };
+
+  /** @brief 2^kMaxOrder の倍数に切り上げたフレーム数 */
+  static size_t Capacity(size_t frame_count);
+
+  size_t frame_count_;
+  /** @brief free_maps_[order] の n ビット目が 1 なら，フレーム n << order から始まるブロックが空き */
+  std::array<OrderMap, kMaxOrder + 1> free_maps_;
+
+  bool IsFreeBlock(size_t frame, int order) const {
+    return free_maps_[order].Test(frame >> order);
+  }
+  /** @brief ブロックを相方と併合しながら空きにする． */
+  void FreeBlock(size_t frame, int order);
+  /** @brief 境界に揃ったブロックを空きブロックから取り除く．含まれる空きブロックがなければ何もしない． */
+  void CarveBlock(size_t frame, int order);
+  /** @brief ブロックに含まれるフレームがすべて空きなら true */
+  bool IsFreeRange(size_t frame, int order) const;
+  /** @brief frame を含む order 以上の空きブロックの order．なければ -1． */
+  int FindFreeAncestor(size_t frame, int order) const;
+  /** @brief ブロックの中に，より小さな空きブロックがあれば true */
+  bool ContainsFreeBlock(size_t frame, int order) const;
+
+  /** @brief [begin, end) を境界に揃ったブロックに分けて先頭から順に f(frame, order) を呼ぶ． */
+  template <class F>
+  static void ForEachBlock(size_t begin, size_t end, F f);
 };
 
+/** @brief カーネルが使うフレーム管理クラス．make BUDDY_MEMORY_MANAGER=1 でバディシステムを使う． */
+#ifdef BUDDY_MEMORY_MANAGER
+using FrameManager = BuddyMemoryManager;
+#else
+using FrameManager = BitmapMemoryManager;
+#endif
+
+extern FrameManager* memory_manager;
+
+/** @brief ロックを取ってから memory_manager->Allocate を呼ぶ．
+ *
+ * memory_manager 自体は排他制御しないので，起動後に複数の CPU から
+ * フレームを確保・解放するときはこちらを使う．
+ */
+WithError<FrameID> AllocateFrames(size_t num_frames, FrameID limit = kNullFrame);
+/** @brief ロックを取ってから memory_manager->Free を呼ぶ． */
+Error FreeFrames(FrameID start_frame, size_t num_frames);
+
+/** @brief リアルモードから参照できるアドレスの上限 */
+const uintptr_t kLowMemoryLimit = 1_MiB;
+
+/** @brief InitializeMemoryManager が kLowMemoryLimit 未満に取り置いたフレームを受け取る．
+ *
+ * AP の起動用トランポリンのように 1MiB 未満に置く必要があるもののために，
+ * Allocate で低位のフレームが使われてしまう前に 1 フレームだけ確保しておく．
+ * 受け取れるのは 1 回だけで，取り置けなかった場合と 2 回目以降はエラーを返す．
+ */
+WithError<FrameID> TakeLowMemoryFrame();
+
+/** @brief memory_manager を作り，メモリマップに従って使用中のフレームを設定する．
+ *
+ * この時点で空きにするのは EfiConventionalMemory だけ．ローダとブートサービスの
+ * メモリ（IsReclaimable）はメモリマップ自体やローダから渡された構造体を含むので，
+ * ReclaimBootMemory を呼ぶまで使用中にしておく．
+ * TakeLowMemoryFrame のためのフレームもここで取り置く．
+ */
 void InitializeMemoryManager(const MemoryMap& memory_map);
+/** @brief ローダとブートサービスが使っていたメモリを解放し，解放した量をログに出す．
+ *
+ * ローダから渡された構造体やメモリマップを使い終わってから，他の CPU やタスクが
+ * フレームを確保し始める前に 1 回だけ呼ぶ（解放しながらメモリマップを読むため）．
+ * 呼んだ後は memory_map.buffer を参照してはならない．
+ */
+void ReclaimBootMemory(const MemoryMap& memory_map);
@@ -54,5 +54,17 @@ inline bool IsAvailable(MemoryType memory_type) {
     memory_type == MemoryType::kEfiConventionalMemory;
 }
 
+/** @brief ローダやブートサービスが使っていたメモリ．カーネルの初期化が終われば再利用できる．
+ *
+ * EfiLoaderData にはカーネル自身も含まれるので，解放するときはそこを除くこと．
+ */
+inline bool IsReclaimable(MemoryType memory_type) {
+  return
+    memory_type == MemoryType::kEfiLoaderCode ||
+    memory_type == MemoryType::kEfiLoaderData ||
+    memory_type == MemoryType::kEfiBootServicesCode ||
+    memory_type == MemoryType::kEfiBootServicesData;
+}
+
 const int kUEFIPageSize = 4096;
 #endif
@@ -2,7 +2,6 @@
 
 struct Message {
   enum Type {
-    kInterruptXHCI,
     kTimerTimeout,
     kKeyPush,
   } type;
@@ -1,22 +1,18 @@
 #include <errno.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 void _exit(void) {
   while (1) __asm__("hlt");
 }
 
-caddr_t program_break, program_break_end;
-
+/*
+ * malloc は slab.cpp で実装していて，newlib の malloc は使わない．
+ * newlib の中から参照されたときのためだけに残している．
+ */
 caddr_t sbrk(int incr) {
-  if (program_break == 0 || program_break + incr >= program_break_end) {  
-    errno = ENOMEM;
-    return (caddr_t)-1;
-  }
-
-  caddr_t prev_break = program_break;
-  program_break += incr;
-  return prev_break;
-
+  errno = ENOMEM;
+  return (caddr_t)-1;
 }
 
 int getpid(void) {
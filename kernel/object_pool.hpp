@@ -0,0 +1,196 @@
+/**
+ * @file object_pool.hpp
+ *
+ * 大きさの決まったオブジェクトを固定個数の領域から割り当てるプール．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include "logger.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+
+/** @brief ObjectPool::GetStats が返す統計情報 */
+struct ObjectPoolStats {
+  size_t capacity{0};  // プールの大きさ（オブジェクト数）
+  size_t in_use{0};    // 使用中のオブジェクト数
+  size_t cached{0};    // CPU ごとのキャッシュにある空きオブジェクト数
+  size_t peak{0};      // 一度でもプールから取り出されたオブジェクト数
+  uint64_t allocs{0};  // これまでの割り当て回数
+  uint64_t frees{0};   // これまでの解放回数
+  uint64_t failures{0}; // 空きがなく割り当てられなかった回数
+};
+
+/** @brief 統計情報をログに出力する． */
+inline void LogObjectPoolStats(const char* name, const ObjectPoolStats& stats) {
+  Log(kWarn, "pool %-12s: in use %lu/%lu (peak %lu, cached %lu), allocs %lu, frees %lu, failures %lu\n",
+      name, stats.in_use, stats.capacity, stats.peak, stats.cached,
+      stats.allocs, stats.frees, stats.failures);
+}
+
+/** @brief T 型のオブジェクト N 個分の領域を持ち，1 個ずつ O(1) で割り当てるプール．
+ *
+ * 空き領域はその領域自身に次の空き領域へのポインタを書いて繋ぐ（侵入型のフリーリスト）．
+ * そのため解放した領域の先頭 8 バイトは次に割り当てるまで書き換わる．
+ * まだ一度も割り当てていない領域は先頭から順に使うので，静的に置いたプールは
+ * コンストラクタを呼ばなくても（ゼロ初期化されていれば）使える．
+ *
+ * CacheSize が 0 でなければ CPU ごとに最大 CacheSize 個の空き領域を手元に置き，
+ * 割り当てと解放はほとんどの場合ロックを取らずに済む．キャッシュが空になったら
+ * 共有のフリーリストから半分まで補充し，満杯になったら半分を返す．
+ * 他の CPU のキャッシュにある空き領域は使わないので，割り当てに失敗しても
+ * プール全体が使用中とは限らない．
+ *
+ * 割り当てが失敗したときの扱い（一般のヒープに頼るかどうか）は使う側が決める．
+ * 割り込みハンドラからも呼び出せる．
+ */
+template <class T, size_t N, size_t CacheSize = 0>
+class ObjectPool {
+ public:
+  /** @brief T 1 個分の領域を割り当てる．コンストラクタは呼ばない．空きがなければ nullptr． */
+  void* Allocate() {
+    InterruptGuard guard;
+    auto& cpu = cpus_[CurrentCPU()];
+    Slot* slot = nullptr;
+    if constexpr (CacheSize > 0) {
+      if (cpu.cached == 0) {
+        Refill(cpu);
+      }
+      if (cpu.cached > 0) {
+        slot = cpu.cache[--cpu.cached];
+      }
+    } else {
+      lock_.Lock();
+      slot = PopLocked();
+      lock_.Unlock();
+    }
+
+    if (slot == nullptr) {
+      ++cpu.failures;
+      return nullptr;
+    }
+    ++cpu.allocs;
+    return slot;
+  }
+
+  /** @brief Allocate で割り当てた領域を返す．デストラクタは呼ばない．nullptr なら何もしない． */
+  void Free(void* p) {
+    if (p == nullptr) {
+      return;
+    }
+    InterruptGuard guard;
+    auto& cpu = cpus_[CurrentCPU()];
+    ++cpu.frees;
+    auto slot = reinterpret_cast<Slot*>(p);
+    if constexpr (CacheSize > 0) {
+      if (cpu.cached == CacheSize) {
+        Drain(cpu);
+      }
+      cpu.cache[cpu.cached++] = slot;
+    } else {
+      lock_.Lock();
+      PushLocked(slot);
+      lock_.Unlock();
+    }
+  }
+
+  /** @brief 領域を割り当てて T を構築する．空きがなければ nullptr． */
+  template <class... Args>
+  T* New(Args&&... args) {
+    void* p = Allocate();
+    return p ? new(p) T(std::forward<Args>(args)...) : nullptr;
+  }
+
+  /** @brief New で構築したオブジェクトを破棄して領域を返す．nullptr なら何もしない． */
+  void Delete(T* object) {
+    if (object) {
+      object->~T();
+      Free(object);
+    }
+  }
+
+  /** @brief p がこのプールの領域を指していれば true */
+  bool Contains(const void* p) const {
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    return reinterpret_cast<uintptr_t>(slots_.data()) <= addr &&
+      addr < reinterpret_cast<uintptr_t>(slots_.data() + N);
+  }
+
+  /** @brief 統計情報．各 CPU の値をロックを取らずに集めるので，厳密な値ではない． */
+  ObjectPoolStats GetStats() const {
+    ObjectPoolStats stats;
+    stats.capacity = N;
+    stats.peak = used_;
+    for (const auto& cpu : cpus_) {
+      stats.cached += cpu.cached;
+      stats.allocs += cpu.allocs;
+      stats.frees += cpu.frees;
+      stats.failures += cpu.failures;
+    }
+    stats.in_use = stats.allocs - stats.frees;
+    return stats;
+  }
+
+ private:
+  union Slot {
+    Slot* next;
+    alignas(T) unsigned char bytes[sizeof(T)];
+  };
+
+  /** @brief CPU ごとのキャッシュと統計．その CPU が割り込みを禁止した状態でだけ書き換える． */
+  struct PerCPU {
+    std::array<Slot*, CacheSize> cache;
+    size_t cached;
+    uint64_t allocs, frees, failures;
+  };
+
+  /** @brief 空き領域を 1 つ取り出す．なければ nullptr． */
+  Slot* PopLocked() {
+    if (Slot* slot = free_list_) {
+      free_list_ = slot->next;
+      return slot;
+    }
+    if (used_ < N) {
+      return &slots_[used_++];
+    }
+    return nullptr;
+  }
+
+  void PushLocked(Slot* slot) {
+    slot->next = free_list_;
+    free_list_ = slot;
+  }
+
+  void Refill(PerCPU& cpu) {
+    lock_.Lock();
+    while (cpu.cached < (CacheSize + 1) / 2) {
+      Slot* slot = PopLocked();
+      if (slot == nullptr) {
+        break;
+      }
+      cpu.cache[cpu.cached++] = slot;
+    }
+    lock_.Unlock();
+  }
+
+  void Drain(PerCPU& cpu) {
+    lock_.Lock();
+    while (cpu.cached > CacheSize / 2) {
+      PushLocked(cpu.cache[--cpu.cached]);
+    }
+    lock_.Unlock();
+  }
+
+  std::array<Slot, N> slots_{};
+  /** @brief slots_ のうち先頭からこの個数までを一度でも割り当てた */
+  size_t used_{0};
+  Slot* free_list_{nullptr};
+  SpinLock lock_;
+  std::array<PerCPU, kMaxCPUs> cpus_{};
+};
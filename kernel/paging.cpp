@@ -3,6 +3,9 @@
 #include <array>
 
 #include "asmfunc.h"
+#include "memory_manager.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 namespace {
   const uint64_t kPageSize4K = 4096;
@@ -13,6 +16,60 @@ namespace {
   alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
   alignas(kPageSize4K)
     std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+
+  const uint64_t kPagePresent = 0x001;
+  const uint64_t kPageLarge = 0x080;
+  const uint64_t kPageAddrMask = 0x000ffffffffff000;
+
+  /** @brief ページテーブルの書き換えと，それに続く TLB シュートダウンを排他するロック */
+  SpinLock page_table_lock;
+
+  /** @brief 2MiB ページのエントリを 4KiB ページテーブルへ分割する．
+   *
+   * 古い 2MiB ページの TLB エントリは呼び出し側が破棄すること．
+   */
+  WithError<uint64_t*> SplitLargePage(uint64_t& pd_entry) {
+    const auto frame = AllocateFrames(1);
+    if (frame.error) {
+      return {nullptr, frame.error};
+    }
+
+    auto page_table = reinterpret_cast<uint64_t*>(frame.value.Frame());
+    const uint64_t base = pd_entry & kPageAddrMask;
+    for (int i_pt = 0; i_pt < 512; ++i_pt) {
+      page_table[i_pt] = (base + i_pt * kPageSize4K) | 0x003;
+    }
+    pd_entry = reinterpret_cast<uint64_t>(page_table) | 0x003;
+    return {page_table, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  Error SetPagePresentLocked(uint64_t addr, bool present) {
+    const size_t i_pdpt = addr / kPageSize1G;
+    const size_t i_pd = (addr / kPageSize2M) % 512;
+    const size_t i_pt = (addr / kPageSize4K) % 512;
+    if (i_pdpt >= page_directory.size()) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    uint64_t& pd_entry = page_directory[i_pdpt][i_pd];
+    uint64_t* page_table = reinterpret_cast<uint64_t*>(pd_entry & kPageAddrMask);
+    if (pd_entry & kPageLarge) {
+      auto [ pt, err ] = SplitLargePage(pd_entry);
+      if (err) {
+        return err;
+      }
+      page_table = pt;
+    }
+
+    if (present) {
+      page_table[i_pt] |= kPagePresent;
+    } else {
+      page_table[i_pt] &= ~kPagePresent;
+    }
+    // 他の CPU も古いエントリ（分割前の 2MiB ページを含む）を持っているかもしれない
+    FlushTLBAllCPUs();
+    return MAKE_ERROR(Error::kSuccess);
+  }
 }
 
 void SetupIdentityPageTable() {
@@ -30,3 +87,15 @@ void SetupIdentityPageTable() {
 void InitializePaging() {
   SetupIdentityPageTable();
 }
+
+Error SetPagePresent(uint64_t addr, bool present) {
+  InterruptGuard guard;
+  // ロックを持つ CPU は TLB シュートダウンの完了を待つので，こちらも依頼に応えながら待つ
+  while (!page_table_lock.TryLock()) {
+    ServiceTLBFlush();
+    __asm__ volatile("pause");
+  }
+  auto err = SetPagePresentLocked(addr, present);
+  page_table_lock.Unlock();
+  return err;
+}
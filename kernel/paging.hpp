@@ -7,6 +7,9 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
 
 /** @brief 静的に確保するページディレクトリの個数
  *
@@ -22,3 +25,16 @@ const size_t kPageDirectoryCount = 64;
 void SetupIdentityPageTable();
 
 void InitializePaging();
+
+/** @brief 恒等マッピングされた 4KiB ページの存在ビットを変更する．
+ *
+ * 対象のアドレスが 2MiB ページでマッピングされている場合，
+ * そのページを 4KiB ページ 512 個のページテーブルに分割してから変更する．
+ * ページテーブル用のフレームは AllocateFrames で確保する．
+ * 変更後は FlushTLBAllCPUs で全 CPU の TLB を破棄するので，スピンロックを持ったまま呼ばないこと．
+ * スタックの下にガードページを置くために使う．
+ *
+ * @param addr  対象ページの先頭アドレス（4KiB 境界）
+ * @param present  true ならマッピングし，false ならマッピングを外す
+ */
+Error SetPagePresent(uint64_t addr, bool present);
@@ -7,6 +7,7 @@
 #include "pci.hpp"
 
 #include "asmfunc.h"
+#include "lapic.hpp"
 #include "logger.hpp"
 
 namespace {
@@ -308,10 +309,13 @@ namespace pci {
   }
 
   Error ConfigureMSIFixedDestination(
-      const Device& dev, uint8_t apic_id,
+      const Device& dev, uint32_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent) {
-    uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
+    auto [ msg_addr, err ] = MSIAddress(apic_id);
+    if (err) {
+      return err;
+    }
     uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
     if (trigger_mode == MSITriggerMode::kLevel) {
       msg_data |= 0xc000;
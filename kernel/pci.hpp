@@ -167,7 +167,7 @@ namespace pci {
   };
 
   Error ConfigureMSIFixedDestination(
-      const Device& dev, uint8_t apic_id,
+      const Device& dev, uint32_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent);
 }
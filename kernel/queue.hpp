@@ -14,6 +14,8 @@ public:
     ArrayQueue(T* buf, size_t size);
     Error Push(const T& value);
     Error Pop();
+    /** 溜まっている要素をすべて捨てる */
+    void Clear();
     size_t Count() const;
     size_t Capacity() const;
     const T& Front() const;
@@ -71,6 +73,11 @@ Error ArrayQueue<T>::Pop() {
     return MAKE_ERROR(Error::kSuccess);
 }
 
+template <typename T>
+void ArrayQueue<T>::Clear() {
+    read_pos_ = write_pos_ = count_ = 0;
+}
+
 template <typename T>
 size_t ArrayQueue<T>::Count() const {
     return count_;
@@ -1,9 +1,29 @@
 #include "segment.hpp"
 
 #include "asmfunc.h"
+#include "memory_manager.hpp"
+#include "smp.hpp"
+#include "stack_pool.hpp"
 
 namespace {
-  std::array<SegmentDescriptor, 3> gdt;
+  /** @brief 64 ビットモードの TSS */
+  struct TaskStateSegment {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7]; // IST1 から IST7
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+  } __attribute__((packed));
+  static_assert(sizeof(TaskStateSegment) == 104);
+
+  const size_t kISTStackBytes = 16_KiB;
+  /** @brief TSS ディスクリプタの先頭の GDT インデックス．1 つの TSS ディスクリプタは 2 エントリを使う． */
+  const int kTSSIndex = 3;
+
+  std::array<SegmentDescriptor, kTSSIndex + 2 * kMaxCPUs> gdt;
+  std::array<TaskStateSegment, kMaxCPUs> tss;
 }
 
 void SetCodeSegment(SegmentDescriptor& desc,
@@ -40,6 +60,17 @@ void SetDataSegment(SegmentDescriptor& desc,
   desc.bits.default_operation_size = 1; // 32-bit stack segment
 }
 
+void SetSystemSegment(SegmentDescriptor& desc,
+                      DescriptorType type,
+                      unsigned int descriptor_privilege_level,
+                      uint32_t base,
+                      uint32_t limit) {
+  SetCodeSegment(desc, type, descriptor_privilege_level, base, limit);
+  desc.bits.system_segment = 0; // 0: system segment
+  desc.bits.long_mode = 0;
+  desc.bits.granularity = 0; // limit はバイト単位
+}
+
 void SetupSegments() {
   gdt[0].data = 0;
   SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
@@ -50,6 +81,31 @@ void SetupSegments() {
 void InitializeSegmentation() {
   SetupSegments();
 
+  // GS を読み込み直すとベースが 0 に戻るので，CurrentCPU が使う CPU ごとの領域を指し直す
+  const uint64_t gs_base = ReadMSR(kMSRGSBase);
   SetDSAll(kKernelDS);
+  WriteMSR(kMSRGSBase, gs_base);
   SetCSSS(kKernelCS, kKernelSS);
 }
+
+Error InitializeTSS(int cpu) {
+  auto& t = tss[cpu];
+  t = {};
+  for (int ist : {kISTForPageFault, kISTForDoubleFault}) {
+    auto [ stack, err ] = stack_pool->Allocate(kISTStackBytes);
+    if (err) {
+      return err;
+    }
+    t.ist[ist - 1] = stack.End() & ~0xflu;
+  }
+  t.iomap_base = sizeof(TaskStateSegment); // I/O 許可ビットマップは持たない
+
+  const int index = kTSSIndex + 2 * cpu;
+  const auto addr = reinterpret_cast<uint64_t>(&t);
+  SetSystemSegment(gdt[index], DescriptorType::kTSSAvailable, 0,
+                   addr & 0xffffffffu, sizeof(TaskStateSegment) - 1);
+  gdt[index + 1].data = addr >> 32;
+
+  LoadTR(index << 3);
+  return MAKE_ERROR(Error::kSuccess);
+}
@@ -9,6 +9,7 @@
 #include <array>
 #include <cstdint>
 
+#include "error.hpp"
 #include "x86_descriptor.hpp"
 
 union SegmentDescriptor {
@@ -40,10 +41,26 @@ void SetDataSegment(SegmentDescriptor& desc,
                     unsigned int descriptor_privilege_level,
                     uint32_t base,
                     uint32_t limit);
+void SetSystemSegment(SegmentDescriptor& desc,
+                      DescriptorType type,
+                      unsigned int descriptor_privilege_level,
+                      uint32_t base,
+                      uint32_t limit);
 
 const uint16_t kKernelCS = 1 << 3;
 const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
 
+/** @brief 例外ハンドラが使う IST の番号．スタックが壊れていても別のスタックで処理できる． */
+const int kISTForPageFault = 1;
+const int kISTForDoubleFault = 2;
+
 void SetupSegments();
 void InitializeSegmentation();
+
+/** @brief cpu 番の CPU の TSS を設定し，TR に読み込む．
+ *
+ * IST に #PF と #DF 用のスタックを stack_pool から確保して設定するので，
+ * InitializeStackPool の後に，その CPU 上で呼び出すこと．
+ */
+Error InitializeTSS(int cpu);
@@ -0,0 +1,386 @@
+#include "slab.hpp"
+
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <new>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+  const uint32_t kSlabMagic = 0x42414c53;  // "SLAB"
+  const uint32_t kLargeMagic = 0x4752414c; // "LARG"
+  const size_t kAlignment = 16;
+
+  /** @brief フレーム数 num_frames の大きな割り当ての先頭に置くヘッダ */
+  struct LargeHeader {
+    uint32_t magic;
+    size_t num_frames;
+  };
+  const size_t kLargeHeaderBytes = (sizeof(LargeHeader) + kAlignment - 1) & ~(kAlignment - 1);
+
+  uint32_t MagicOf(void* p) {
+    return *reinterpret_cast<uint32_t*>(reinterpret_cast<uintptr_t>(p) & ~(kBytesPerFrame - 1));
+  }
+}
+
+struct SlabAllocator::Slab {
+  uint32_t magic;
+  int size_class;
+  /** @brief 使用中のオブジェクト数 */
+  size_t in_use;
+  size_t capacity;
+  FreeObject* free_list;
+  /** @brief SizeClass::partial のリスト */
+  Slab* prev;
+  Slab* next;
+
+  static const size_t kHeaderBytes;
+
+  void Unlink(Slab*& head) {
+    if (prev) {
+      prev->next = next;
+    } else {
+      head = next;
+    }
+    if (next) {
+      next->prev = prev;
+    }
+    prev = next = nullptr;
+  }
+
+  void PushTo(Slab*& head) {
+    prev = nullptr;
+    next = head;
+    if (head) {
+      head->prev = this;
+    }
+    head = this;
+  }
+};
+
+const size_t SlabAllocator::Slab::kHeaderBytes =
+  (sizeof(SlabAllocator::Slab) + kAlignment - 1) & ~(kAlignment - 1);
+
+const std::array<size_t, SlabAllocator::kNumSizeClasses> SlabAllocator::kClassBytes{
+  16, 32, 64, 128, 256, 512, 1024,
+};
+
+void* SlabAllocator::Allocate(size_t bytes) {
+  if (bytes > kMaxSlabBytes) {
+    return AllocateLarge(bytes, kAlignment);
+  }
+
+  const int size_class = SizeClassOf(bytes);
+  auto& c = classes_[size_class];
+  SpinLockGuard guard{c.lock};
+  Slab* slab = c.partial;
+  if (slab == nullptr) {
+    if (c.empty) {
+      slab = c.empty;
+      c.empty = nullptr;
+    } else if ((slab = NewSlab(size_class)) == nullptr) {
+      return nullptr;
+    } else {
+      ++c.stats.slabs;
+      c.stats.free += slab->capacity;
+    }
+    slab->PushTo(c.partial);
+  }
+
+  FreeObject* object = slab->free_list;
+  slab->free_list = object->next;
+  ++slab->in_use;
+  if (slab->free_list == nullptr) {
+    slab->Unlink(c.partial);
+  }
+
+  ++c.stats.in_use;
+  --c.stats.free;
+  ++c.stats.allocs;
+  return object;
+}
+
+void* SlabAllocator::AllocateAligned(size_t alignment, size_t bytes) {
+  if (alignment > kMaxAlignment || (alignment & (alignment - 1)) != 0) {
+    return nullptr;
+  }
+  if (alignment <= kAlignment) {
+    return Allocate(bytes);
+  }
+  return AllocateLarge(bytes, alignment);
+}
+
+void SlabAllocator::Free(void* p) {
+  if (p == nullptr) {
+    return;
+  }
+
+  const auto frame = reinterpret_cast<uintptr_t>(p) & ~(kBytesPerFrame - 1);
+  if (MagicOf(p) == kLargeMagic) {
+    auto header = reinterpret_cast<LargeHeader*>(frame);
+    const size_t num_frames = header->num_frames;
+    header->magic = 0;
+    FreeFrames(FrameID{frame / kBytesPerFrame}, num_frames);
+
+    SpinLockGuard guard{large_lock_};
+    --large_stats_.in_use;
+    large_stats_.frames_in_use -= num_frames;
+    ++large_stats_.frees;
+    return;
+  }
+  if (MagicOf(p) != kSlabMagic) {
+    Log(kError, "SlabAllocator::Free: invalid pointer %p\n", p);
+    return;
+  }
+
+  auto slab = reinterpret_cast<Slab*>(frame);
+  auto& c = classes_[slab->size_class];
+  SpinLockGuard guard{c.lock};
+  auto object = reinterpret_cast<FreeObject*>(p);
+  const bool was_full = slab->free_list == nullptr;
+  object->next = slab->free_list;
+  slab->free_list = object;
+  --slab->in_use;
+
+  --c.stats.in_use;
+  ++c.stats.free;
+  ++c.stats.frees;
+
+  if (was_full) {
+    slab->PushTo(c.partial);
+  }
+  if (slab->in_use > 0) {
+    return;
+  }
+
+  slab->Unlink(c.partial);
+  if (c.empty == nullptr) {
+    c.empty = slab;
+    return;
+  }
+  --c.stats.slabs;
+  c.stats.free -= slab->capacity;
+  slab->magic = 0;
+  FreeFrames(FrameID{frame / kBytesPerFrame}, 1);
+}
+
+size_t SlabAllocator::UsableSize(void* p) const {
+  if (p == nullptr) {
+    return 0;
+  }
+  const auto frame = reinterpret_cast<uintptr_t>(p) & ~(kBytesPerFrame - 1);
+  if (MagicOf(p) == kLargeMagic) {
+    return reinterpret_cast<LargeHeader*>(frame)->num_frames * kBytesPerFrame -
+      (reinterpret_cast<uintptr_t>(p) - frame);
+  }
+  return kClassBytes[reinterpret_cast<Slab*>(frame)->size_class];
+}
+
+SlabAllocator::ClassStats SlabAllocator::Stats(int size_class) {
+  auto& c = classes_[size_class];
+  SpinLockGuard guard{c.lock};
+  return c.stats;
+}
+
+SlabAllocator::LargeStats SlabAllocator::Large() {
+  SpinLockGuard guard{large_lock_};
+  return large_stats_;
+}
+
+void SlabAllocator::Report() {
+  for (int i = 0; i < kNumSizeClasses; ++i) {
+    const auto stats = Stats(i);
+    Log(kWarn, "slab %4lu B: slabs %lu, in use %lu, free %lu, allocs %lu, frees %lu\n",
+        kClassBytes[i], stats.slabs, stats.in_use, stats.free, stats.allocs, stats.frees);
+  }
+  const auto large = Large();
+  Log(kWarn, "large: in use %lu (%lu frames), allocs %lu, frees %lu\n",
+      large.in_use, large.frames_in_use, large.allocs, large.frees);
+}
+
+int SlabAllocator::SizeClassOf(size_t bytes) {
+  int size_class = 0;
+  while (kClassBytes[size_class] < bytes) {
+    ++size_class;
+  }
+  return size_class;
+}
+
+SlabAllocator::Slab* SlabAllocator::NewSlab(int size_class) {
+  const auto frame = AllocateFrames(1);
+  if (frame.error) {
+    return nullptr;
+  }
+
+  auto slab = reinterpret_cast<Slab*>(frame.value.Frame());
+  const size_t object_bytes = kClassBytes[size_class];
+  slab->magic = kSlabMagic;
+  slab->size_class = size_class;
+  slab->in_use = 0;
+  slab->capacity = (kBytesPerFrame - Slab::kHeaderBytes) / object_bytes;
+  slab->prev = slab->next = nullptr;
+
+  // オブジェクトを先頭から順に取り出せるようにフリーリストを後ろから繋ぐ
+  const auto objects = reinterpret_cast<uintptr_t>(slab) + Slab::kHeaderBytes;
+  slab->free_list = nullptr;
+  for (size_t i = slab->capacity; i > 0; --i) {
+    auto object = reinterpret_cast<FreeObject*>(objects + (i - 1) * object_bytes);
+    object->next = slab->free_list;
+    slab->free_list = object;
+  }
+  return slab;
+}
+
+void* SlabAllocator::AllocateLarge(size_t bytes, size_t alignment) {
+  // alignment <= kMaxAlignment なので，揃えた先頭もヘッダと同じ先頭のフレームに入る
+  const size_t offset = std::max(kLargeHeaderBytes, alignment);
+  if (bytes > std::numeric_limits<size_t>::max() - offset - kBytesPerFrame) {
+    return nullptr;
+  }
+  const size_t num_frames = (bytes + offset + kBytesPerFrame - 1) / kBytesPerFrame;
+  const auto frame = AllocateFrames(num_frames);
+  if (frame.error) {
+    return nullptr;
+  }
+
+  auto header = reinterpret_cast<LargeHeader*>(frame.value.Frame());
+  header->magic = kLargeMagic;
+  header->num_frames = num_frames;
+  {
+    SpinLockGuard guard{large_lock_};
+    ++large_stats_.in_use;
+    large_stats_.frames_in_use += num_frames;
+    ++large_stats_.allocs;
+  }
+  return reinterpret_cast<char*>(header) + offset;
+}
+
+SlabAllocator* slab_allocator;
+
+namespace {
+  alignas(SlabAllocator) char slab_allocator_buf[sizeof(SlabAllocator)];
+}
+
+void InitializeSlabAllocator() {
+  slab_allocator = new(slab_allocator_buf) SlabAllocator;
+}
+
+/*
+ * newlib の malloc の代わりに slab_allocator から割り当てる．
+ * newlib 内部の呼び出しも届くように，再入可能版（_r の付く関数）も定義する．
+ * operator new は libc++abi の実装が malloc を呼ぶのでここに来る．
+ */
+extern "C" {
+
+void* malloc(size_t bytes) {
+  if (slab_allocator == nullptr) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  void* p = slab_allocator->Allocate(bytes);
+  if (p == nullptr) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+void free(void* p) {
+  if (slab_allocator) {
+    slab_allocator->Free(p);
+  }
+}
+
+void* calloc(size_t num, size_t bytes) {
+  if (bytes != 0 && num > std::numeric_limits<size_t>::max() / bytes) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  void* p = malloc(num * bytes);
+  if (p) {
+    memset(p, 0, num * bytes);
+  }
+  return p;
+}
+
+void* realloc(void* p, size_t bytes) {
+  if (p == nullptr) {
+    return malloc(bytes);
+  }
+  if (slab_allocator == nullptr) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  const size_t usable = slab_allocator->UsableSize(p);
+  if (bytes <= usable) {
+    return p;
+  }
+  void* q = malloc(bytes);
+  if (q) {
+    memcpy(q, p, usable);
+    free(p);
+  }
+  return q;
+}
+
+void* memalign(size_t alignment, size_t bytes) {
+  if (slab_allocator == nullptr) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  if (alignment > SlabAllocator::kMaxAlignment || (alignment & (alignment - 1)) != 0) {
+    // 対応できないアライメントは黙って小さく揃えず，失敗させる
+    errno = EINVAL;
+    return nullptr;
+  }
+  void* p = slab_allocator->AllocateAligned(alignment, bytes);
+  if (p == nullptr) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t bytes) {
+  if (alignment < sizeof(void*)) {
+    return EINVAL;
+  }
+  const int saved_errno = errno;
+  void* p = memalign(alignment, bytes);
+  const int err = errno;
+  errno = saved_errno; // posix_memalign は errno を変えない
+  if (p == nullptr) {
+    return err;
+  }
+  *memptr = p;
+  return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t bytes) {
+  return memalign(alignment, bytes);
+}
+
+struct _reent;
+
+void* _malloc_r(_reent*, size_t bytes) {
+  return malloc(bytes);
+}
+
+void _free_r(_reent*, void* p) {
+  free(p);
+}
+
+void* _calloc_r(_reent*, size_t num, size_t bytes) {
+  return calloc(num, bytes);
+}
+
+void* _realloc_r(_reent*, void* p, size_t bytes) {
+  return realloc(p, bytes);
+}
+
+void* _memalign_r(_reent*, size_t alignment, size_t bytes) {
+  return memalign(alignment, bytes);
+}
+
+}
@@ -0,0 +1,100 @@
+/**
+ * @file slab.hpp
+ *
+ * カーネルのヒープ．malloc と new は newlib の malloc ではなくここで割り当てる．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "spinlock.hpp"
+
+/** @brief 小さなオブジェクトをサイズクラスごとのスラブから割り当てるアロケータ．
+ *
+ * スラブは 1 フレームで，先頭にヘッダを置き，残りを同じ大きさのオブジェクトに分ける．
+ * kMaxSlabBytes を超える要求はフレームを直接確保し，先頭にヘッダを置いて返す．
+ * どちらの場合も解放するポインタを含むフレームの先頭にヘッダがあるので，
+ * Free には大きさを渡さなくてよい．
+ *
+ * 空になったスラブはサイズクラスごとに 1 つだけ残し，それ以外はフレームを返す．
+ */
+class SlabAllocator {
+ public:
+  static const int kNumSizeClasses = 7;
+  /** @brief 各サイズクラスのオブジェクトの大きさ（バイト） */
+  static const std::array<size_t, kNumSizeClasses> kClassBytes;
+  /** @brief スラブから割り当てる最大の大きさ（バイト） */
+  static const size_t kMaxSlabBytes = 1024;
+  /** @brief AllocateAligned に指定できる最大のアライメント（バイト） */
+  static const size_t kMaxAlignment = 2048;
+
+  /** @brief サイズクラスごとの統計情報 */
+  struct ClassStats {
+    size_t slabs{0};     // 確保しているスラブ数
+    size_t in_use{0};    // 使用中のオブジェクト数
+    size_t free{0};      // スラブ上の空きオブジェクト数
+    uint64_t allocs{0};  // これまでの割り当て回数
+    uint64_t frees{0};   // これまでの解放回数
+  };
+
+  /** @brief kMaxSlabBytes を超える割り当ての統計情報 */
+  struct LargeStats {
+    size_t in_use{0};        // 使用中の割り当て数
+    size_t frames_in_use{0}; // 使用中のフレーム数
+    uint64_t allocs{0};
+    uint64_t frees{0};
+  };
+
+  /** @brief bytes バイト以上の領域を 16 バイト境界で割り当てる．確保できなければ nullptr． */
+  void* Allocate(size_t bytes);
+  /** @brief bytes バイト以上の領域を alignment バイト境界で割り当てる．
+   *
+   * alignment は 2 のべき乗で kMaxAlignment 以下であること．そうでなければ nullptr を返す．
+   * 16 バイトを超えるアライメントではスラブを使わず，フレームを直接確保してその中で揃える．
+   */
+  void* AllocateAligned(size_t alignment, size_t bytes);
+  /** @brief Allocate か AllocateAligned で割り当てた領域を解放する．nullptr なら何もしない． */
+  void Free(void* p);
+  /** @brief Allocate か AllocateAligned で割り当てた領域の実際に使える大きさ */
+  size_t UsableSize(void* p) const;
+
+  ClassStats Stats(int size_class);
+  LargeStats Large();
+  /** @brief 統計情報をログに出力する． */
+  void Report();
+
+ private:
+  struct FreeObject {
+    FreeObject* next;
+  };
+  struct Slab;
+
+  /** @brief サイズクラスごとのスラブの一覧 */
+  struct SizeClass {
+    /** @brief 空きオブジェクトが残っているスラブのリスト */
+    Slab* partial{nullptr};
+    /** @brief 解放せずに残しておく空のスラブ */
+    Slab* empty{nullptr};
+    ClassStats stats;
+    SpinLock lock;
+  };
+
+  /** @brief bytes を割り当てられる最小のサイズクラス */
+  static int SizeClassOf(size_t bytes);
+  /** @brief 新しいスラブをフレームから確保してオブジェクトに分ける． */
+  Slab* NewSlab(int size_class);
+  /** @brief フレームを直接確保し，ヘッダの後ろを alignment に揃えて返す． */
+  void* AllocateLarge(size_t bytes, size_t alignment);
+
+  std::array<SizeClass, kNumSizeClasses> classes_{};
+  LargeStats large_stats_{};
+  SpinLock large_lock_;
+};
+
+extern SlabAllocator* slab_allocator;
+
+/** @brief slab_allocator を作る．InitializeMemoryManager の直後，new を使う前に呼ぶ． */
+void InitializeSlabAllocator();
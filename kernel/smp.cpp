@@ -0,0 +1,214 @@
+#include "smp.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "segment.hpp"
+#include "spinlock.hpp"
+#include "stack_pool.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+extern "C" {
+  extern uint8_t ap_trampoline_start[], ap_trampoline_end[];
+  extern uint8_t ap_param_cr3[], ap_param_stack[], ap_param_entry[];
+}
+
+namespace {
+  const uint32_t kICRLevelAssert = 1u << 14;
+  const uint32_t kICRInit = 0b101u << 8;
+  const uint32_t kICRStartup = 0b110u << 8;
+
+  const size_t kAPStackBytes = 16_KiB;
+
+  /** @brief CPU ごとの領域．各 CPU の GS のベースが自身の要素を指す． */
+  struct CPULocal {
+    int cpu; // CurrentCPU が %gs:0 から読むので先頭に置く
+  };
+  std::array<CPULocal, kMaxCPUs> cpu_locals{};
+
+  std::array<uint32_t, kMaxCPUs> cpu_to_apic_id{};
+  std::atomic<int> num_cpus{1};
+  std::atomic<bool> ap_started{false};
+  /** @brief 起動中の AP に割り当てた CPU 番号．AP は 1 つずつ起動する． */
+  std::atomic<int> starting_cpu{kBSPCPU};
+
+  /** @brief TLB シュートダウンを同時に 1 つに限るロック */
+  SpinLock tlb_flush_lock;
+  /** @brief 各 CPU への TLB 破棄の依頼．破棄した CPU が false に戻す． */
+  std::array<std::atomic<bool>, kMaxCPUs> tlb_flush_pending{};
+
+  /** @brief AP がトランポリンから最初に呼び出す関数． */
+  void APMain() {
+    InitializeCPULocal(starting_cpu);
+    InitializeSegmentation();
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    InitializeLocalAPIC();
+    if (auto err = InitializeTSS(CurrentCPU())) {
+      Log(kWarn, "failed to initialize TSS of CPU %d: %s\n", CurrentCPU(), err.Name());
+    }
+
+    // 以降，この実行コンテキストがこの CPU のアイドルタスクになる
+    task_manager->InitializeCPU(CurrentCPU());
+    InitializeLocalAPICTimer();
+    ap_started = true;
+
+    __asm__("sti");
+    while (true) __asm__("hlt");
+  }
+
+  uint64_t* TrampolineParam(uint8_t* trampoline, uint8_t* param) {
+    return reinterpret_cast<uint64_t*>(trampoline + (param - ap_trampoline_start));
+  }
+
+  bool StartAP(uint32_t apic_id, uint8_t* trampoline) {
+    const int cpu = num_cpus;
+    auto [ stack, err ] = stack_pool->Allocate(kAPStackBytes);
+    if (err) {
+      Log(kWarn, "failed to allocate AP stack: %s\n", err.Name());
+      return false;
+    }
+    *TrampolineParam(trampoline, ap_param_stack) = stack.End() & ~0xflu;
+
+    cpu_to_apic_id[cpu] = apic_id;
+    starting_cpu = cpu;
+    ap_started = false;
+
+    const uint8_t sipi_vector = reinterpret_cast<uintptr_t>(trampoline) >> 12;
+    SendLAPICIPI(apic_id, kICRInit | kICRLevelAssert);
+    acpi::WaitMilliseconds(10);
+    for (int i = 0; i < 2 && !ap_started; ++i) {
+      SendLAPICIPI(apic_id, kICRStartup | sipi_vector);
+      acpi::WaitMilliseconds(1);
+    }
+    for (int ms = 0; ms < 100 && !ap_started; ++ms) {
+      acpi::WaitMilliseconds(1);
+    }
+
+    if (!ap_started) {
+      // 遅れて起動したときのためにスタックは返さない
+      Log(kWarn, "AP (APIC ID %u) did not start\n", apic_id);
+      return false;
+    }
+    ++num_cpus;
+    return true;
+  }
+}
+
+void InitializeCPULocal(int cpu) {
+  cpu_locals[cpu].cpu = cpu;
+  WriteMSR(kMSRGSBase, reinterpret_cast<uint64_t>(&cpu_locals[cpu]));
+}
+
+int NumCPUs() {
+  return num_cpus;
+}
+
+void SendIPI(int cpu, uint8_t vector) {
+  SendLAPICIPI(cpu_to_apic_id[cpu], vector); // Fixed, Physical destination
+}
+
+void FlushTLBAllCPUs() {
+  InterruptGuard guard;
+  // 他の CPU がシュートダウン中なら，その依頼に応えながら順番を待つ
+  while (!tlb_flush_lock.TryLock()) {
+    ServiceTLBFlush();
+    __asm__ volatile("pause");
+  }
+
+  // 書き換えは稀なので，ページごとの invlpg ではなく CR3 の再設定ですべて破棄する
+  SetCR3(GetCR3());
+  const int self = CurrentCPU();
+  const int n = NumCPUs();
+  for (int cpu = 0; cpu < n; ++cpu) {
+    if (cpu != self) {
+      tlb_flush_pending[cpu].store(true, std::memory_order_release);
+      SendIPI(cpu, InterruptVector::kTLBFlush);
+    }
+  }
+  for (int cpu = 0; cpu < n; ++cpu) {
+    while (cpu != self && tlb_flush_pending[cpu].load(std::memory_order_acquire)) {
+      __asm__ volatile("pause");
+    }
+  }
+
+  tlb_flush_lock.Unlock();
+}
+
+void ServiceTLBFlush() {
+  auto& pending = tlb_flush_pending[CurrentCPU()];
+  if (pending.load(std::memory_order_acquire)) {
+    SetCR3(GetCR3());
+    pending.store(false, std::memory_order_release);
+  }
+}
+
+void InitializeSMP() {
+  const uint32_t bsp_apic_id = LocalAPICID();
+  cpu_to_apic_id[kBSPCPU] = bsp_apic_id;
+
+  if (acpi::madt == nullptr) {
+    return;
+  }
+
+  // AP はリアルモードで起動するので，トランポリンは 1MiB 未満に置く
+  const auto frame = TakeLowMemoryFrame();
+  if (frame.error) {
+    Log(kWarn, "no frame below 1MiB for AP trampoline: %s\n", frame.error.Name());
+    return;
+  }
+  if (reinterpret_cast<uintptr_t>(frame.value.Frame()) + kBytesPerFrame > kLowMemoryLimit) {
+    Log(kWarn, "AP trampoline frame %08lx is not below 1MiB\n",
+        reinterpret_cast<uintptr_t>(frame.value.Frame()));
+    FreeFrames(frame.value, 1);
+    return;
+  }
+  auto trampoline = reinterpret_cast<uint8_t*>(frame.value.Frame());
+  memcpy(trampoline, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+  *TrampolineParam(trampoline, ap_param_cr3) = GetCR3();
+  *TrampolineParam(trampoline, ap_param_entry) = reinterpret_cast<uint64_t>(APMain);
+
+  for (auto p = acpi::madt->EntriesBegin(); p < acpi::madt->EntriesEnd();
+       p += reinterpret_cast<const acpi::MADTEntryHeader*>(p)->length) {
+    auto header = reinterpret_cast<const acpi::MADTEntryHeader*>(p);
+    if (header->length == 0) {
+      break;
+    }
+
+    // APIC ID が 255 以上の CPU は Type 9 のエントリにだけ載る。
+    // x2APIC モードでなければそれらの CPU には IPI を送れない
+    uint32_t apic_id, flags;
+    if (header->type == acpi::MADTLocalAPIC::kType) {
+      auto entry = reinterpret_cast<const acpi::MADTLocalAPIC*>(p);
+      apic_id = entry->apic_id;
+      flags = entry->flags;
+    } else if (header->type == acpi::MADTLocalX2APIC::kType && X2APICEnabled()) {
+      auto entry = reinterpret_cast<const acpi::MADTLocalX2APIC*>(p);
+      apic_id = entry->x2apic_id;
+      flags = entry->flags;
+    } else {
+      continue;
+    }
+
+    const auto cpus_end = cpu_to_apic_id.begin() + num_cpus;
+    if ((flags & 1) == 0 ||
+        std::find(cpu_to_apic_id.begin(), cpus_end, apic_id) != cpus_end) {
+      continue; // 同じ CPU が両方の種類のエントリに載っていることがある
+    }
+    if (num_cpus >= kMaxCPUs) {
+      Log(kWarn, "too many CPUs: ignoring APIC ID %u\n", apic_id);
+      continue;
+    }
+    StartAP(apic_id, trampoline);
+  }
+
+  Log(kWarn, "%d CPU(s) online\n", NumCPUs());
+}
@@ -0,0 +1,61 @@
+/**
+ * @file smp.hpp
+ *
+ * アプリケーションプロセッサ（AP）の起動と CPU 間割り込みを集めたファイル。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief 扱える CPU の最大数 */
+const int kMaxCPUs = 16;
+/** @brief ブートストラッププロセッサ（BSP）の CPU 番号 */
+const int kBSPCPU = 0;
+
+/** @brief IA32_GS_BASE MSR。カーネルでは CPU ごとの領域を指す。 */
+const uint32_t kMSRGSBase = 0xc0000101;
+
+/** @brief 実行中の CPU の番号（0 = BSP，1 以降 = AP）を返す。
+ *
+ * InitializeCPULocal が GS のベースに設定した CPU ごとの領域から読むので，
+ * Local APIC の ID（MMIO や RDMSR）を読みに行かない。
+ */
+inline int CurrentCPU() {
+  int cpu;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+/** @brief 実行中の CPU の GS のベースを，CPU 番号 cpu の CPU ごとの領域に向ける。
+ *
+ * CurrentCPU はこれより前に呼べない。BSP は KernelMainNewStack の最初で，
+ * AP は APMain の最初で呼ぶ。
+ */
+void InitializeCPULocal(int cpu);
+/** @brief 起動済みの CPU の数を返す。InitializeSMP 前は 1。 */
+int NumCPUs();
+/** @brief 指定した CPU に固定（Fixed）モードの CPU 間割り込みを送る。 */
+void SendIPI(int cpu, uint8_t vector);
+
+/** @brief すべての起動済み CPU の TLB を破棄する（TLB シュートダウン）。
+ *
+ * 自身の TLB を破棄してから他の CPU に InterruptVector::kTLBFlush を送り，
+ * すべての CPU が破棄し終えるまで待つ。ページテーブルを書き換えた後に呼ぶ。
+ * 他の CPU が割り込みを禁止したままこの CPU を待っていると戻れないので，
+ * スピンロックを持ったまま呼ばないこと。
+ */
+void FlushTLBAllCPUs();
+/** @brief 他の CPU から頼まれた TLB の破棄があれば実行する。
+ *
+ * 割り込みを禁止したまま FlushTLBAllCPUs を呼ぶ CPU を待つループは，
+ * 待っている間これを呼んで依頼に応えること。
+ */
+void ServiceTLBFlush();
+
+/** @brief MADT に記載された AP を INIT-SIPI-SIPI で起動する。
+ *
+ * acpi::Initialize，InitializeLAPICTimer，InitializeTask の後に呼ぶこと。
+ * 起動した AP はそれぞれ自身のアイドルタスクとして TaskManager に登録され，
+ * 実行可能なタスクを他の CPU から奪って実行する。
+ */
+void InitializeSMP();
@@ -0,0 +1,177 @@
+#include "softirq.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace {
+  struct Vector {
+    SoftIRQHandler* handler;
+    bool threaded;
+    /** @brief 保留ビットを立てた時刻 */
+    uint64_t raised_tsc;
+    SoftIRQStats stats;
+  };
+
+  std::array<Vector, SoftIRQ::kNum> vectors{};
+  /** @brief 以下の変数と WorkItem のリストを守る */
+  SpinLock softirq_lock;
+  uint32_t pending;
+  /** @brief ハンドラが登録済みのソフト割り込み */
+  uint32_t registered;
+  uint32_t threaded;
+  Task* softirq_task;
+
+  WorkItem* work_head;
+  WorkItem** work_tail = &work_head;
+
+  /** @brief softirq_lock を取得した状態で呼び，mask の保留ビットを取り出す。 */
+  uint32_t TakePendingLocked(uint32_t mask) {
+    const uint32_t bits = pending & mask;
+    pending &= ~bits;
+
+    const uint64_t now = ReadTSC();
+    for (uint32_t b = bits; b; b &= b - 1) {
+      auto& v = vectors[__builtin_ctz(b)];
+      v.stats.max_delay_tsc = std::max(v.stats.max_delay_tsc, now - v.raised_tsc);
+    }
+    return bits;
+  }
+
+  void RunHandlers(uint32_t bits) {
+    for (; bits; bits &= bits - 1) {
+      auto& v = vectors[__builtin_ctz(bits)];
+      const uint64_t start = ReadTSC();
+      v.handler();
+      const uint64_t elapsed = ReadTSC() - start;
+      ++v.stats.runs;
+      v.stats.total_tsc += elapsed;
+      v.stats.max_tsc = std::max(v.stats.max_tsc, elapsed);
+    }
+  }
+
+  void RunWork() {
+    while (true) {
+      WorkItem* item;
+      {
+        SpinLockGuard guard{softirq_lock};
+        item = work_head;
+        if (item == nullptr) {
+          return;
+        }
+        work_head = item->next;
+        if (work_head == nullptr) {
+          work_tail = &work_head;
+        }
+        item->queued = false;
+      }
+      item->func(item);
+    }
+  }
+
+  void SoftIRQTask(uint64_t task_id, int64_t data) {
+    while (true) {
+      uint32_t bits;
+      {
+        InterruptGuard guard;
+        softirq_lock.Lock();
+        while ((bits = TakePendingLocked(threaded)) == 0) {
+          task_manager->SleepAndUnlock(softirq_lock, true);
+          softirq_lock.Lock();
+        }
+        softirq_lock.Unlock();
+      }
+      RunHandlers(bits);
+    }
+  }
+}
+
+void RegisterSoftIRQ(SoftIRQ::Number n, SoftIRQHandler* handler, bool threaded_handler) {
+  bool wakeup;
+  {
+    SpinLockGuard guard{softirq_lock};
+    vectors[n].handler = handler;
+    vectors[n].threaded = threaded_handler;
+    registered |= 1u << n;
+    if (threaded_handler) {
+      threaded |= 1u << n;
+    } else {
+      threaded &= ~(1u << n);
+    }
+    wakeup = threaded_handler && (pending & (1u << n));
+  }
+  if (wakeup && softirq_task) {
+    task_manager->Wakeup(softirq_task);
+  }
+}
+
+void RaiseSoftIRQ(SoftIRQ::Number n) {
+  bool wakeup;
+  {
+    SpinLockGuard guard{softirq_lock};
+    auto& v = vectors[n];
+    ++v.stats.raised;
+    if ((pending & (1u << n)) == 0) {
+      pending |= 1u << n;
+      v.raised_tsc = ReadTSC();
+    }
+    wakeup = threaded & (1u << n);
+  }
+  if (wakeup && softirq_task) {
+    task_manager->Wakeup(softirq_task);
+  }
+}
+
+void RunSoftIRQs() {
+  if (CurrentCPU() != kBSPCPU) {
+    return;
+  }
+  uint32_t bits;
+  {
+    SpinLockGuard guard{softirq_lock};
+    bits = TakePendingLocked(registered & ~threaded);
+  }
+  RunHandlers(bits);
+}
+
+void QueueWork(WorkItem& item) {
+  {
+    SpinLockGuard guard{softirq_lock};
+    if (item.queued) {
+      return;
+    }
+    item.queued = true;
+    item.next = nullptr;
+    *work_tail = &item;
+    work_tail = &item.next;
+  }
+  RaiseSoftIRQ(SoftIRQ::kWork);
+}
+
+SoftIRQStats GetSoftIRQStats(SoftIRQ::Number n) {
+  SpinLockGuard guard{softirq_lock};
+  return vectors[n].stats;
+}
+
+void InitializeSoftIRQ() {
+  RegisterSoftIRQ(SoftIRQ::kWork, RunWork, true);
+
+  // タイマのコールバックや xHC の処理がスタックを使う
+  auto [ new_task, err ] = task_manager->NewTask(SoftIRQTask, 0, 16_KiB);
+  if (err) {
+    Log(kError, "failed to create soft IRQ task: %s\n", err.Name());
+    exit(1);
+  }
+  Task& task = new_task->SetAffinity(kBSPCPU);
+  {
+    SpinLockGuard guard{softirq_lock};
+    softirq_task = &task;
+  }
+  task.Wakeup(TaskManager::kMaxLevel);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file softirq.hpp
+ *
+ * 割り込みハンドラから後回しにした処理（ソフト割り込み）を実行する仕組み。
+ *
+ * 割り込みハンドラは RaiseSoftIRQ で保留ビットを立てて EOI を送るだけにし，
+ * 本来の処理はハンドラの出口（RunSoftIRQs）か，ソフト割り込み用のタスクで行う。
+ * ハンドラは BSP だけで実行する（TimerManager は BSP でしか操作できず，xHC の割り込みも BSP に来るため）。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+class SoftIRQ {
+ public:
+  enum Number {
+    /** @brief タイマホイールを進め，満了したタイマを通知する（割り込みの出口で実行） */
+    kTimer,
+    /** @brief 満了したタイマのコールバックを呼ぶ */
+    kTimerCallback,
+    /** @brief xHC のイベントリングを処理する */
+    kXHCI,
+    /** @brief QueueWork で積まれた WorkItem を実行する */
+    kWork,
+    kNum,
+  };
+};
+
+using SoftIRQHandler = void();
+
+/** @brief ソフト割り込みのハンドラを登録する。
+ *
+ * @param threaded  true ならハンドラはソフト割り込み用のタスクで割り込み許可のまま呼ばれ，
+ *   Mutex の取得などで休止してよい。false なら RunSoftIRQs から割り込み禁止のまま呼ばれるので，
+ *   短く，休止しない処理に限る。
+ */
+void RegisterSoftIRQ(SoftIRQ::Number n, SoftIRQHandler* handler, bool threaded);
+/** @brief ソフト割り込みの保留ビットを立てる。割り込みハンドラからも呼べる。
+ *
+ * threaded なソフト割り込みなら，ソフト割り込み用のタスクを起床させる。
+ * そうでなければ，次に BSP で RunSoftIRQs が呼ばれたときに実行される。
+ * ハンドラが未登録の間に立てたビットは，登録されるまで保留のまま残る。
+ */
+void RaiseSoftIRQ(SoftIRQ::Number n);
+/** @brief 保留中の threaded でないソフト割り込みを実行する。
+ *
+ * 割り込みハンドラの出口，EOI の後で呼ぶ。タスクを切り替える処理より前に呼ぶこと。
+ * AP で呼んだ場合は何もしない。
+ */
+void RunSoftIRQs();
+
+/** @brief ソフト割り込み用のタスクで実行する処理 */
+struct WorkItem {
+  void (*func)(WorkItem* item);
+  /** @brief 以下は QueueWork が使う */
+  WorkItem* next{nullptr};
+  bool queued{false};
+};
+
+/** @brief WorkItem をソフト割り込み用のタスクで実行するよう積む。
+ *
+ * 割り込みハンドラからも呼べる。実行待ちの WorkItem を再度積んでも 1 回しか実行されない。
+ * func が呼ばれた時点で WorkItem は再び積める状態になっている。
+ */
+void QueueWork(WorkItem& item);
+
+/** @brief ソフト割り込みごとの統計 */
+struct SoftIRQStats {
+  /** @brief RaiseSoftIRQ の回数 */
+  uint64_t raised;
+  /** @brief ハンドラを呼んだ回数。保留中に再度立てたビットはまとめて 1 回になる。 */
+  uint64_t runs;
+  /** @brief ハンドラの実行時間の合計と最大（TSC のカウント） */
+  uint64_t total_tsc;
+  uint64_t max_tsc;
+  /** @brief ビットを立ててからハンドラを呼ぶまでの時間の最大（TSC のカウント） */
+  uint64_t max_delay_tsc;
+};
+
+SoftIRQStats GetSoftIRQStats(SoftIRQ::Number n);
+
+/** @brief ソフト割り込み用のタスクを BSP 上に生成する。InitializeTask の後に呼ぶこと。 */
+void InitializeSoftIRQ();
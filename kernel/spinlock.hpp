@@ -0,0 +1,55 @@
+/**
+ * @file spinlock.hpp
+ *
+ * CPU 間の排他制御に使うスピンロックを集めたファイル．
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "interrupt.hpp"
+
+/** @brief 単純なテスト・アンド・セット方式のスピンロック．
+ *
+ * ロックを持ったまま割り込みハンドラが同じロックを取ろうとするとデッドロックするので，
+ * 割り込みハンドラと共有するデータには SpinLockGuard を使うこと．
+ */
+class SpinLock {
+ public:
+  void Lock() {
+    while (locked_.exchange(true, std::memory_order_acquire)) {
+      while (locked_.load(std::memory_order_relaxed)) {
+        __asm__ volatile("pause");
+      }
+    }
+  }
+
+  bool TryLock() {
+    return !locked_.exchange(true, std::memory_order_acquire);
+  }
+
+  void Unlock() {
+    locked_.store(false, std::memory_order_release);
+  }
+
+ private:
+  std::atomic<bool> locked_{false};
+};
+
+/** @brief 割り込みを禁止してからロックを取り，スコープ終了時に両方を元に戻す． */
+class SpinLockGuard {
+ public:
+  explicit SpinLockGuard(SpinLock& lock) : lock_{lock} {
+    lock_.Lock();
+  }
+  ~SpinLockGuard() {
+    lock_.Unlock();
+  }
+  SpinLockGuard(const SpinLockGuard&) = delete;
+  SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+ private:
+  InterruptGuard interrupt_guard_;
+  SpinLock& lock_;
+};
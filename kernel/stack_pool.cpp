@@ -0,0 +1,114 @@
+#include "stack_pool.hpp"
+
+#include <algorithm>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+namespace {
+  /** @brief 未使用のスタックを埋める値．ここが書き換わっていれば使用済み． */
+  const uint64_t kStackFillPattern = 0xcccccccccccccccc;
+
+  void FillStack(const TaskStack& stack) {
+    auto p = reinterpret_cast<uint64_t*>(stack.base);
+    for (size_t i = 0; i < stack.bytes / sizeof(uint64_t); ++i) {
+      p[i] = kStackFillPattern;
+    }
+  }
+}
+
+const std::array<size_t, StackPool::kNumSizeClasses> StackPool::kClassBytes{
+  4_KiB, 16_KiB, 64_KiB, 256_KiB,
+};
+
+WithError<TaskStack> StackPool::Allocate(size_t bytes) {
+  int size_class = 0;
+  while (size_class < kNumSizeClasses && kClassBytes[size_class] < bytes) {
+    ++size_class;
+  }
+  if (size_class == kNumSizeClasses) {
+    return {{}, MAKE_ERROR(Error::kNoEnoughMemory)};
+  }
+
+  TaskStack stack{0, kClassBytes[size_class], size_class};
+  if (auto err = Take(stack)) {
+    return {{}, err};
+  }
+
+  FillStack(stack);
+  return {stack, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error StackPool::Take(TaskStack& stack) {
+  const int size_class = stack.size_class;
+  {
+    SpinLockGuard guard{lock_};
+    if (auto free_stack = free_lists_[size_class]) {
+      free_lists_[size_class] = free_stack->next;
+      --stats_[size_class].free;
+      ++stats_[size_class].in_use;
+      stack.base = reinterpret_cast<uint64_t>(free_stack);
+      return MAKE_ERROR(Error::kSuccess);
+    }
+  }
+
+  // SetPagePresent は全 CPU の TLB 破棄を待つので，lock_ を離してから呼ぶ．
+  // 先頭の 1 フレームをガードページにする
+  const size_t num_frames = stack.bytes / kBytesPerFrame + 1;
+  const auto frame = AllocateFrames(num_frames);
+  if (frame.error) {
+    return frame.error;
+  }
+  const auto guard_page = reinterpret_cast<uint64_t>(frame.value.Frame());
+  if (auto err = SetPagePresent(guard_page, false)) {
+    FreeFrames(frame.value, num_frames);
+    return err;
+  }
+  stack.base = guard_page + kBytesPerFrame;
+
+  SpinLockGuard guard{lock_};
+  ++stats_[size_class].in_use;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void StackPool::Free(const TaskStack& stack) {
+  if (!stack.Valid()) {
+    return;
+  }
+
+  const size_t high_water = HighWaterMark(stack);
+  SpinLockGuard guard{lock_};
+  auto& stats = stats_[stack.size_class];
+  stats.max_high_water = std::max(stats.max_high_water, high_water);
+  --stats.in_use;
+  ++stats.free;
+
+  auto free_stack = reinterpret_cast<FreeStack*>(stack.base);
+  free_stack->next = free_lists_[stack.size_class];
+  free_lists_[stack.size_class] = free_stack;
+}
+
+size_t StackPool::HighWaterMark(const TaskStack& stack) {
+  auto p = reinterpret_cast<const uint64_t*>(stack.base);
+  const size_t num_words = stack.bytes / sizeof(uint64_t);
+  size_t i = 0;
+  while (i < num_words && p[i] == kStackFillPattern) {
+    ++i;
+  }
+  return (num_words - i) * sizeof(uint64_t);
+}
+
+void StackPool::Report() const {
+  for (int i = 0; i < kNumSizeClasses; ++i) {
+    const auto& stats = stats_[i];
+    Log(kWarn, "stack class %lu KiB: in use %lu, free %lu, max high water %lu bytes\n",
+        kClassBytes[i] / 1024, stats.in_use, stats.free, stats.max_high_water);
+  }
+}
+
+StackPool* stack_pool;
+
+void InitializeStackPool() {
+  stack_pool = new StackPool;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file stack_pool.hpp
+ *
+ * タスク用スタックを確保，再利用するプールを集めたファイル．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "spinlock.hpp"
+
+/** @brief スタックプールから確保したスタック 1 本を表す．
+ *
+ * base の直下の 1 フレームはガードページとしてマッピングを外してある．
+ */
+struct TaskStack {
+  /** @brief スタックとして使える領域の先頭（最下位）アドレス */
+  uint64_t base{0};
+  /** @brief スタックとして使える領域の大きさ（バイト） */
+  size_t bytes{0};
+  /** @brief 属するサイズクラス．-1 なら有効なスタックではない． */
+  int size_class{-1};
+
+  /** @brief スタック領域の終端（最上位の次）のアドレス */
+  uint64_t End() const { return base + bytes; }
+  bool Valid() const { return size_class >= 0; }
+};
+
+/** @brief タスク用スタックをサイズクラスごとに管理するプール．
+ *
+ * スタックは memory_manager から直接フレーム単位で確保するので，
+ * newlib のヒープを断片化させない．
+ * 解放されたスタックはフレームを返さずにサイズクラスごとのフリーリストに繋ぎ，
+ * 次の Allocate で再利用する．
+ */
+class StackPool {
+ public:
+  static const int kNumSizeClasses = 4;
+  /** @brief 各サイズクラスのスタックの大きさ（バイト）．ガードページは含まない． */
+  static const std::array<size_t, kNumSizeClasses> kClassBytes;
+
+  /** @brief サイズクラスごとの統計情報 */
+  struct ClassStats {
+    size_t in_use{0}; // 使用中のスタック数
+    size_t free{0};   // フリーリスト上のスタック数
+    size_t max_high_water{0}; // 返却されたスタックの使用量の最大値（バイト）
+  };
+
+  /** @brief bytes 以上の大きさを持つ最小のサイズクラスからスタックを確保する．
+   *
+   * 確保したスタックは高水位を測るための値で埋めた状態で返される．
+   */
+  WithError<TaskStack> Allocate(size_t bytes);
+  /** @brief スタックをプールに返却する．フレームは解放しない． */
+  void Free(const TaskStack& stack);
+
+  /** @brief スタックがこれまでに使われた最大の深さ（バイト）を返す． */
+  static size_t HighWaterMark(const TaskStack& stack);
+  const ClassStats& Stats(int size_class) const { return stats_[size_class]; }
+  /** @brief サイズクラスごとの統計情報をログに出力する． */
+  void Report() const;
+
+ private:
+  struct FreeStack {
+    FreeStack* next;
+  };
+
+  /** @brief stack.size_class のスタックをフリーリストから取るか新たに確保し，stack.base に設定する． */
+  Error Take(TaskStack& stack);
+
+  std::array<FreeStack*, kNumSizeClasses> free_lists_{};
+  std::array<ClassStats, kNumSizeClasses> stats_{};
+  /** @brief 複数の CPU からの Allocate，Free を排他する */
+  SpinLock lock_;
+};
+
+extern StackPool* stack_pool;
+
+void InitializeStackPool();
@@ -0,0 +1,186 @@
+#include "sync.hpp"
+
+#include "smp.hpp"
+#include "task.hpp"
+
+namespace {
+  /** @brief 休止する前にロックの解放を待ってスピンする回数 */
+  const int kSpinCount = 100;
+
+  template <class F>
+  bool SpinTry(F try_func) {
+    if (NumCPUs() <= 1) {
+      // 相手は同じ CPU 上で止まっているのでスピンしても解放されない
+      return false;
+    }
+    for (int i = 0; i < kSpinCount; ++i) {
+      if (try_func()) {
+        return true;
+      }
+      __asm__ volatile("pause");
+    }
+    return false;
+  }
+
+  /** @brief lock を持った状態で呼び，task が Pop されるまで休止する。戻るときも lock を持つ。 */
+  void SleepUntilDone(SpinLock& lock, Task* task) {
+    while (!WaitQueue::Done(task)) {
+      task_manager->SleepAndUnlock(lock, false); // ロック待ちはレベルを上げない
+      lock.Lock();
+    }
+  }
+}
+
+void WaitQueue::Push(Task* task) {
+  task->wait_next_ = nullptr;
+  task->wait_done_ = false;
+  if (tail_) {
+    tail_->wait_next_ = task;
+  } else {
+    head_ = task;
+  }
+  tail_ = task;
+}
+
+Task* WaitQueue::Pop() {
+  Task* task = head_;
+  if (task == nullptr) {
+    return nullptr;
+  }
+  head_ = task->wait_next_;
+  if (head_ == nullptr) {
+    tail_ = nullptr;
+  }
+  task->wait_next_ = nullptr;
+  task->wait_done_ = true;
+  return task;
+}
+
+bool WaitQueue::Done(const Task* task) {
+  return task->wait_done_;
+}
+
+void Mutex::Lock() {
+  if (TryLock() || SpinTry([this]{ return TryLock(); })) {
+    return;
+  }
+
+  InterruptGuard guard;
+  Task* current_task = &task_manager->CurrentTask();
+  lock_.Lock();
+  if (!locked_) {
+    locked_ = true;
+    owner_ = current_task;
+  } else {
+    waiters_.Push(current_task);
+    SleepUntilDone(lock_, current_task); // Unlock が owner_ を設定してくれる
+  }
+  lock_.Unlock();
+}
+
+bool Mutex::TryLock() {
+  SpinLockGuard guard{lock_};
+  if (locked_) {
+    return false;
+  }
+  locked_ = true;
+  // タスク管理の初期化前にも使えるようにする
+  owner_ = task_manager ? &task_manager->CurrentTask() : nullptr;
+  return true;
+}
+
+void Mutex::Unlock() {
+  Task* next;
+  {
+    SpinLockGuard guard{lock_};
+    next = waiters_.Pop();
+    owner_ = next;
+    locked_ = next != nullptr;
+  }
+  if (next) {
+    task_manager->Wakeup(next);
+  }
+}
+
+void Semaphore::Wait() {
+  if (TryWait() || SpinTry([this]{ return TryWait(); })) {
+    return;
+  }
+
+  InterruptGuard guard;
+  Task* current_task = &task_manager->CurrentTask();
+  lock_.Lock();
+  if (count_ > 0) {
+    --count_;
+  } else {
+    waiters_.Push(current_task);
+    SleepUntilDone(lock_, current_task);
+  }
+  lock_.Unlock();
+}
+
+bool Semaphore::TryWait() {
+  SpinLockGuard guard{lock_};
+  if (count_ == 0) {
+    return false;
+  }
+  --count_;
+  return true;
+}
+
+void Semaphore::Signal() {
+  Task* next;
+  {
+    SpinLockGuard guard{lock_};
+    next = waiters_.Pop();
+    if (next == nullptr) {
+      ++count_;
+    }
+  }
+  if (next) {
+    task_manager->Wakeup(next);
+  }
+}
+
+void CondVar::Wait(Mutex& mutex) {
+  {
+    InterruptGuard guard;
+    Task* current_task = &task_manager->CurrentTask();
+    lock_.Lock();
+    waiters_.Push(current_task);
+    lock_.Unlock();
+
+    // Push した後なので，ここで Signal されても取りこぼさない
+    mutex.Unlock();
+
+    lock_.Lock();
+    SleepUntilDone(lock_, current_task);
+    lock_.Unlock();
+  }
+  mutex.Lock();
+}
+
+void CondVar::Signal() {
+  Task* next;
+  {
+    SpinLockGuard guard{lock_};
+    next = waiters_.Pop();
+  }
+  if (next) {
+    task_manager->Wakeup(next);
+  }
+}
+
+void CondVar::Broadcast() {
+  while (true) {
+    Task* next;
+    {
+      SpinLockGuard guard{lock_};
+      next = waiters_.Pop();
+    }
+    if (next == nullptr) {
+      break;
+    }
+    task_manager->Wakeup(next);
+  }
+}
@@ -0,0 +1,98 @@
+/**
+ * @file sync.hpp
+ *
+ * タスク間の排他制御，同期のための休止可能なプリミティブを集めたファイル。
+ *
+ * いずれも待つ間はタスクを休止させ，CPU を他のタスクに譲る。
+ * 割り込みハンドラから待つ操作（Lock，Wait）を呼んではならない。
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "spinlock.hpp"
+
+class Task;
+
+/** @brief Task に埋め込まれたリンクで待ちタスクを繋ぐ FIFO キュー。
+ *
+ * タスクは同時に 1 つの WaitQueue にしか入れない。メモリ確保は行わない。
+ */
+class WaitQueue {
+ public:
+  /** @brief タスクを末尾に加え，待ち状態にする。 */
+  void Push(Task* task);
+  /** @brief 先頭のタスクを取り出し，待ち完了の印を付ける。空なら nullptr。 */
+  Task* Pop();
+  bool Empty() const { return head_ == nullptr; }
+  /** @brief Push されたタスクが Pop されたかどうかを返す。 */
+  static bool Done(const Task* task);
+
+ private:
+  Task* head_{nullptr};
+  Task* tail_{nullptr};
+};
+
+/** @brief 休止可能な相互排他ロック。
+ *
+ * ロックが取れなければ（マルチプロセッサなら少しスピンしてから）休止する。
+ * Unlock は待っているタスクがあればロックをそのタスクへ直接渡してから起床させる。
+ */
+class Mutex {
+ public:
+  void Lock();
+  bool TryLock();
+  void Unlock();
+
+ private:
+  SpinLock lock_;
+  bool locked_{false};
+  Task* owner_{nullptr};
+  WaitQueue waiters_;
+};
+
+/** @brief スコープの間 Mutex をロックする。 */
+class MutexGuard {
+ public:
+  explicit MutexGuard(Mutex& mutex) : mutex_{mutex} { mutex_.Lock(); }
+  ~MutexGuard() { mutex_.Unlock(); }
+  MutexGuard(const MutexGuard&) = delete;
+  MutexGuard& operator=(const MutexGuard&) = delete;
+
+ private:
+  Mutex& mutex_;
+};
+
+/** @brief 計数セマフォ。
+ *
+ * Signal は待っているタスクがあればカウントを増やさずにそのタスクへ直接渡す。
+ * Signal は割り込みハンドラからも呼び出せる。
+ */
+class Semaphore {
+ public:
+  explicit Semaphore(size_t count = 0) : count_{count} {}
+  void Wait();
+  bool TryWait();
+  void Signal();
+
+ private:
+  SpinLock lock_;
+  size_t count_;
+  WaitQueue waiters_;
+};
+
+/** @brief 条件変数。Mutex と組み合わせて使う。 */
+class CondVar {
+ public:
+  /** @brief mutex を解放して Signal か Broadcast を待ち，再び mutex をロックして戻る。 */
+  void Wait(Mutex& mutex);
+  /** @brief 待っているタスクを 1 つ起床させる。 */
+  void Signal();
+  /** @brief 待っているタスクをすべて起床させる。 */
+  void Broadcast();
+
+ private:
+  SpinLock lock_;
+  WaitQueue waiters_;
+};
@@ -1,46 +1,194 @@
 #include "task.hpp"
 
+#include <cstring>
+
 #include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 
 namespace {
-  template <class T, class U>
-  void Erase(T& c, const U& value) {
-    auto it = std::remove(c.begin(), c.end(), value);
-    c.erase(it, c.end());
-  }
-
 // #@@range_begin(task_idle)
   void TaskIdle(uint64_t task_id, int64_t data) {
     while (true) __asm__("hlt");
   }
-} // namespace
 // #@@range_end(task_idle)
 
-Task::Task(uint64_t id) : id_{id}, msgs_{} {
+  /** @brief メインタスクのメッセージキュー容量。
+   *
+   * xHCI，タイマ，キーボードのメッセージはすべてメインタスクに届くので大きめに取る。
+   */
+  const size_t kMainTaskMessageCapacity = 256;
+
+  /** @brief kMLFQ で実行されていないタスクを調べる周期（tick 数） */
+  const unsigned long kAgingPeriod = kTimerFreq;
+
+  void AgingTimer(unsigned long timeout, int value) {
+    task_manager->AgeTasks();
+    timer_manager->AddTimer(Timer{timeout + kAgingPeriod, value, AgingTimer});
+  }
+
+  /** @brief プールに確保しておくタスクの数 */
+  const size_t kPooledTasks = 64;
+  /** @brief NewTask はどの CPU からも呼ばれるので，CPU ごとに少しだけ空きを持たせる */
+  const size_t kTaskPoolCache = 4;
+  ObjectPool<Task, kPooledTasks, kTaskPoolCache> task_pool;
+  ObjectPool<std::array<Message, Task::kDefaultMessageCapacity>,
+             kPooledTasks, kTaskPoolCache> message_block_pool;
+
+  const uint64_t kCR0TaskSwitched = 1u << 3;
+
+  void SetTaskSwitched(bool ts) {
+    const uint64_t cr0 = GetCR0();
+    const uint64_t new_cr0 = ts ? (cr0 | kCR0TaskSwitched) : (cr0 & ~kCR0TaskSwitched);
+    if (new_cr0 != cr0) {
+      SetCR0(new_cr0);
+    }
+  }
+} // namespace
+
+void LatencyHistogram::Add(uint64_t cycles) {
+  int i = 0;
+  while (i < kBuckets - 1 && cycles >= UpperBound(i)) {
+    ++i;
+  }
+  ++counts[i];
+}
+
+uint64_t LatencyHistogram::Total() const {
+  uint64_t total = 0;
+  for (auto c : counts) {
+    total += c;
+  }
+  return total;
+}
+
+uint64_t LatencyHistogram::Percentile(int percent) const {
+  const uint64_t total = Total();
+  if (total == 0) {
+    return 0;
+  }
+  const uint64_t target = (total * percent + 99) / 100;
+  uint64_t sum = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    sum += counts[i];
+    if (sum >= target) {
+      return UpperBound(i);
+    }
+  }
+  return UpperBound(kBuckets - 1);
+}
+
+void* Task::operator new(size_t size) {
+  if (void* p = task_pool.Allocate()) {
+    return p;
+  }
+  return ::operator new(size);
+}
+
+void Task::operator delete(void* p) noexcept {
+  if (task_pool.Contains(p)) {
+    task_pool.Free(p);
+  } else {
+    ::operator delete(p);
+  }
+}
+
+ObjectPoolStats Task::PoolStats() {
+  return task_pool.GetStats();
 }
 
-Task& Task::InitContext(TaskFunc* f, int64_t data) {
-  const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-  stack_.resize(stack_size);
-  uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+ObjectPoolStats Task::MessagePoolStats() {
+  return message_block_pool.GetStats();
+}
+
+Task::Task(uint64_t id, size_t msg_capacity)
+    : id_{id}, msgs_{AllocateMessageBuffer(msg_capacity), msg_capacity} {
+}
+
+Task::~Task() {
+  stack_pool->Free(stack_);
+  message_block_pool.Delete(msg_block_);
+}
+
+Message* Task::AllocateMessageBuffer(size_t msg_capacity) {
+  if (msg_capacity == kDefaultMessageCapacity) {
+    msg_block_ = message_block_pool.New();
+    if (msg_block_) {
+      return msg_block_->data();
+    }
+  }
+  msg_buf_.resize(msg_capacity);
+  return msg_buf_.data();
+}
+
+void Task::Exit() {
+  task_manager->Exit();
+}
+
+void Task::Recycle(uint64_t id) {
+  {
+    // 古い ID 宛てに送ろうとしている TaskManager::SendMessages と競合しないようにする
+    SpinLockGuard guard{msgs_lock_};
+    id_ = id;
+    msgs_.Clear();
+    msgs_closed_ = false;
+  }
+  func_ = nullptr;
+  stack_ = {};
+  msgs_dropped_ = msg_overflows_ = 0;
+  msg_overflowing_ = false;
+  fpu_saves_ = fpu_restores_ = 0;
+  level_ = kDefaultLevel;
+  running_ = false;
+  cpu_ = kBSPCPU;
+  on_cpu_ = -1;
+  affinity_ = kAnyCPU;
+  runtime_ = voluntary_switches_ = involuntary_switches_ = wakeup_tsc_ = 0;
+  wakeup_latency_ = {};
+  exited_ = false;
+  aging_runtime_ = 0;
+  wait_next_ = nullptr;
+  wait_done_ = false;
+}
+
+Error Task::InitContext(TaskFunc* f, int64_t data, size_t stack_bytes) {
+  stack_pool->Free(stack_);
+  stack_ = {};
+  auto [ stack, err ] = stack_pool->Allocate(stack_bytes);
+  if (err) {
+    return err;
+  }
+  stack_ = stack;
+  uint64_t stack_end = stack_.End();
+  func_ = f;
 
   memset(&context_, 0, sizeof(context_));
   context_.cr3 = GetCR3();
-  context_.rflags = 0x202;
+  // スケジューラのロックを解放するまでは割り込み禁止で動かす（Entry で許可する）
+  context_.rflags = 0x002;
   context_.cs = kKernelCS;
   context_.ss = kKernelSS;
   context_.rsp = (stack_end & ~0xflu) - 8;
 
-  context_.rip = reinterpret_cast<uint64_t>(f);
+  context_.rip = reinterpret_cast<uint64_t>(Entry);
   context_.rdi = id_;
   context_.rsi = data;
 
   // MXCSR のすべての例外をマスクする
   *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
 
-  return *this;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void Task::Entry(uint64_t task_id, int64_t data) {
+  task_manager->lock_.Unlock();
+  IRQTraceIRQsOn();
+  __asm__("sti");
+
+  task_manager->CurrentTask().func_(task_id, data);
+  task_manager->Exit();
 }
 
 TaskContext& Task::Context() {
@@ -56,99 +204,440 @@ Task& Task::Sleep() {
   return *this;
 }
 
-Task& Task::Wakeup() {
-  task_manager->Wakeup(this);
+Task& Task::Wakeup(int level) {
+  task_manager->Wakeup(this, level);
   return *this;
 }
 
-void Task::SendMessage(const Message& msg) {
-  msgs_.push_back(msg);
+Error Task::SendMessage(const Message& msg) {
+  return SendMessages(&msg, 1);
+}
+
+Error Task::SendMessages(const Message* msgs, size_t len) {
+  auto err = PushMessages(id_, msgs, len);
+  if (err.Cause() == Error::kNoSuchTask) {
+    return err;
+  }
   Wakeup();
+  return err;
 }
 
 std::optional<Message> Task::ReceiveMessage() {
-  if (msgs_.empty()) {
+  Message m;
+  if (ReceiveMessages(&m, 1) == 0) {
     return std::nullopt;
   }
-
-  auto m = msgs_.front();
-  msgs_.pop_front();
   return m;
 }
 
+size_t Task::ReceiveMessages(Message* msgs, size_t len) {
+  SpinLockGuard guard{msgs_lock_};
+  return PopMessages(msgs, len);
+}
+
+size_t Task::WaitMessages(Message* msgs, size_t len) {
+  InterruptGuard guard;
+  while (true) {
+    msgs_lock_.Lock();
+    if (size_t n = PopMessages(msgs, len); n > 0) {
+      msgs_lock_.Unlock();
+      return n;
+    }
+    task_manager->SleepAndUnlock(msgs_lock_, true);
+  }
+}
+
+size_t Task::PopMessages(Message* msgs, size_t len) {
+  size_t i = 0;
+  for (; i < len && msgs_.Count() > 0; ++i) {
+    msgs[i] = msgs_.Front();
+    msgs_.Pop();
+  }
+  return i;
+}
+
+Error Task::PushMessages(uint64_t id, const Message* msgs, size_t len) {
+  SpinLockGuard guard{msgs_lock_};
+  if (msgs_closed_ || id_ != id) {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  Error err = MAKE_ERROR(Error::kSuccess);
+  for (size_t i = 0; i < len; ++i) {
+    if (auto push_err = msgs_.Push(msgs[i])) {
+      err = push_err;
+      ++msgs_dropped_;
+      if (!msg_overflowing_) {
+        msg_overflowing_ = true;
+        ++msg_overflows_;
+      }
+    } else {
+      msg_overflowing_ = false;
+    }
+  }
+  return err;
+}
+
+void TaskManager::RunList::PushBack(Task* task) {
+  task->rq_prev_ = tail_;
+  task->rq_next_ = nullptr;
+  if (tail_) {
+    tail_->rq_next_ = task;
+  } else {
+    head_ = task;
+  }
+  tail_ = task;
+  ++size_;
+}
+
+void TaskManager::RunList::PushFront(Task* task) {
+  task->rq_prev_ = nullptr;
+  task->rq_next_ = head_;
+  if (head_) {
+    head_->rq_prev_ = task;
+  } else {
+    tail_ = task;
+  }
+  head_ = task;
+  ++size_;
+}
+
+void TaskManager::RunList::Erase(Task* task) {
+  if (task->rq_prev_) {
+    task->rq_prev_->rq_next_ = task->rq_next_;
+  } else {
+    head_ = task->rq_next_;
+  }
+  if (task->rq_next_) {
+    task->rq_next_->rq_prev_ = task->rq_prev_;
+  } else {
+    tail_ = task->rq_prev_;
+  }
+  task->rq_prev_ = nullptr;
+  task->rq_next_ = nullptr;
+  --size_;
+}
+
 // #@@range_begin(taskmgr_ctor)
 TaskManager::TaskManager() {
-  Task& task = NewTask()
-    .SetLevel(current_level_)
-    .SetRunning(true);
-  running_[current_level_].push_back(&task);
+  mlfq_quanta_ = {kTaskTimerPeriod, 4, 2, 1};
+
+  auto& rq = cpus_[kBSPCPU];
+
+  // 生成中の TaskManager は他から参照されないので，lock_ を取らずに作ってよい
+  Task& task = NewTaskLocked(kMainTaskMessageCapacity)
+    .SetLevel(rq.current_level)
+    .SetRunning(true)
+    .SetAffinity(kBSPCPU);
+  task.on_cpu_ = kBSPCPU;
+  rq.running[rq.current_level].PushBack(&task);
+  rq.current = &task;
+  rq.switched_tsc = ReadTSC();
+  // 現在の FPU/SSE レジスタの内容はメインタスクのもの
+  rq.fpu_owner = &task;
+
+  Task& idle = NewTaskLocked(Task::kDefaultMessageCapacity);
+  if (auto err = idle.InitContext(TaskIdle, 0, Task::kDefaultStackBytes)) {
+    Log(kError, "failed to allocate stack for idle task: %s at %s:%d\n",
+        err.Name(), err.File(), err.Line());
+    exit(1);
+  }
+  idle.SetLevel(0)
+    .SetRunning(true)
+    .SetAffinity(kBSPCPU);
+  rq.running[0].PushBack(&idle);
+  rq.idle = &idle;
+}
+// #@@range_end(taskmgr_ctor)
 
-  Task& idle = NewTask()
-    .InitContext(TaskIdle, 0)
+void TaskManager::InitializeCPU(int cpu) {
+  SpinLockGuard guard{lock_};
+  auto& rq = cpus_[cpu];
+
+  Task& idle = NewTaskLocked(Task::kDefaultMessageCapacity)
     .SetLevel(0)
-    .SetRunning(true);
-  running_[0].push_back(&idle);
+    .SetRunning(true)
+    .SetAffinity(cpu);
+  idle.cpu_ = cpu;
+  idle.on_cpu_ = cpu;
+  rq.running[0].PushBack(&idle);
+  rq.current_level = 0;
+  rq.current = &idle;
+  rq.idle = &idle;
+  rq.switched_tsc = ReadTSC();
+}
+
+WithError<Task*> TaskManager::NewTask(TaskFunc* f, int64_t data,
+                                      size_t stack_bytes, size_t msg_capacity) {
+  Task* task;
+  {
+    SpinLockGuard guard{lock_};
+    task = &NewTaskLocked(msg_capacity);
+  }
+  // スタックの確保はページテーブルの変更を伴うことがあるので lock_ の外で行う。
+  // まだ実行キューに入っていないので，他の CPU がこのタスクに触れることはない。
+  if (auto err = task->InitContext(f, data, stack_bytes)) {
+    SpinLockGuard guard{lock_};
+    task->exited_ = true; // 一度も実行されていないので，次の NewTask がすぐに回収する
+    return {nullptr, err};
+  }
+  return {task, MAKE_ERROR(Error::kSuccess)};
 }
-// #@@range_end(taskmgr_ctor)
 
-Task& TaskManager::NewTask() {
+Task& TaskManager::NewTaskLocked(size_t msg_capacity) {
+  ReapLocked();
   ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_});
+
+  auto it = std::find_if(free_tasks_.begin(), free_tasks_.end(),
+                         [msg_capacity](const auto& t){
+                           return t->msgs_.Capacity() == msg_capacity;
+                         });
+  if (it == free_tasks_.end()) {
+    return *tasks_.emplace_back(new Task{latest_id_, msg_capacity});
+  }
+
+  std::unique_ptr<Task> task = std::move(*it);
+  free_tasks_.erase(it);
+  task->Recycle(latest_id_);
+  return *tasks_.emplace_back(std::move(task));
+}
+
+void TaskManager::ReapLocked() {
+  // lock_ はコンテキスト切り替えが終わるまで解放されないので，
+  // ここで on_cpu_ < 0 なら終了したタスクのスタックはもう使われていない
+  for (auto it = tasks_.begin(); it != tasks_.end();) {
+    Task* task = it->get();
+    if (!task->exited_ || task->on_cpu_ >= 0) {
+      ++it;
+      continue;
+    }
+    stack_pool->Free(task->stack_);
+    task->stack_ = {};
+    free_tasks_.push_back(std::move(*it));
+    it = tasks_.erase(it);
+  }
+}
+
+void TaskManager::Exit() {
+  __asm__("cli"); // 切り替え先のタスクが割り込みの許可状態を決める
+  IRQTraceIRQsOff(IRQTraceRIP());
+  lock_.Lock();
+  auto& rq = cpus_[CurrentCPU()];
+  Task* task = rq.current;
+
+  {
+    SpinLockGuard guard{task->msgs_lock_};
+    task->msgs_.Clear();
+    task->msgs_closed_ = true;
+  }
+  for (auto& q : cpus_) {
+    if (q.fpu_owner == task) {
+      q.fpu_owner = nullptr;
+    }
+  }
+  task->exited_ = true;
+  task->SetRunning(false);
+  SwitchTaskLocked(true);
+
+  // 終了したタスクが再び選ばれることはない
+  while (true) __asm__("hlt");
+}
+
+Task* TaskManager::FindTaskLocked(uint64_t id) {
+  auto it = std::find_if(tasks_.begin(), tasks_.end(),
+                         [id](const auto& t){ return t->ID() == id; });
+  if (it == tasks_.end() || (*it)->exited_) {
+    return nullptr;
+  }
+  return it->get();
 }
 
 void TaskManager::SwitchTask(bool current_sleep) {
-  auto& level_queue = running_[current_level_];
-  Task* current_task = level_queue.front();
-  level_queue.pop_front();
-  if (!current_sleep) {
-    level_queue.push_back(current_task);
+  InterruptGuard guard;
+  lock_.Lock();
+  SwitchTaskLocked(current_sleep);
+  // 切り替えた場合，ここに戻ってくるのはこのタスクが再び選ばれたとき。
+  // そのときロックは切り替え元のタスクから受け渡されている。
+  lock_.Unlock();
+}
+
+void TaskManager::QuantumExpired() {
+  InterruptGuard guard;
+  lock_.Lock();
+  auto& rq = cpus_[CurrentCPU()];
+  Task* task = rq.current;
+  if (policy_ == SchedPolicy::kMLFQ && task != rq.idle &&
+      task->Level() > kMinMLFQLevel) {
+    ChangeLevelRunning(task, task->Level() - 1);
   }
-  if (level_queue.empty()) {
-    level_changed_ = true;
+  SwitchTaskLocked(false);
+  lock_.Unlock();
+}
+
+void TaskManager::SetPolicy(SchedPolicy policy) {
+  bool start_aging = false;
+  {
+    SpinLockGuard guard{lock_};
+    policy_ = policy;
+    if (policy == SchedPolicy::kMLFQ && !aging_started_) {
+      aging_started_ = start_aging = true;
+    }
+  }
+  if (start_aging) {
+    timer_manager->AddTimer(
+        Timer{timer_manager->CurrentTick() + kAgingPeriod, 0, AgingTimer});
+  }
+}
+
+void TaskManager::SetQuantum(int level, int ticks) {
+  SpinLockGuard guard{lock_};
+  mlfq_quanta_[level] = ticks;
+}
+
+int TaskManager::Quantum(int level) const {
+  return policy_ == SchedPolicy::kMLFQ ? mlfq_quanta_[level] : kTaskTimerPeriod;
+}
+
+void TaskManager::AgeTasks() {
+  SpinLockGuard guard{lock_};
+  if (policy_ != SchedPolicy::kMLFQ) {
+    return;
+  }
+  for (const auto& task : tasks_) {
+    const bool starving = task->Running() && task->on_cpu_ < 0 &&
+      task->runtime_ == task->aging_runtime_;
+    if (starving && task.get() != cpus_[task->cpu_].idle &&
+        task->Level() < kMaxLevel) {
+      ChangeLevelRunning(task.get(), task->Level() + 1);
+    }
+    task->aging_runtime_ = task->runtime_;
+  }
+}
+
+void TaskManager::SwitchTaskLocked(bool current_sleep) {
+  const int cpu = CurrentCPU();
+  auto& rq = cpus_[cpu];
+
+  auto& level_queue = rq.running[rq.current_level];
+  Task* current_task = level_queue.Front();
+  level_queue.PopFront();
+  if (!current_sleep && current_task->Running()) {
+    level_queue.PushBack(current_task);
+  }
+  if (level_queue.Empty()) {
+    rq.level_changed = true;
   }
 
-  if (level_changed_) {
-    level_changed_ = false;
+  if (rq.level_changed) {
+    rq.level_changed = false;
     for (int lv = kMaxLevel; lv >= 0; --lv) {
-      if (!running_[lv].empty()) {
-        current_level_ = lv;
+      if (!rq.running[lv].Empty()) {
+        rq.current_level = lv;
         break;
       }
     }
   }
 
-  Task* next_task = running_[current_level_].front();
+  Task* next_task = rq.running[rq.current_level].Front();
+  if (next_task == rq.idle) {
+    if (Task* stolen = StealTask(cpu)) {
+      stolen->cpu_ = cpu;
+      rq.running[stolen->Level()].PushFront(stolen);
+      rq.current_level = stolen->Level();
+      next_task = stolen;
+    }
+  }
+
+  current_task->on_cpu_ = -1;
+  next_task->on_cpu_ = cpu;
+  rq.current = next_task;
+  UpdateTaskTimer(cpu, true);
+  AccountSwitch(rq, current_task, next_task,
+                current_sleep || !current_task->Running());
+
+  if (next_task == current_task) {
+    return;
+  }
 
+  // 他の CPU に移るかもしれないタスクの FPU/SSE の状態は，この CPU のレジスタに
+  // 残しておけないので切り替え前に退避する
+  if (rq.fpu_owner == current_task &&
+      current_task->Affinity() == Task::kAnyCPU && NumCPUs() > 1) {
+    FXSave(current_task->context_.fxsave_area.data());
+    ++current_task->fpu_saves_;
+    rq.fpu_owner = nullptr;
+  }
+
+  // FPU/SSE の状態は次のタスクが実際に使うまで入れ替えない
+  SetTaskSwitched(next_task != rq.fpu_owner);
+  IRQTraceContextSwitch();
   SwitchContext(&next_task->Context(), &current_task->Context());
 }
 
 void TaskManager::Sleep(Task* task) {
+  InterruptGuard guard;
+  lock_.Lock();
+  SleepLocked(task, true);
+  lock_.Unlock();
+}
+
+void TaskManager::SleepLocked(Task* task, bool interactive) {
   if (!task->Running()) {
     return;
   }
 
   task->SetRunning(false);
 
-  if (task == running_[current_level_].front()) {
-    SwitchTask(true);
+  const int cpu = CurrentCPU();
+  if (task == cpus_[cpu].current) {
+    // 自ら休止した（入力などを待つ）タスクは対話的とみなしてレベルを上げる。
+    // ロック待ちで上げると，ロックを奪い合う CPU 負荷の高いタスクまで上がってしまう
+    if (interactive && policy_ == SchedPolicy::kMLFQ && task != cpus_[cpu].idle &&
+        task->Level() < kMaxLevel) {
+      task->SetLevel(task->Level() + 1);
+    }
+    SwitchTaskLocked(true);
     return;
   }
 
-  Erase(running_[task->Level()], task);
+  if (task->on_cpu_ >= 0) {
+    // 他の CPU で実行中。その CPU が切り替えるときに実行キューから外れる。
+    SendIPI(task->on_cpu_, InterruptVector::kReschedule);
+    return;
+  }
+
+  cpus_[task->cpu_].running[task->Level()].Erase(task);
+  UpdateTaskTimer(task->cpu_, false);
+}
+
+void TaskManager::SleepAndUnlock(SpinLock& lock, bool interactive) {
+  lock_.Lock();
+  lock.Unlock();
+  SleepLocked(cpus_[CurrentCPU()].current, interactive);
+  lock_.Unlock();
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
-    return MAKE_ERROR(Error::kNoSuchTask);
+  InterruptGuard guard;
+  lock_.Lock();
+  Task* task = FindTaskLocked(id);
+  if (task) {
+    SleepLocked(task, true);
   }
+  lock_.Unlock();
 
-  Sleep(it->get());
+  if (task == nullptr) {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
+  SpinLockGuard guard{lock_};
+  WakeupLocked(task, level);
+}
+
+void TaskManager::WakeupLocked(Task* task, int level) {
   if (task->Running()) {
     ChangeLevelRunning(task, level);
     return;
@@ -158,40 +647,142 @@ void TaskManager::Wakeup(Task* task, int level) {
     level = task->Level();
   }
 
+  if (task->on_cpu_ >= 0) {
+    // Sleep された直後で，まだ実行中の CPU の実行キューに残っている
+    task->SetRunning(true);
+    ChangeLevelRunning(task, level);
+    return;
+  }
+
   task->SetLevel(level);
   task->SetRunning(true);
-
-  running_[level].push_back(task);
-  if (level > current_level_) {
-    level_changed_ = true;
+  task->wakeup_tsc_ = ReadTSC();
+
+  const int cpu = SelectCPU(task);
+  task->cpu_ = cpu;
+  auto& rq = cpus_[cpu];
+  rq.running[level].PushBack(task);
+  if (level > rq.current_level) {
+    rq.level_changed = true;
   }
+  UpdateTaskTimer(cpu, false);
   return;
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  SpinLockGuard guard{lock_};
+  Task* task = FindTaskLocked(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Wakeup(it->get(), level);
+  WakeupLocked(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  return SendMessages(id, &msg, 1);
+}
+
+Error TaskManager::SendMessages(uint64_t id, const Message* msgs, size_t len) {
+  Task* task;
+  {
+    SpinLockGuard guard{lock_};
+    task = FindTaskLocked(id);
+  }
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  (*it)->SendMessage(msg);
-  return MAKE_ERROR(Error::kSuccess);
+  // lock_ を解放した後に task が終了，再利用されていることがあるので，
+  // 追加も起床も ID を確かめてから行う。Task は解放されないので task は指したままでよい。
+  auto err = task->PushMessages(id, msgs, len);
+  if (err.Cause() == Error::kNoSuchTask) {
+    return err;
+  }
+
+  SpinLockGuard guard{lock_};
+  if (task->ID() == id && !task->exited_) {
+    WakeupLocked(task, -1);
+  }
+  return err;
 }
 
 Task& TaskManager::CurrentTask() {
-  return *running_[current_level_].front();
+  // CPU 番号を読んでから current を読むまでに別の CPU へ移ると，その CPU のタスクを返してしまう
+  InterruptGuard guard;
+  return *cpus_[CurrentCPU()].current;
+}
+
+void TaskManager::Reschedule() {
+  InterruptGuard guard;
+  lock_.Lock();
+  const int cpu = CurrentCPU();
+  auto& rq = cpus_[cpu];
+  if (!rq.current->Running() || rq.level_changed || rq.current == rq.idle) {
+    SwitchTaskLocked(false);
+  } else {
+    UpdateTaskTimer(cpu, false);
+  }
+  lock_.Unlock();
+}
+
+void TaskManager::ReportStackUsage() const {
+  for (const auto& task : tasks_) {
+    const auto& stack = task->Stack();
+    if (!stack.Valid()) {
+      continue;
+    }
+    Log(kWarn, "task %lu: stack %lu / %lu bytes used\n",
+        task->ID(), StackPool::HighWaterMark(stack), stack.bytes);
+  }
+  stack_pool->Report();
+}
+
+size_t TaskManager::GetStats(TaskStats* stats, size_t len) {
+  SpinLockGuard guard{lock_};
+  const uint64_t now = ReadTSC();
+  size_t i = 0;
+  for (; i < len && i < tasks_.size(); ++i) {
+    const Task* task = tasks_[i].get();
+    auto& s = stats[i];
+    s.id = task->ID();
+    s.level = task->Level();
+    s.running = task->Running();
+    s.on_cpu = task->on_cpu_;
+    s.runtime = task->runtime_;
+    if (task->on_cpu_ >= 0) {
+      s.runtime += now - cpus_[task->on_cpu_].switched_tsc;
+    }
+    s.voluntary_switches = task->voluntary_switches_;
+    s.involuntary_switches = task->involuntary_switches_;
+    s.wakeup_latency = task->wakeup_latency_;
+  }
+  return i;
+}
+
+LatencyHistogram TaskManager::LevelWakeupLatency(int level) {
+  SpinLockGuard guard{lock_};
+  return level_wakeup_latency_[level];
+}
+
+const void* TaskManager::SwitchFPU(const void* fxsave_area) {
+  // 実行キューのロックは取らない。ロックを持ったまま #NM が起きることがあるため。
+  // fpu_owner は自 CPU でしか書き換えず，奪われ得るのは fpu_owner でないタスクだけ。
+  auto& rq = cpus_[CurrentCPU()];
+  Task* current_task = rq.current;
+  if (rq.fpu_owner == current_task) {
+    return fxsave_area;
+  }
+
+  if (rq.fpu_owner) {
+    auto& area = rq.fpu_owner->context_.fxsave_area;
+    memcpy(area.data(), fxsave_area, area.size());
+    ++rq.fpu_owner->fpu_saves_;
+  }
+  ++current_task->fpu_restores_;
+  rq.fpu_owner = current_task;
+  return current_task->context_.fxsave_area.data();
 }
 
 void TaskManager::ChangeLevelRunning(Task* task, int level) {
@@ -199,26 +790,138 @@ void TaskManager::ChangeLevelRunning(Task* task, int level) {
     return;
   }
 
-  if (task != running_[current_level_].front()) {
+  auto& rq = cpus_[task->cpu_];
+  if (task->on_cpu_ < 0) {
     // change level of other task
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
+    rq.running[task->Level()].Erase(task);
+    rq.running[level].PushBack(task);
     task->SetLevel(level);
-    if (level > current_level_) {
-      level_changed_ = true;
+    if (level > rq.current_level) {
+      rq.level_changed = true;
     }
+    UpdateTaskTimer(task->cpu_, false);
     return;
   }
 
-  // change level myself
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
+  // change level of running task
+  rq.running[rq.current_level].PopFront();
+  rq.running[level].PushFront(task);
   task->SetLevel(level);
-  if (level >= current_level_) {
-    current_level_ = level;
+  if (level >= rq.current_level) {
+    rq.current_level = level;
   } else {
-    current_level_ = level;
-    level_changed_ = true;
+    rq.current_level = level;
+    rq.level_changed = true;
+  }
+  UpdateTaskTimer(task->cpu_, false);
+}
+
+int TaskManager::SelectCPU(const Task* task) const {
+  if (task->Affinity() != Task::kAnyCPU) {
+    return task->Affinity();
+  }
+
+  auto is_idle = [this](int cpu) {
+    return cpus_[cpu].current == cpus_[cpu].idle;
+  };
+  if (is_idle(task->cpu_)) {
+    return task->cpu_;
+  }
+  for (int cpu = 0; cpu < NumCPUs(); ++cpu) {
+    if (is_idle(cpu)) {
+      return cpu;
+    }
+  }
+  return task->cpu_;
+}
+
+Task* TaskManager::StealTask(int cpu) {
+  auto stealable = [](const RunQueue& rq, const Task* t) {
+    return t->on_cpu_ < 0 && t->Affinity() == Task::kAnyCPU && rq.fpu_owner != t;
+  };
+
+  int victim = -1;
+  size_t max_count = 0;
+  for (int i = 0; i < NumCPUs(); ++i) {
+    if (i == cpu) {
+      continue;
+    }
+    size_t count = 0;
+    for (const auto& level_queue : cpus_[i].running) {
+      for (const Task* t = level_queue.Front(); t; t = t->rq_next_) {
+        count += stealable(cpus_[i], t);
+      }
+    }
+    if (count > max_count) {
+      victim = i;
+      max_count = count;
+    }
+  }
+  if (victim < 0) {
+    return nullptr;
+  }
+
+  auto& rq = cpus_[victim];
+  for (int lv = kMaxLevel; lv >= 0; --lv) {
+    auto& level_queue = rq.running[lv];
+    for (Task* t = level_queue.Back(); t; t = t->rq_prev_) {
+      if (stealable(rq, t)) {
+        level_queue.Erase(t);
+        return t;
+      }
+    }
+  }
+  return nullptr;
+}
+
+void TaskManager::AccountSwitch(RunQueue& rq, Task* current_task, Task* next_task,
+                                bool voluntary) {
+  const uint64_t now = ReadTSC();
+  current_task->runtime_ += now - rq.switched_tsc;
+  rq.switched_tsc = now;
+
+  if (next_task == current_task) {
+    return;
+  }
+
+  if (voluntary) {
+    ++current_task->voluntary_switches_;
+  } else {
+    ++current_task->involuntary_switches_;
+  }
+
+  if (next_task->wakeup_tsc_ != 0) {
+    const uint64_t latency = now - next_task->wakeup_tsc_;
+    next_task->wakeup_latency_.Add(latency);
+    level_wakeup_latency_[next_task->Level()].Add(latency);
+    next_task->wakeup_tsc_ = 0;
+  }
+}
+
+void TaskManager::UpdateTaskTimer(int cpu, bool restart) {
+  const auto& rq = cpus_[cpu];
+  const bool preempt = rq.level_changed || rq.running[rq.current_level].Size() > 1;
+
+  if (cpu != CurrentCPU()) {
+    if (preempt || rq.current == rq.idle) {
+      SendIPI(cpu, InterruptVector::kReschedule);
+    }
+    return;
+  }
+
+  // LAPIC タイマは CPU ごとにある。BSP のものは TimerManager が管理している。
+  if (cpu == kBSPCPU) {
+    if (preempt) {
+      timer_manager->StartTaskTimer(restart, Quantum(rq.current_level));
+    } else {
+      timer_manager->StopTaskTimer();
+    }
+  } else {
+    if (preempt) {
+      StartLocalTaskTimer(restart, Quantum(rq.current_level));
+    } else {
+      StopLocalTaskTimer();
+    }
   }
 }
 
@@ -226,9 +929,4 @@ TaskManager* task_manager;
 
 void InitializeTask() {
   task_manager = new TaskManager;
-
-  __asm__("cli");
-  timer_manager->AddTimer(
-      Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue});
-  __asm__("sti");
 }
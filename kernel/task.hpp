@@ -9,12 +9,16 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
-#include <deque>
 #include <optional>
 #include <vector>
 
 #include "error.hpp"
 #include "message.hpp"
+#include "object_pool.hpp"
+#include "queue.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "stack_pool.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1; // offset 0x00
@@ -26,63 +30,398 @@ struct TaskContext {
 
 using TaskFunc = void (uint64_t, int64_t);
 
+/** @brief 起床してから実行されるまでの待ち時間（TSC のカウント数）のヒストグラム。
+ *
+ * バケット i は [2^(i+kMinShift), 2^(i+kMinShift+1)) の範囲を数える。
+ * 両端のバケットはそれより短い，長い待ち時間も含む。
+ */
+struct LatencyHistogram {
+  static const int kBuckets = 16;
+  static const int kMinShift = 10;
+
+  std::array<uint64_t, kBuckets> counts{};
+
+  void Add(uint64_t cycles);
+  uint64_t Total() const;
+  /** @brief percent パーセンタイルを含むバケットの上限（カウント数）を返す。空なら 0。 */
+  uint64_t Percentile(int percent) const;
+  /** @brief バケット i の上限（カウント数） */
+  static uint64_t UpperBound(int i) { return uint64_t{2} << (i + kMinShift); }
+};
+
+/** @brief TaskManager::GetStats が返すタスクごとの統計情報。時間はすべて TSC のカウント数。 */
+struct TaskStats {
+  uint64_t id;
+  int level;
+  bool running;
+  /** @brief 実行中の CPU 番号。実行中でなければ -1。 */
+  int on_cpu;
+  /** @brief これまでに CPU 上で実行された時間の合計 */
+  uint64_t runtime;
+  /** @brief 自ら休止して CPU を手放した回数 */
+  uint64_t voluntary_switches;
+  /** @brief タイマや優先度の高いタスクによって CPU を奪われた回数 */
+  uint64_t involuntary_switches;
+  LatencyHistogram wakeup_latency;
+};
+
 class TaskManager;
+class WaitQueue;
 
 class Task {
  public:
   static const int kDefaultLevel = 1;
   static const size_t kDefaultStackBytes = 4096;
+  /** @brief メッセージキューの既定の容量（メッセージ数） */
+  static const size_t kDefaultMessageCapacity = 32;
+  /** @brief どの CPU で実行してもよいことを表すアフィニティ */
+  static const int kAnyCPU = -1;
+
+  /** @brief タスクの領域はプールから割り当てる。プールを使い切ったら一般のヒープを使う。 */
+  static void* operator new(size_t size);
+  static void operator delete(void* p) noexcept;
+  /** @brief タスク用のプールの統計情報 */
+  static ObjectPoolStats PoolStats();
+  /** @brief 既定の容量のメッセージキュー用のプールの統計情報 */
+  static ObjectPoolStats MessagePoolStats();
 
-  Task(uint64_t id);
-  Task& InitContext(TaskFunc* f, int64_t data);
+  /** @brief タスクを生成する。
+   *
+   * メッセージキューの領域はここで確保され，以降は伸縮しない。
+   * そのため SendMessage は割り込みハンドラから呼んでもメモリ確保を行わない。
+   * 容量が kDefaultMessageCapacity ならその領域はプールから割り当てる。
+   *
+   * @param id  タスク ID
+   * @param msg_capacity  メッセージキューに溜められる最大のメッセージ数
+   */
+  Task(uint64_t id, size_t msg_capacity);
+  ~Task();
+  /** @brief 現在のタスク自身を終了する。戻らない。TaskManager::Exit と同じ。 */
+  [[noreturn]] static void Exit();
   TaskContext& Context();
   uint64_t ID() const;
   Task& Sleep();
-  Task& Wakeup();
-  void SendMessage(const Message& msg);
+  Task& Wakeup(int level = -1);
+  /** @brief メッセージをキューに追加してタスクを起床させる。
+   *
+   * キューが満杯ならメッセージを捨てて kFull を返す（タスクは起床させる）。
+   * 割り込みハンドラからも呼び出せる。
+   */
+  Error SendMessage(const Message& msg);
+  /** @brief len 個のメッセージをまとめてキューに追加し，タスクを 1 回だけ起床させる。
+   *
+   * 入りきらなかったメッセージは捨てて kFull を返す。割り込みハンドラからも呼び出せる。
+   */
+  Error SendMessages(const Message* msgs, size_t len);
   std::optional<Message> ReceiveMessage();
+  /** @brief キューに溜まったメッセージを最大 len 個まとめて取り出す。
+   *
+   * @return 取り出したメッセージ数
+   */
+  size_t ReceiveMessages(Message* msgs, size_t len);
+  /** @brief メッセージが届くまで休止し，届いたものを最大 len 個まとめて取り出す。
+   *
+   * 現在のタスク自身に対してのみ呼び出せる。
+   *
+   * @return 取り出したメッセージ数（1 以上）
+   */
+  size_t WaitMessages(Message* msgs, size_t len);
 
   int Level() const { return level_; }
   bool Running() const { return running_; }
 
+  /** @brief タスクを実行する CPU を固定する。kAnyCPU ならどの CPU でもよい。 */
+  Task& SetAffinity(int cpu) { affinity_ = cpu; return *this; }
+  int Affinity() const { return affinity_; }
+
+  /** @brief キューが満杯で捨てられたメッセージの総数 */
+  uint64_t MessagesDropped() const { return msgs_dropped_; }
+  /** @brief キューが満杯になった（あふれ始めた）回数 */
+  uint64_t MessageOverflows() const { return msg_overflows_; }
+
+  /** @brief FPU/SSE の状態を fxsave_area へ退避した回数 */
+  uint64_t FPUSaves() const { return fpu_saves_; }
+  /** @brief FPU/SSE の状態を fxsave_area から復帰した回数 */
+  uint64_t FPURestores() const { return fpu_restores_; }
+
+  /** @brief スタックの情報。InitContext を呼んでいなければ無効なスタックを返す。 */
+  const TaskStack& Stack() const { return stack_; }
+
  private:
   uint64_t id_;
-  std::vector<uint64_t> stack_;
+  TaskFunc* func_{nullptr};
+  TaskStack stack_{};
   alignas(16) TaskContext context_;
-  std::deque<Message> msgs_;
+  /** @brief プールから割り当てたメッセージキューの領域。なければ msg_buf_ を使う。 */
+  std::array<Message, kDefaultMessageCapacity>* msg_block_{nullptr};
+  std::vector<Message> msg_buf_;
+  ArrayQueue<Message> msgs_;
+  SpinLock msgs_lock_;
+  /** @brief Exit でメッセージキューを閉じた。msgs_lock_ を取得して読み書きする。 */
+  bool msgs_closed_{false};
+  uint64_t msgs_dropped_{0};
+  uint64_t msg_overflows_{0};
+  bool msg_overflowing_{false};
+  uint64_t fpu_saves_{0};
+  uint64_t fpu_restores_{0};
   unsigned int level_{kDefaultLevel};
   bool running_{false};
+  /** @brief このタスクが登録されている実行キューの CPU 番号 */
+  int cpu_{kBSPCPU};
+  /** @brief このタスクを実行中の CPU 番号。実行中でなければ -1。 */
+  int on_cpu_{-1};
+  int affinity_{kAnyCPU};
+  uint64_t runtime_{0};
+  uint64_t voluntary_switches_{0};
+  uint64_t involuntary_switches_{0};
+  /** @brief 最後に起床させられた時刻。実行されたら 0 に戻す。 */
+  uint64_t wakeup_tsc_{0};
+  LatencyHistogram wakeup_latency_{};
+  /** @brief Exit した。切り替えが済めば TaskManager が回収する。 */
+  bool exited_{false};
+  /** @brief 前回の AgeTasks で見た runtime_ */
+  uint64_t aging_runtime_{0};
+  /** @brief WaitQueue で次に待っているタスク */
+  Task* wait_next_{nullptr};
+  /** @brief WaitQueue から取り出された（待ちが終わった）かどうか */
+  bool wait_done_{false};
+  /** @brief 実行キューで前後にあるタスク */
+  Task* rq_prev_{nullptr};
+  Task* rq_next_{nullptr};
+
+  /** @brief InitContext で初期化したタスクが最初に実行する関数。
+   *
+   * コンテキスト切り替えで受け渡されたスケジューラのロックを解放してから func_ を呼ぶ。
+   */
+  static void Entry(uint64_t task_id, int64_t data);
+  /** @brief タスクの実行コンテキストを初期化する。
+   *
+   * スタックは stack_pool から stack_bytes 以上のサイズクラスで確保する。
+   * 確保できなければ kNoEnoughMemory を返し，タスクはスタックを持たない状態になる。
+   */
+  Error InitContext(TaskFunc* f, int64_t data, size_t stack_bytes);
+  /** @brief msg_capacity 個分のメッセージキューの領域を msg_block_ か msg_buf_ に確保する。 */
+  Message* AllocateMessageBuffer(size_t msg_capacity);
 
   Task& SetLevel(int level) { level_ = level; return *this; }
   Task& SetRunning(bool running) { running_ = running; return *this; }
+  /** @brief 回収したタスクを新しい ID のタスクとして再利用できる状態に戻す。
+   *
+   * スタックは回収時に返却済みであること。メッセージキューの領域はそのまま使う。
+   */
+  void Recycle(uint64_t id);
+  /** @brief msgs_lock_ を取得した状態で呼び，メッセージを最大 len 個取り出す。 */
+  size_t PopMessages(Message* msgs, size_t len);
+  /** @brief ID が id のタスクとして生きていれば，メッセージをキューに追加する。
+   *
+   * ID の比較と追加は msgs_lock_ を取得したまま行うので，その間に終了したり
+   * 別の ID で再利用されたりしたタスクには追加せず kNoSuchTask を返す。
+   * タスクは起床させない。
+   */
+  Error PushMessages(uint64_t id, const Message* msgs, size_t len);
 
   friend TaskManager;
+  friend WaitQueue;
+};
+
+/** @brief スケジューリングの方針 */
+enum class SchedPolicy {
+  /** @brief 固定優先度のラウンドロビン。どのレベルも同じ kTaskTimerPeriod で切り替える。 */
+  kRoundRobin,
+  /** @brief 多段フィードバックキュー。
+   *
+   * レベルごとに切り替え時間を設定でき，切り替え時間を使い切ったタスクは
+   * レベルを 1 つ下げ，自ら休止したタスクはレベルを 1 つ上げる。
+   * 一定時間まったく実行されなかったタスクはレベルを 1 つ上げる（エージング）。
+   * レベル 0 はアイドルタスク専用とし，他のタスクは 1 未満に下げない。
+   */
+  kMLFQ,
 };
 
 class TaskManager {
  public:
   // level: 0 = lowest, kMaxLevel = highest
   static const int kMaxLevel = 3;
+  /** @brief kMLFQ でタスクを下げられる最低のレベル */
+  static const int kMinMLFQLevel = 1;
 
   TaskManager();
-  Task& NewTask();
+  /** @brief AP 上で呼び出し，現在の実行コンテキストをその CPU のアイドルタスクとして登録する。 */
+  void InitializeCPU(int cpu);
+  /** @brief f(task_id, data) を実行するタスクを生成する。タスクは休止状態で作られる。
+   *
+   * 終了したタスクのうち同じメッセージキュー容量のものがあれば，
+   * その Task オブジェクトとメッセージキューの領域を再利用する。
+   * タスク ID は再利用せず，常に新しい値を割り当てる。
+   *
+   * @return 生成したタスク。スタックを確保できなければ kNoEnoughMemory。
+   */
+  WithError<Task*> NewTask(TaskFunc* f, int64_t data,
+                           size_t stack_bytes = Task::kDefaultStackBytes,
+                           size_t msg_capacity = Task::kDefaultMessageCapacity);
+  /** @brief 現在のタスクを終了する。戻らない。
+   *
+   * タスクは実行キューから外れ，未処理のメッセージは捨てられる。
+   * Task オブジェクトとスタックは，この CPU が次のタスクに切り替わった後で
+   * 次の NewTask が回収する。アイドルタスクとメインタスクは終了させてはならない。
+   * InitContext で設定した関数から戻った場合もこの関数が呼ばれる。
+   */
+  [[noreturn]] void Exit();
   void SwitchTask(bool current_sleep = false);
+  /** @brief タスク切り替え用のタイマ割り込みで呼ぶ。
+   *
+   * kMLFQ なら現在のタスクのレベルを下げてからタスクを切り替える。
+   */
+  void QuantumExpired();
+
+  void SetPolicy(SchedPolicy policy);
+  SchedPolicy Policy() const { return policy_; }
+  /** @brief kMLFQ でのレベル level の切り替え時間（tick 数）を設定する。 */
+  void SetQuantum(int level, int ticks);
+  /** @brief 現在の方針でのレベル level の切り替え時間（tick 数） */
+  int Quantum(int level) const;
+  /** @brief kMLFQ のとき，前回から一度も実行されていない実行可能なタスクのレベルを上げる。
+   *
+   * SetPolicy(SchedPolicy::kMLFQ) で開始するタイマが定期的に呼ぶ。
+   */
+  void AgeTasks();
 
   void Sleep(Task* task);
   Error Sleep(uint64_t id);
   void Wakeup(Task* task, int level = -1);
   Error Wakeup(uint64_t id, int level = -1);
   Error SendMessage(uint64_t id, const Message& msg);
+  Error SendMessages(uint64_t id, const Message* msgs, size_t len);
+  /** @brief lock を解放して現在のタスクを休止させる。
+   *
+   * lock を取得し，割り込みを禁止した状態で呼び出す。戻ったとき lock は解放されている。
+   * lock の解放と休止の間に Wakeup が割り込まないため，起床を取りこぼさない。
+   * ロックの順序は lock が先，スケジューラのロックが後。
+   *
+   * interactive が true なら，入力やタイマを待つ対話的な休止として kMLFQ でレベルを上げる。
+   * Mutex などのロック待ちは他のタスク次第で起きるだけなので false にする。
+   */
+  void SleepAndUnlock(SpinLock& lock, bool interactive);
+  /** @brief 実行中の CPU で現在動いているタスクを返す。
+   *
+   * 読む間は割り込みを禁止するので，途中で別の CPU へ移されても自身を返す。
+   */
   Task& CurrentTask();
+  /** @brief CPU 間割り込み InterruptVector::kReschedule を受けた CPU で呼ばれる。
+   *
+   * 他の CPU がこの CPU の実行キューを変更したときに送られる。
+   * 必要ならタスクを切り替え，そうでなければタスク切り替え用タイマを更新する。
+   */
+  void Reschedule();
+  /** @brief 各タスクのスタック使用量（高水位）とスタックプールの統計をログに出力する。 */
+  void ReportStackUsage() const;
+
+  /** @brief 各タスクの統計情報を最大 len 個 stats に書き込む。
+   *
+   * 実行中のタスクの runtime には今回の実行分も含める。
+   *
+   * @return 書き込んだ個数
+   */
+  size_t GetStats(TaskStats* stats, size_t len);
+  /** @brief 指定したレベルのタスク全体の，起床から実行までの待ち時間のヒストグラムを返す。 */
+  LatencyHistogram LevelWakeupLatency(int level);
+
+  /** @brief FPU/SSE の状態を現在のタスクのものに切り替える。
+   *
+   * SwitchTask は FPU/SSE の状態を入れ替えず，CR0.TS を立てるだけにしている。
+   * 切り替え後のタスクが FPU/SSE 命令を使うと #NM 例外が発生し，
+   * その例外ハンドラがこの関数を呼ぶ。
+   *
+   * 例外ハンドラは割り込まれた時点のレジスタを fxsave_area に FXSAVE してから呼び，
+   * 戻り値の領域を FXRSTOR する。この関数は fxsave_area を前の所有者へ写し，
+   * 現在のタスクの領域を返す。所有者が変わらなければ fxsave_area をそのまま返す。
+   */
+  const void* SwitchFPU(const void* fxsave_area);
 
  private:
+  /** @brief 実行キューの 1 レベル分。Task::rq_prev_/rq_next_ でつなぐ。
+   *
+   * 追加も削除もメモリを確保しないので，割り込みコンテキストからの起床でも使える。
+   */
+  class RunList {
+   public:
+    Task* Front() const { return head_; }
+    Task* Back() const { return tail_; }
+    bool Empty() const { return head_ == nullptr; }
+    size_t Size() const { return size_; }
+    void PushBack(Task* task);
+    void PushFront(Task* task);
+    void PopFront() { Erase(head_); }
+    /** @brief task を取り除く。task はこのリストに入っていなければならない。 */
+    void Erase(Task* task);
+
+   private:
+    Task* head_{nullptr};
+    Task* tail_{nullptr};
+    size_t size_{0};
+  };
+
+  /** @brief CPU ごとの実行キュー */
+  struct RunQueue {
+    std::array<RunList, kMaxLevel + 1> running{};
+    int current_level{kMaxLevel};
+    bool level_changed{false};
+    /** @brief この CPU で実行中のタスク（running[current_level] の先頭） */
+    Task* current{nullptr};
+    /** @brief この CPU のアイドルタスク */
+    Task* idle{nullptr};
+    /** @brief この CPU の FPU/SSE レジスタに現在載っている状態の持ち主 */
+    Task* fpu_owner{nullptr};
+    /** @brief current が実行を始めた（実行時間を最後に計上した）時刻 */
+    uint64_t switched_tsc{0};
+  };
+
   std::vector<std::unique_ptr<Task>> tasks_{};
+  /** @brief 回収して再利用を待つタスク */
+  std::vector<std::unique_ptr<Task>> free_tasks_{};
   uint64_t latest_id_{0};
-  std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-  int current_level_{kMaxLevel};
-  bool level_changed_{false};
+  std::array<RunQueue, kMaxCPUs> cpus_{};
+  /** @brief tasks_ と全 CPU の実行キューを守るロック。
+   *
+   * コンテキスト切り替えをまたいで保持され，切り替え先のタスクが解放する。
+   */
+  SpinLock lock_;
+  std::array<LatencyHistogram, kMaxLevel + 1> level_wakeup_latency_{};
+  SchedPolicy policy_{SchedPolicy::kRoundRobin};
+  /** @brief kMLFQ でのレベルごとの切り替え時間（tick 数）。高いレベルほど短い。 */
+  std::array<int, kMaxLevel + 1> mlfq_quanta_{};
+  bool aging_started_{false};
 
+  Task& NewTaskLocked(size_t msg_capacity);
+  /** @brief 終了して切り替えも済んだタスクを tasks_ から free_tasks_ へ移す。 */
+  void ReapLocked();
+  Task* FindTaskLocked(uint64_t id);
+  void SwitchTaskLocked(bool current_sleep);
+  void SleepLocked(Task* task, bool interactive);
+  void WakeupLocked(Task* task, int level);
   void ChangeLevelRunning(Task* task, int level);
+  /** @brief 起床したタスクを入れる CPU を選ぶ。
+   *
+   * アフィニティが指定されていればその CPU，なければ前回実行した CPU が
+   * アイドル中ならそこ，次にアイドル中の CPU，どれもなければ前回実行した CPU。
+   */
+  int SelectCPU(const Task* task) const;
+  /** @brief 他の CPU の実行キューから，実行中でなく CPU を固定されていないタスクを奪う。
+   *
+   * 実行可能なタスクが最も多い CPU から，最も高いレベルのタスクを選ぶ。
+   */
+  Task* StealTask(int cpu);
+  /** @brief タスク切り替えが必要なときだけタスク切り替え用のタイマを動かす。
+   *
+   * 現在のレベルに実行可能なタスクが 1 つしかなく，より高いレベルのタスクも
+   * 待っていなければタイマを止める。アイドル時に無駄な割り込みを起こさないため。
+   * 他の CPU の実行キューなら，その CPU に kReschedule を送って判断を任せる。
+   */
+  void UpdateTaskTimer(int cpu, bool restart);
+  /** @brief 切り替えに伴う実行時間，切り替え回数，起床からの待ち時間を記録する。 */
+  void AccountSwitch(RunQueue& rq, Task* current_task, Task* next_task, bool voluntary);
+
+  friend Task;
 };
 
 extern TaskManager* task_manager;
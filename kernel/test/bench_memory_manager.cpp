@@ -0,0 +1,157 @@
+#include <CppUTest/TestHarness.h>
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "frame_manager_fixture.hpp"
+#include "memory_manager.hpp"
+
+/** @brief フレーム管理クラスの所要時間を測るベンチマーク．
+ *
+ * 結果は標準出力に表示する．通常のテスト（test.run）には含めず，make bench で
+ * bench.run としてビルドして実行する．
+ */
+TEST_GROUP(MemoryManagerBench) {
+  std::unique_ptr<FrameManagerFixture<BitmapMemoryManager>> fixture;
+  BitmapMemoryManager* mgr;
+
+  TEST_SETUP() {
+    fixture = std::make_unique<FrameManagerFixture<BitmapMemoryManager>>(128_GiB / kBytesPerFrame);
+    mgr = &fixture->mgr;
+  }
+
+  TEST_TEARDOWN() {
+    fixture.reset();
+  }
+
+  template <class F>
+  void Measure(const char* name, int count, F f) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+      f(i);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    printf("\n%-40s %8d ops %10.1f ns/op", name, count, static_cast<double>(ns) / count);
+  }
+};
+
+TEST(MemoryManagerBench, AllocateOneAfterLowMemoryFilled) {
+  // 先頭 16 GiB を使用中にしてから 1 フレームずつ確保する
+  const size_t kUsedFrames = 16_GiB / kBytesPerFrame;
+  mgr->MarkAllocated(FrameID{0}, kUsedFrames);
+
+  Measure("allocate 1 frame (16 GiB used below)", 100000, [&](int i) {
+    const auto frame = mgr->Allocate(1);
+    CHECK_EQUAL(kUsedFrames + i, frame.value.ID());
+  });
+}
+
+TEST(MemoryManagerBench, AllocateOneAfterFree) {
+  const size_t kUsedFrames = 1_GiB / kBytesPerFrame;
+  mgr->MarkAllocated(FrameID{0}, kUsedFrames);
+
+  Measure("allocate 1 frame, free it", 100000, [&](int i) {
+    const auto frame = mgr->Allocate(1);
+    mgr->Free(frame.value, 1);
+  });
+}
+
+TEST(MemoryManagerBench, AllocateContiguousFragmented) {
+  // 先頭 1 GiB を 1 フレームおきに使用中にしておき，64 フレームの連続領域を確保する
+  const size_t kFragmentedFrames = 1_GiB / kBytesPerFrame;
+  for (size_t i = 0; i < kFragmentedFrames; i += 2) {
+    mgr->MarkAllocated(FrameID{i}, 1);
+  }
+
+  Measure("allocate 64 frames (1 GiB fragmented)", 1000, [&](int i) {
+    const auto frame = mgr->Allocate(64);
+    CHECK_TRUE(frame.value.ID() >= kFragmentedFrames - 1);
+  });
+}
+
+TEST(MemoryManagerBench, AllocateLarge) {
+  const size_t kUsedFrames = 4_GiB / kBytesPerFrame;
+  mgr->MarkAllocated(FrameID{0}, kUsedFrames);
+
+  Measure("allocate 32768 frames (128 MiB)", 100, [&](int i) {
+    const auto frame = mgr->Allocate(32768);
+    CHECK_EQUAL(kUsedFrames + 32768 * i, frame.value.ID());
+  });
+}
+
+TEST(MemoryManagerBench, MarkAllocatedAndFreeWholeRange) {
+  // 起動時にメモリマップの予約領域をまとめて登録する場合を想定する
+  Measure("mark/free all frames (128 GiB)", 10, [&](int i) {
+    mgr->MarkAllocated(FrameID{1}, mgr->FrameCount() - 2);
+    mgr->Free(FrameID{1}, mgr->FrameCount() - 2);
+  });
+  CHECK_TRUE(mgr->IsFree(FrameID{0}, mgr->FrameCount()));
+}
+
+namespace {
+  /** @brief 確保と解放を乱数で繰り返して断片化させた状態で，確保の速さと連続領域の残り具合を比べる． */
+  template <class M>
+  void BenchFragmented(const char* name) {
+    auto fixture = std::make_unique<FrameManagerFixture<M>>(128_GiB / kBytesPerFrame);
+    auto mgr = &fixture->mgr;
+    const size_t kRange = 1_GiB / kBytesPerFrame;
+    mgr->SetMemoryRange(FrameID{1}, FrameID{kRange});
+
+    struct Block { size_t frame, num; };
+    std::vector<Block> blocks;
+    std::mt19937 rng{1};
+    auto allocate = [&] {
+      const size_t num = 1 + rng() % (rng() % 16 == 0 ? 256 : 8);
+      const auto frame = mgr->Allocate(num);
+      if (!frame.error) {
+        blocks.push_back({frame.value.ID(), num});
+      }
+    };
+    auto free = [&] {
+      const size_t n = rng() % blocks.size();
+      mgr->Free(FrameID{blocks[n].frame}, blocks[n].num);
+      blocks[n] = blocks.back();
+      blocks.pop_back();
+    };
+
+    // 約 3/4 を埋めてから半分を解放し，穴だらけにする
+    while (blocks.size() < kRange / 24) {
+      allocate();
+    }
+    for (size_t i = blocks.size() / 2; i > 0; --i) {
+      free();
+    }
+
+    const int kOps = 200000;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kOps; ++i) {
+      if (i % 2 == 0) {
+        allocate();
+      } else {
+        free();
+      }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+    // 512 フレーム（2 MiB）の連続領域がいくつ取れるか
+    int large = 0;
+    while (!mgr->Allocate(512).error) {
+      ++large;
+    }
+    printf("\n%-40s %8d ops %10.1f ns/op, %d x 2 MiB left",
+           name, kOps, static_cast<double>(ns) / kOps, large);
+  }
+}
+
+TEST(MemoryManagerBench, AllocateFreeFragmentedBitmap) {
+  BenchFragmented<BitmapMemoryManager>("fragmented alloc/free (bitmap)");
+}
+
+TEST(MemoryManagerBench, AllocateFreeFragmentedBuddy) {
+  BenchFragmented<BuddyMemoryManager>("fragmented alloc/free (buddy)");
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <CppUTest/TestHarness.h>
+
+#include <vector>
+
+#include "memory_manager.hpp"
+
+/** @brief フレーム管理クラスと，その管理領域に使うバッファの組 */
+template <class M>
+struct FrameManagerFixture {
+  explicit FrameManagerFixture(size_t frame_count)
+    : map_buf(M::MapBytes(frame_count) / sizeof(typename M::MapLineType)),
+      mgr(frame_count, map_buf.data()) {
+  }
+
+  std::vector<typename M::MapLineType> map_buf;
+  M mgr;
+};
+
+/** @brief 管理するフレーム数を超えて MarkAllocated しても，範囲内だけが使用中になることを確かめる． */
+template <class M>
+void CheckMarkAllocatedBeyondFrameCount(M& mgr) {
+  mgr.MarkAllocated(FrameID{mgr.FrameCount() - 1}, 100);
+
+  CHECK_FALSE(mgr.IsFree(FrameID{mgr.FrameCount() - 1}, 1));
+  CHECK_FALSE(mgr.IsFree(FrameID{mgr.FrameCount()}, 1));
+  CHECK_TRUE(mgr.IsFree(FrameID{mgr.FrameCount() - 2}, 1));
+}
@@ -0,0 +1,99 @@
+#include <CppUTest/CommandLineTestRunner.h>
+
+#include <memory>
+
+#include "frame_manager_fixture.hpp"
+#include "memory_manager.hpp"
+
+TEST_GROUP(BuddyMemoryManager) {
+  std::unique_ptr<FrameManagerFixture<BuddyMemoryManager>> fixture;
+  BuddyMemoryManager* mgr;
+
+  TEST_SETUP() {
+    fixture = std::make_unique<FrameManagerFixture<BuddyMemoryManager>>(4_GiB / kBytesPerFrame);
+    mgr = &fixture->mgr;
+  }
+
+  TEST_TEARDOWN() {
+    fixture.reset();
+  }
+};
+
+TEST(BuddyMemoryManager, AllocateNaturallyAligned) {
+  const auto frame1 = mgr->Allocate(1);
+  const auto frame2 = mgr->Allocate(5);
+  const auto frame3 = mgr->Allocate(512);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(0, frame2.value.ID() % 8);
+  CHECK_EQUAL(0, frame3.value.ID() % 512);
+}
+
+TEST(BuddyMemoryManager, AllocateReturnsRoundedUpTail) {
+  // 5 フレームの要求は 8 フレームのブロックから取り，余りの 3 フレームは空きに戻す
+  const auto frame1 = mgr->Allocate(5);
+  const auto frame2 = mgr->Allocate(1);
+  const auto frame3 = mgr->Allocate(2);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(5, frame2.value.ID());
+  CHECK_EQUAL(6, frame3.value.ID());
+}
+
+TEST(BuddyMemoryManager, FreeCoalesces) {
+  const auto frame1 = mgr->Allocate(1);
+  const auto frame2 = mgr->Allocate(1);
+  mgr->Free(frame1.value, 1);
+  mgr->Free(frame2.value, 1);
+
+  // 併合されていれば最大の order のブロックを先頭から確保できる
+  const auto frame3 = mgr->Allocate(1ul << BuddyMemoryManager::kMaxOrder);
+  CHECK_EQUAL(0, frame3.value.ID());
+}
+
+TEST(BuddyMemoryManager, AllocateTooLarge) {
+  const auto frame1 = mgr->Allocate((1ul << BuddyMemoryManager::kMaxOrder) + 1);
+
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
+}
+
+TEST(BuddyMemoryManager, MarkAllocatedSplitsBlock) {
+  mgr->MarkAllocated(FrameID{3}, 2);
+
+  CHECK_TRUE(mgr->IsFree(FrameID{0}, 3));
+  CHECK_FALSE(mgr->IsFree(FrameID{3}, 1));
+  CHECK_FALSE(mgr->IsFree(FrameID{4}, 1));
+  CHECK_TRUE(mgr->IsFree(FrameID{5}, 1ul << 19));
+
+  const auto frame1 = mgr->Allocate(4);
+  CHECK_EQUAL(8, frame1.value.ID());
+
+  mgr->Free(FrameID{3}, 2);
+  mgr->Free(frame1.value, 4);
+  CHECK_EQUAL(0, mgr->Allocate(1ul << BuddyMemoryManager::kMaxOrder).value.ID());
+}
+
+TEST(BuddyMemoryManager, MarkAllocatedOverAllocated) {
+  // 使用中の領域と空き領域にまたがる範囲を指定しても，空きの部分だけが取り除かれる
+  const auto frame1 = mgr->Allocate(1);
+  mgr->MarkAllocated(FrameID{0}, 1ul << 19);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_FALSE(mgr->IsFree(FrameID{1}, 1));
+  CHECK_TRUE(mgr->IsFree(FrameID{1ul << 19}, 1ul << 19));
+  CHECK_EQUAL(1ul << 19, mgr->Allocate(1).value.ID());
+}
+
+TEST(BuddyMemoryManager, FrameCountNotMultipleOfMaxBlock) {
+  // 最大のブロックに切り上げた分のフレームは割り当てない
+  FrameManagerFixture<BuddyMemoryManager> small{1000};
+  const auto frame1 = small.mgr.Allocate(512);
+  const auto frame2 = small.mgr.Allocate(512);
+  const auto frame3 = small.mgr.Allocate(256);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame2.error.Cause());
+  CHECK_EQUAL(512, frame3.value.ID());
+  CHECK_TRUE(small.mgr.IsFree(FrameID{768}, 232));
+  CHECK_FALSE(small.mgr.IsFree(FrameID{768}, 233));
+}
@@ -0,0 +1,169 @@
+#include <CppUTest/CommandLineTestRunner.h>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "frame_manager_fixture.hpp"
+#include "memory_manager.hpp"
+
+/* BitmapMemoryManager と BuddyMemoryManager に共通する振る舞いのテスト．
+ * 各テストは管理クラスを型引数に取る関数に書き，両方のグループから呼ぶ．
+ */
+namespace {
+  template <class M>
+  void CheckAllocateDisjoint(M& mgr) {
+    const auto frame1 = mgr.Allocate(3);
+    const auto frame2 = mgr.Allocate(5);
+    const auto frame3 = mgr.Allocate(1);
+
+    CHECK_FALSE(frame1.error);
+    CHECK_FALSE(frame2.error);
+    CHECK_FALSE(frame3.error);
+    CHECK_FALSE(mgr.IsFree(frame1.value, 3));
+    CHECK_FALSE(mgr.IsFree(frame2.value, 5));
+    CHECK_FALSE(mgr.IsFree(frame3.value, 1));
+    CHECK_TRUE(frame1.value.ID() + 3 <= frame2.value.ID() ||
+               frame2.value.ID() + 5 <= frame1.value.ID());
+    CHECK_TRUE(frame3.value.ID() < frame1.value.ID() ||
+               frame1.value.ID() + 3 <= frame3.value.ID());
+    CHECK_TRUE(frame3.value.ID() < frame2.value.ID() ||
+               frame2.value.ID() + 5 <= frame3.value.ID());
+  }
+
+  template <class M>
+  void CheckFreeAndReuse(M& mgr) {
+    const auto frame1 = mgr.Allocate(100);
+    mgr.Free(frame1.value, 100);
+    const auto frame2 = mgr.Allocate(100);
+
+    CHECK_EQUAL(0, frame1.value.ID());
+    CHECK_EQUAL(0, frame2.value.ID());
+    CHECK_TRUE(mgr.IsFree(FrameID{100}, mgr.FrameCount() - 100));
+  }
+
+  template <class M>
+  void CheckAllocateNoEnoughMemory(M& mgr) {
+    const auto frame1 = mgr.Allocate(mgr.FrameCount() + 1);
+
+    CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
+    CHECK_EQUAL(kNullFrame.ID(), frame1.value.ID());
+  }
+
+  template <class M>
+  void CheckMarkAllocated(M& mgr) {
+    mgr.MarkAllocated(FrameID{61}, 3);
+    const auto frame1 = mgr.Allocate(64);
+
+    CHECK_TRUE(mgr.IsFree(FrameID{0}, 61));
+    CHECK_FALSE(mgr.IsFree(FrameID{63}, 1));
+    CHECK_TRUE(mgr.IsFree(FrameID{64 + 64}, 64));
+    CHECK_EQUAL(64, frame1.value.ID());
+  }
+
+  template <class M>
+  void CheckSetMemoryRange(M& mgr) {
+    mgr.SetMemoryRange(FrameID{10}, FrameID{64});
+    const auto frame1 = mgr.Allocate(1);
+    const auto frame2 = mgr.Allocate(64);
+
+    CHECK_TRUE(10 <= frame1.value.ID() && frame1.value.ID() < 64);
+    CHECK_EQUAL(Error::kNoEnoughMemory, frame2.error.Cause());
+  }
+
+  template <class M>
+  void CheckAllocateBelowLimit(M& mgr) {
+    mgr.MarkAllocated(FrameID{0}, 64);
+    mgr.MarkAllocated(FrameID{200}, 1); // 201 に小さな空きブロックができる
+    const auto frame1 = mgr.Allocate(1, FrameID{128});
+    const auto frame2 = mgr.Allocate(15, FrameID{128});
+    const auto frame3 = mgr.Allocate(64, FrameID{128});
+    const auto frame4 = mgr.Allocate(64);
+
+    CHECK_FALSE(frame1.error);
+    CHECK_TRUE(64 <= frame1.value.ID() && frame1.value.ID() < 128);
+    CHECK_FALSE(frame2.error);
+    CHECK_TRUE(64 <= frame2.value.ID() && frame2.value.ID() + 15 <= 128);
+    CHECK_EQUAL(Error::kNoEnoughMemory, frame3.error.Cause());
+    CHECK_FALSE(frame4.error);
+    CHECK_TRUE(frame4.value.ID() + 64 > 128); // limit がなければ limit をまたいで確保できる
+  }
+
+  /** @brief 確保と解放を乱数で繰り返し，確保した領域が重ならず全部返せば元に戻ることを確かめる． */
+  template <class M>
+  void CheckRandomAllocateFree(M& mgr) {
+    struct Block { size_t frame, num; };
+    std::vector<Block> blocks;
+    std::mt19937 rng{1};
+    const size_t kRange = 1 << 16;
+    mgr.SetMemoryRange(FrameID{1}, FrameID{kRange});
+
+    for (int i = 0; i < 20000; ++i) {
+      if (blocks.empty() || rng() % 3 != 0) {
+        const size_t num = 1 + rng() % (rng() % 8 == 0 ? 512 : 16);
+        const auto frame = mgr.Allocate(num);
+        if (frame.error) {
+          continue;
+        }
+        CHECK_TRUE(frame.value.ID() >= 1 && frame.value.ID() + num <= kRange);
+        for (const auto& b : blocks) {
+          CHECK_TRUE(frame.value.ID() + num <= b.frame || b.frame + b.num <= frame.value.ID());
+        }
+        CHECK_FALSE(mgr.IsFree(frame.value, 1));
+        blocks.push_back({frame.value.ID(), num});
+      } else {
+        const size_t n = rng() % blocks.size();
+        mgr.Free(FrameID{blocks[n].frame}, blocks[n].num);
+        CHECK_TRUE(mgr.IsFree(FrameID{blocks[n].frame}, blocks[n].num));
+        blocks[n] = blocks.back();
+        blocks.pop_back();
+      }
+    }
+
+    for (const auto& b : blocks) {
+      mgr.Free(FrameID{b.frame}, b.num);
+    }
+    CHECK_TRUE(mgr.IsFree(FrameID{1}, kRange - 1));
+  }
+}
+
+TEST_GROUP(BitmapFrameManager) {
+  std::unique_ptr<FrameManagerFixture<BitmapMemoryManager>> fixture;
+  BitmapMemoryManager* mgr;
+
+  TEST_SETUP() {
+    fixture = std::make_unique<FrameManagerFixture<BitmapMemoryManager>>(4_GiB / kBytesPerFrame);
+    mgr = &fixture->mgr;
+  }
+
+  TEST_TEARDOWN() {
+    fixture.reset();
+  }
+};
+
+TEST_GROUP(BuddyFrameManager) {
+  std::unique_ptr<FrameManagerFixture<BuddyMemoryManager>> fixture;
+  BuddyMemoryManager* mgr;
+
+  TEST_SETUP() {
+    fixture = std::make_unique<FrameManagerFixture<BuddyMemoryManager>>(4_GiB / kBytesPerFrame);
+    mgr = &fixture->mgr;
+  }
+
+  TEST_TEARDOWN() {
+    fixture.reset();
+  }
+};
+
+#define FRAME_MANAGER_TEST(name) \
+  TEST(BitmapFrameManager, name) { Check##name(*mgr); } \
+  TEST(BuddyFrameManager, name) { Check##name(*mgr); }
+
+FRAME_MANAGER_TEST(AllocateDisjoint)
+FRAME_MANAGER_TEST(FreeAndReuse)
+FRAME_MANAGER_TEST(AllocateNoEnoughMemory)
+FRAME_MANAGER_TEST(MarkAllocated)
+FRAME_MANAGER_TEST(SetMemoryRange)
+FRAME_MANAGER_TEST(AllocateBelowLimit)
+FRAME_MANAGER_TEST(MarkAllocatedBeyondFrameCount)
+FRAME_MANAGER_TEST(RandomAllocateFree)
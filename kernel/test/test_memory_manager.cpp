@@ -1,8 +1,10 @@
 #include <CppUTest/CommandLineTestRunner.h>
+#include "frame_manager_fixture.hpp"
 #include "memory_manager.hpp"
 
 TEST_GROUP(MemoryManager) {
-  BitmapMemoryManager mgr;
+  FrameManagerFixture<BitmapMemoryManager> fixture{4_GiB / kBytesPerFrame};
+  BitmapMemoryManager& mgr = fixture.mgr;
 
   TEST_SETUP() {}
 
@@ -26,7 +28,7 @@ TEST(MemoryManager, AllocateMultipleLine) {
 }
 
 TEST(MemoryManager, AllocateNoEnoughMemory) {
-  const auto frame1 = mgr.Allocate(BitmapMemoryManager::kFrameCount + 1);
+  const auto frame1 = mgr.Allocate(mgr.FrameCount() + 1);
 
   CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
   CHECK_EQUAL(kNullFrame.ID(), frame1.value.ID());
@@ -65,3 +67,88 @@ TEST(MemoryManager, SetMemoryRange) {
   CHECK_EQUAL(0, frame1.value.ID());
   CHECK_EQUAL(10, frame2.value.ID());
 }
+
+TEST(MemoryManager, AllocateSkipsFullLines) {
+  mgr.MarkAllocated(FrameID{0}, BitmapMemoryManager::kBitsPerMapLine * 100 + 5);
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine);
+
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 100 + 5, frame1.value.ID());
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 100 + 6, frame2.value.ID());
+}
+
+TEST(MemoryManager, AllocateAfterFreeBelowHint) {
+  const auto frame1 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine * 3);
+  const auto frame2 = mgr.Allocate(1);
+  mgr.Free(FrameID{70}, 2);
+  const auto frame3 = mgr.Allocate(2);
+  const auto frame4 = mgr.Allocate(1);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 3, frame2.value.ID());
+  CHECK_EQUAL(70, frame3.value.ID());
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 3 + 1, frame4.value.ID());
+}
+
+TEST(MemoryManager, AllocateRangeEnd) {
+  mgr.SetMemoryRange(FrameID{1}, FrameID{100});
+  const auto frame1 = mgr.Allocate(99);
+  const auto frame2 = mgr.Allocate(1);
+
+  CHECK_EQUAL(1, frame1.value.ID());
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame2.error.Cause());
+}
+
+TEST(MemoryManager, MarkAllocatedRange) {
+  const size_t kLine = BitmapMemoryManager::kBitsPerMapLine;
+  mgr.MarkAllocated(FrameID{10}, kLine * 5);
+
+  CHECK_TRUE(mgr.IsFree(FrameID{0}, 10));
+  CHECK_FALSE(mgr.IsFree(FrameID{0}, 11));
+  CHECK_FALSE(mgr.IsFree(FrameID{kLine * 2}, 1));
+  CHECK_FALSE(mgr.IsFree(FrameID{kLine * 5 + 9}, 1));
+  CHECK_TRUE(mgr.IsFree(FrameID{kLine * 5 + 10}, kLine * 2));
+
+  const auto frame1 = mgr.Allocate(11);
+  CHECK_EQUAL(kLine * 5 + 10, frame1.value.ID());
+}
+
+TEST(MemoryManager, FreeRange) {
+  const size_t kLine = BitmapMemoryManager::kBitsPerMapLine;
+  mgr.MarkAllocated(FrameID{0}, kLine * 10);
+  mgr.Free(FrameID{kLine + 3}, kLine * 3);
+
+  CHECK_TRUE(mgr.IsFree(FrameID{kLine + 3}, kLine * 3));
+  CHECK_FALSE(mgr.IsFree(FrameID{kLine + 2}, 1));
+  CHECK_FALSE(mgr.IsFree(FrameID{kLine * 4 + 3}, 1));
+
+  const auto frame1 = mgr.Allocate(kLine * 3);
+  CHECK_EQUAL(kLine + 3, frame1.value.ID());
+}
+
+TEST(MemoryManager, MarkAllocatedBeyondFrameCount) {
+  CheckMarkAllocatedBeyondFrameCount(mgr);
+}
+
+TEST(MemoryManager, FrameCountNotMultipleOfLine) {
+  FrameManagerFixture<BitmapMemoryManager> small_fixture{1000};
+  auto& small = small_fixture.mgr;
+  const auto frame1 = small.Allocate(1000);
+  const auto frame2 = small.Allocate(1);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame2.error.Cause());
+  small.Free(frame1.value, 2000);
+  CHECK_TRUE(small.IsFree(FrameID{0}, 1000));
+  CHECK_FALSE(small.IsFree(FrameID{0}, 1001));
+}
+
+TEST(MemoryManager, MapBytesGrowsWithFrameCount) {
+  // 要約ビットマップの 1 要素が扱う 4096 フレームごとに 65 要素
+  CHECK_EQUAL(65 * sizeof(BitmapMemoryManager::MapLineType),
+              BitmapMemoryManager::MapBytes(4096));
+  CHECK_EQUAL(2 * 65 * sizeof(BitmapMemoryManager::MapLineType),
+              BitmapMemoryManager::MapBytes(4097));
+  CHECK_EQUAL((256_GiB / kBytesPerFrame / 4096) * 65 * sizeof(BitmapMemoryManager::MapLineType),
+              BitmapMemoryManager::MapBytes(256_GiB / kBytesPerFrame));
+}
@@ -0,0 +1,204 @@
+#include <CppUTest/CommandLineTestRunner.h>
+
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "frame_manager_fixture.hpp"
+#include "usb/memory.hpp"
+
+namespace {
+  const size_t kArenaFrames = 1024;
+  const size_t kArenaAlignment = 1024 * 1024;
+
+  /** @brief DMAPool に渡すフレーム．ホスト上の領域を BitmapMemoryManager で管理する． */
+  struct Arena {
+    Arena()
+      : base{static_cast<uint8_t*>(aligned_alloc(kArenaAlignment, kArenaFrames * kBytesPerFrame))},
+        frames(kArenaFrames) {
+    }
+    ~Arena() {
+      free(base);
+    }
+
+    uint8_t* base;
+    FrameManagerFixture<BitmapMemoryManager> frames;
+    size_t frames_in_use{0};
+  };
+
+  Arena* arena;
+
+  void* AllocateArenaFrames(size_t num_frames) {
+    const auto frame = arena->frames.mgr.Allocate(num_frames);
+    if (frame.error) {
+      return nullptr;
+    }
+    arena->frames_in_use += num_frames;
+    return arena->base + frame.value.ID() * kBytesPerFrame;
+  }
+
+  void FreeArenaFrames(void* p, size_t num_frames) {
+    const size_t id = (static_cast<uint8_t*>(p) - arena->base) / kBytesPerFrame;
+    arena->frames.mgr.Free(FrameID{id}, num_frames);
+    arena->frames_in_use -= num_frames;
+  }
+
+  bool CrossesBoundary(void* p, size_t size, size_t boundary) {
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    return addr / boundary != (addr + size - 1) / boundary;
+  }
+}
+
+TEST_GROUP(DMAPool) {
+  std::unique_ptr<Arena> arena_holder;
+  std::unique_ptr<usb::DMAPool> pool;
+
+  TEST_SETUP() {
+    arena_holder = std::make_unique<Arena>();
+    arena = arena_holder.get();
+    pool = std::make_unique<usb::DMAPool>(
+        usb::FrameSource{AllocateArenaFrames, FreeArenaFrames});
+  }
+
+  TEST_TEARDOWN() {
+    pool.reset();
+    arena_holder.reset();
+    arena = nullptr;
+  }
+};
+
+TEST(DMAPool, AllocateHonorsAlignment) {
+  for (unsigned int alignment = 1; alignment <= 64 * 1024; alignment *= 2) {
+    void* p = pool->Allocate(24, alignment, 0);
+    CHECK(p != nullptr);
+    CHECK_EQUAL(0, reinterpret_cast<uintptr_t>(p) % alignment);
+    CHECK_EQUAL(0, reinterpret_cast<uintptr_t>(p) % usb::DMAPool::kMinBlockBytes);
+  }
+}
+
+TEST(DMAPool, AllocateDoesNotCrossBoundary) {
+  // 前の割り当てで位置をずらしながら，境界の直前に来るような要求を繰り返す
+  for (size_t size = 16; size <= 4096; size += 208) {
+    void* p = pool->Allocate(size, 64, 4096);
+    CHECK(p != nullptr);
+    CHECK_FALSE(CrossesBoundary(p, size, 4096));
+  }
+
+  // 1 フレームを超える要求でも size <= boundary なら境界を跨がない
+  void* ring = pool->Allocate(12 * 1024, 64, 16 * 1024);
+  CHECK(ring != nullptr);
+  CHECK_FALSE(CrossesBoundary(ring, 12 * 1024, 16 * 1024));
+}
+
+TEST(DMAPool, AllocateZeroFills) {
+  auto p = static_cast<uint8_t*>(pool->Allocate(256, 64, 4096));
+  memset(p, 0xff, 256);
+  pool->Free(p);
+
+  auto q = static_cast<uint8_t*>(pool->Allocate(256, 64, 4096));
+  CHECK_EQUAL(p, q);
+  for (int i = 0; i < 256; ++i) {
+    CHECK_EQUAL(0, q[i]);
+  }
+}
+
+TEST(DMAPool, FreeReusesBlock) {
+  void* p1 = pool->Allocate(100, 64, 0);
+  void* p2 = pool->Allocate(100, 64, 0);
+  pool->Free(p1);
+  void* p3 = pool->Allocate(128, 0, 0);
+
+  CHECK(p1 != p2);
+  CHECK_EQUAL(p1, p3);
+  CHECK_EQUAL(2, pool->Stats(usb::DMAPool::SizeClassOf(128)).in_use);
+}
+
+TEST(DMAPool, FreeReturnsEmptyPages) {
+  const size_t per_page = usb::DMAPool::kBytesPerPage / 64;
+  std::vector<void*> blocks;
+  for (size_t i = 0; i < per_page * 3; ++i) {
+    blocks.push_back(pool->Allocate(64, 64, 0));
+  }
+  const auto stats = pool->Stats(0);
+  CHECK_EQUAL(3, stats.pages);
+  CHECK_EQUAL(per_page * 3, stats.in_use);
+
+  for (void* p : blocks) {
+    pool->Free(p);
+  }
+  // 空のページは 1 つだけ残し，それ以外はフレームを返す
+  CHECK_EQUAL(1, pool->Stats(0).pages);
+  CHECK_EQUAL(0, pool->Stats(0).in_use);
+  CHECK_EQUAL(pool->MetadataFrames() + 1, arena->frames_in_use);
+}
+
+TEST(DMAPool, LargeAllocationReturnsFrames) {
+  void* p = pool->Allocate(3 * 4096 + 1, 64 * 1024, 0);
+  CHECK(p != nullptr);
+  CHECK_EQUAL(0, reinterpret_cast<uintptr_t>(p) % (64 * 1024));
+  // 揃えるために余分に確保したフレームは返している
+  CHECK_EQUAL(4, pool->Large().frames_in_use);
+  CHECK_EQUAL(pool->MetadataFrames() + 4, arena->frames_in_use);
+
+  pool->Free(p);
+  CHECK_EQUAL(0, pool->Large().in_use);
+  CHECK_EQUAL(pool->MetadataFrames(), arena->frames_in_use);
+}
+
+TEST(DMAPool, AllocateFailsWhenFramesRunOut) {
+  CHECK(pool->Allocate(kArenaFrames * kBytesPerFrame, 0, 0) == nullptr);
+  CHECK_EQUAL(1, pool->Failures());
+}
+
+TEST(DMAPool, RandomAllocateAndFree) {
+  struct Block {
+    uint8_t* p;
+    size_t size;
+    uint8_t fill;
+  };
+  std::vector<Block> live;
+  std::mt19937 rng{42};
+
+  for (int i = 0; i < 20000; ++i) {
+    if (live.empty() || rng() % 3 != 0) {
+      const size_t size = 1 + rng() % (rng() % 8 == 0 ? 20000 : 600);
+      const unsigned int alignment = rng() % 4 == 0 ? 0 : 1u << (rng() % 14);
+      const unsigned int boundary = rng() % 2 == 0 ? 0 : 1u << (12 + rng() % 5);
+      auto p = static_cast<uint8_t*>(pool->Allocate(size, alignment, boundary));
+      if (p == nullptr) {
+        continue;
+      }
+      if (alignment) {
+        CHECK_EQUAL(0, reinterpret_cast<uintptr_t>(p) % alignment);
+      }
+      if (boundary && size <= boundary) {
+        CHECK_FALSE(CrossesBoundary(p, size, boundary));
+      }
+      const uint8_t fill = rng();
+      memset(p, fill, size);
+      live.push_back({p, size, fill});
+    } else {
+      const size_t index = rng() % live.size();
+      const auto block = live[index];
+      // 他の割り当てと重なっていれば書き換わっている
+      for (size_t j = 0; j < block.size; ++j) {
+        CHECK_EQUAL(block.fill, block.p[j]);
+      }
+      pool->Free(block.p);
+      live[index] = live.back();
+      live.pop_back();
+    }
+  }
+
+  for (const auto& block : live) {
+    pool->Free(block.p);
+  }
+  size_t empty_pages = 0;
+  for (int i = 0; i < usb::DMAPool::kNumSizeClasses; ++i) {
+    CHECK_EQUAL(0, pool->Stats(i).in_use);
+    empty_pages += pool->Stats(i).pages;
+  }
+  CHECK_EQUAL(0, pool->Large().in_use);
+  CHECK_EQUAL(pool->MetadataFrames() + empty_pages, arena->frames_in_use);
+}
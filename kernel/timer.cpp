@@ -1,97 +1,510 @@
 #include "timer.hpp"
 
-#include "acpi.hpp"
+#include <algorithm>
+#include <array>
+
+#include "asmfunc.h"
 #include "interrupt.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "smp.hpp"
+#include "softirq.hpp"
 #include "task.hpp"
+#include "tsc.hpp"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
-  volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
-  volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
-  volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
-  volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+  /** @brief 1 tick あたりの LAPIC タイマのカウント数 */
+  unsigned long lapic_counts_per_tick;
+
+  const uint64_t kNsPerTick = 1'000'000'000 / kTimerFreq;
+
+  /** @brief TSC で測定するときの 1 回あたりの時間（マイクロ秒）と回数 */
+  const uint64_t kSampleMicros = 1000;
+  const int kNumSamples = 3;
+
+  /** @brief TSC を基準に kSampleMicros の間の LAPIC タイマのカウント数を数え，周波数を求める。 */
+  unsigned long MeasureLAPICTimerFreq() {
+    const uint64_t sample_tsc = NsToTSC(kSampleMicros * 1000);
+    StartLAPICTimer();
+    const uint64_t start = ReadTSC();
+    uint64_t now;
+    while ((now = ReadTSC()) - start < sample_tsc);
+    const auto elapsed = LAPICTimerElapsed();
+    StopLAPICTimer();
+    return static_cast<unsigned long>(elapsed) * 1'000'000'000 / TSCToNs(now - start);
+  }
 }
 
 void InitializeLAPICTimer() {
-  timer_manager = new TimerManager;
+  WriteLAPIC(LAPICRegister::kDivideConfig, 0b1011); // divide 1:1
+  WriteLAPIC(LAPICRegister::kLVTTimer, 0b001 << 16); // masked, one-shot
 
-  divide_config = 0b1011; // divide 1:1
-  lvt_timer = 0b001 << 16; // masked, one-shot
+  uint64_t hv_tsc, hv_lapic;
+  if ((lapic_timer_freq = CPUIDCrystalFreq()) != 0) {
+    Log(kWarn, "LAPIC timer: %lu kHz (CPUID 0x15)\n", lapic_timer_freq / 1000);
+  } else if (HypervisorFreqs(hv_tsc, hv_lapic) && hv_lapic != 0) {
+    lapic_timer_freq = hv_lapic;
+    Log(kWarn, "LAPIC timer: %lu kHz (hypervisor CPUID 0x40000010)\n",
+        lapic_timer_freq / 1000);
+  } else {
+    std::array<unsigned long, kNumSamples> freqs;
+    for (auto& f : freqs) {
+      f = MeasureLAPICTimerFreq();
+    }
+    std::sort(freqs.begin(), freqs.end());
+    lapic_timer_freq = freqs[kNumSamples / 2];
+    Log(kWarn, "LAPIC timer: %lu kHz (TSC, %d x %lu us, spread %lu kHz)\n",
+        lapic_timer_freq / 1000, kNumSamples, kSampleMicros,
+        (freqs[kNumSamples - 1] - freqs[0]) / 1000);
+  }
 
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+  lapic_counts_per_tick = lapic_timer_freq / kTimerFreq;
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  WriteLAPIC(LAPICRegister::kDivideConfig, 0b1011); // divide 1:1
+  WriteLAPIC(LAPICRegister::kLVTTimer,
+             (0b000 << 16) | InterruptVector::kLAPICTimer); // not-masked, one-shot
 
-  divide_config = 0b1011; // divide 1:1
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
-  initial_count = lapic_timer_freq / kTimerFreq;
+  timer_manager = new TimerManager;
+  RegisterSoftIRQ(SoftIRQ::kTimer, []{ timer_manager->ProcessExpired(); }, false);
+  RegisterSoftIRQ(SoftIRQ::kTimerCallback, []{ timer_manager->RunCallbacks(); }, true);
 }
 
 void StartLAPICTimer() {
-  initial_count = kCountMax;
+  WriteLAPIC(LAPICRegister::kInitialCount, kCountMax);
 }
 
 uint32_t LAPICTimerElapsed() {
-  return kCountMax - current_count;
+  return kCountMax - ReadLAPIC(LAPICRegister::kCurrentCount);
 }
 
 void StopLAPICTimer() {
-  initial_count = 0;
+  WriteLAPIC(LAPICRegister::kInitialCount, 0);
+}
+
+void InitializeLocalAPICTimer() {
+  WriteLAPIC(LAPICRegister::kDivideConfig, 0b1011); // divide 1:1
+  WriteLAPIC(LAPICRegister::kLVTTimer,
+             (0b000 << 16) | InterruptVector::kLAPICTimer); // not-masked, one-shot
+  WriteLAPIC(LAPICRegister::kInitialCount, 0);
+}
+
+void StartLocalTaskTimer(bool restart, int period) {
+  if (!restart && ReadLAPIC(LAPICRegister::kCurrentCount) != 0) {
+    return;
+  }
+  WriteLAPIC(LAPICRegister::kInitialCount, period * lapic_counts_per_tick);
+}
+
+void StopLocalTaskTimer() {
+  WriteLAPIC(LAPICRegister::kInitialCount, 0);
 }
 
-Timer::Timer(unsigned long timeout, int value)
-    : timeout_{timeout}, value_{value} {
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
+    : timeout_{timeout}, value_{value}, task_id_{task_id} {
+}
+
+Timer::Timer(unsigned long timeout, int value, TimerCallback* callback)
+    : timeout_{timeout}, value_{value}, callback_{callback} {
+}
+
+bool TimerHandle::Cancel() {
+  return timer_manager->Cancel(*this);
+}
+
+bool TimerHandle::Reschedule(unsigned long timeout) {
+  return timer_manager->Reschedule(*this, timeout);
 }
 
 TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1});
+  ProgramNextInterrupt();
+}
+
+TimerHandle TimerManager::AddTimer(const Timer& timer) {
+  return AddNode(timer, false);
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-  timers_.push(timer);
+TimerHandle TimerManager::AddHighResTimer(const Timer& timer) {
+  return AddNode(timer, true);
+}
+
+TimerHandle TimerManager::AddNode(const Timer& timer, bool high_res) {
+  InterruptGuard guard;
+  auto node = reinterpret_cast<TimerNode*>(node_pool_.Allocate());
+  if (node == nullptr) {
+    return {};
+  }
+
+  node->timer = timer;
+  node->high_res = high_res;
+  LinkNode(node);
+  if (high_res ? high_res_ == node : timer.Timeout() < next_interrupt_tick_) {
+    ProgramNextInterrupt();
+  }
+  return {node, node->generation};
+}
+
+bool TimerManager::Cancel(TimerHandle& handle) {
+  InterruptGuard guard;
+  TimerNode* node = NodeOf(handle);
+  handle = {};
+  if (node == nullptr) {
+    return false;
+  }
+  UnlinkNode(node);
+  FreeNode(node);
+  // 設定済みの割り込みは早すぎるだけなので，そのままにする
+  return true;
+}
+
+bool TimerManager::Reschedule(TimerHandle& handle, unsigned long timeout) {
+  InterruptGuard guard;
+  TimerNode* node = NodeOf(handle);
+  if (node == nullptr) {
+    handle = {};
+    return false;
+  }
+  UnlinkNode(node);
+  node->timer.SetTimeout(timeout);
+  LinkNode(node);
+  if (node->high_res ? high_res_ == node : timeout < next_interrupt_tick_) {
+    ProgramNextInterrupt();
+  }
+  return true;
+}
+
+unsigned long TimerManager::CurrentTick() {
+  InterruptGuard guard;
+  SyncTick();
+  return tick_;
+}
+
+void TimerManager::StartTaskTimer(bool restart, int period) {
+  if (task_timer_deadline_ != 0 && !restart) {
+    return;
+  }
+  task_timer_deadline_ = CurrentTick() + period;
+  if (task_timer_deadline_ != next_interrupt_tick_) {
+    ProgramNextInterrupt();
+  }
+}
+
+void TimerManager::StopTaskTimer() {
+  // 既に設定済みの割り込みはそのままにし，次の割り込みで設定し直す
+  task_timer_deadline_ = 0;
+}
+
+unsigned long TimerManager::SyncTick() {
+  const uint32_t current = ReadLAPIC(LAPICRegister::kCurrentCount);
+  unsigned long elapsed = armed_offset_ + (armed_count_ - current);
+  if (current == 0 && armed_count_ != 0) {
+    // 0 で止まったカウンタからは割り込みの遅れが分からないので，期限からの遅れを足す。
+    // こうしないと遅れの分だけ次の期限が後ろにずれ，積み重なっていく
+    const uint64_t now_tsc = ReadTSC();
+    if (now_tsc > deadline_tsc_) {
+      elapsed += TSCToNs(now_tsc - deadline_tsc_) * (lapic_timer_freq / 1000) / 1'000'000;
+    }
+  }
+  tick_ = armed_tick_ + elapsed / lapic_counts_per_tick;
+  return elapsed % lapic_counts_per_tick;
+}
+
+void TimerManager::ProgramNextInterrupt() {
+  const unsigned long offset = SyncTick();
+
+  unsigned long next = expired_ ? tick_ : NextWheelEvent();
+  if (task_timer_deadline_ != 0) {
+    next = std::min(next, task_timer_deadline_);
+  }
+  // 何もすることがなくても，カウンタの最大値を超えない範囲で割り込みを入れる
+  const unsigned long max_ticks = kCountMax / lapic_counts_per_tick;
+  next = std::max(next, tick_ + 1);
+  next = std::min(next, tick_ + max_ticks);
+
+  armed_tick_ = tick_;
+  armed_offset_ = offset;
+  armed_count_ = (next - tick_) * lapic_counts_per_tick - offset;
+
+  if (high_res_) {
+    // 高分解能タイマの期限の方が早ければ，tick の境界ではなくその期限に合わせる
+    const uint64_t now_ns = NowNs();
+    const uint64_t deadline_ns = high_res_->timer.Timeout();
+    const uint64_t left_ns = deadline_ns > now_ns ? deadline_ns - now_ns : 0;
+    if (left_ns < (next - tick_) * kNsPerTick) {
+      armed_count_ = std::max<unsigned long>(
+          1, left_ns * (lapic_timer_freq / 1000) / 1'000'000);
+      next = tick_ + (offset + armed_count_) / lapic_counts_per_tick;
+    }
+  }
+
+  next_interrupt_tick_ = next;
+  deadline_tsc_ =
+    ReadTSC() + NsToTSC(armed_count_ * 1'000'000'000 / lapic_timer_freq);
+  WriteLAPIC(LAPICRegister::kInitialCount, armed_count_);
 }
 
 bool TimerManager::Tick() {
-  ++tick_;
+#ifdef IRQ_TRACE
+  IRQTraceTimerFired(deadline_tsc_);
+#endif
+  SyncTick();
 
   bool task_timer_timeout = false;
+  if (task_timer_deadline_ != 0 && task_timer_deadline_ <= tick_) {
+    task_timer_timeout = true;
+    task_timer_deadline_ = 0;
+  }
+
+  // ホイールを進める処理はソフト割り込みに回し，ここでは要否だけを調べる
+  if (expired_ || NextWheelEvent() <= tick_ ||
+      (high_res_ && high_res_->timer.Timeout() <= NowNs())) {
+    RaiseSoftIRQ(SoftIRQ::kTimer);
+  } else {
+    ProgramNextInterrupt();
+  }
+  return task_timer_timeout;
+}
+
+void TimerManager::ProcessExpired() {
+  SyncTick();
+  AdvanceWheel(tick_);
+  if (high_res_) {
+    const uint64_t now_ns = NowNs();
+    while (high_res_ && high_res_->timer.Timeout() <= now_ns) {
+      TimerNode* node = high_res_;
+      UnlinkNode(node);
+      PushNode(&expired_, node);
+    }
+  }
+
+  NotifyExpired();
+  ProgramNextInterrupt();
+}
+
+void TimerManager::RunCallbacks() {
   while (true) {
-    const auto& t = timers_.top();
-    if (t.Timeout() > tick_) {
-      break;
+    TimerNode* node;
+    {
+      SpinLockGuard guard{callbacks_lock_};
+      node = callbacks_;
+      if (node == nullptr) {
+        return;
+      }
+      UnlinkNode(node); // 以降の Cancel は失敗する
     }
 
-    // #@@range_begin(timer_tick)
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
+    node->timer.Callback()(node->timer.Timeout(), node->timer.Value());
+
+    InterruptGuard guard;
+    FreeNode(node);
+  }
+}
+
+void TimerManager::NotifyExpired() {
+  const size_t kBatchSize = 16;
+  std::array<Message, kBatchSize> msgs;
+  bool has_callbacks = false;
+
+  while (TimerNode* head = expired_) {
+    if (head->timer.Callback()) {
+      UnlinkNode(head);
+      SpinLockGuard guard{callbacks_lock_};
+      PushNode(&callbacks_, head);
+      has_callbacks = true;
       continue;
     }
 
-    Message m{Message::kTimerTimeout};
-    m.arg.timer.timeout = t.Timeout();
-    m.arg.timer.value = t.Value();
-    task_manager->SendMessage(1, m);
+    // 先頭と同じタスク宛てのタイマをまとめて 1 回で送る
+    const uint64_t task_id = head->timer.TaskID();
+    size_t num_msgs = 0;
+    TimerNode* node = head;
+    while (node && num_msgs < kBatchSize) {
+      TimerNode* next = node->next;
+      if (node->timer.Callback() == nullptr && node->timer.TaskID() == task_id) {
+        // #@@range_begin(timer_tick)
+        Message& m = msgs[num_msgs++];
+        m.type = Message::kTimerTimeout;
+        m.arg.timer.timeout = node->timer.Timeout();
+        m.arg.timer.value = node->timer.Value();
+        // #@@range_end(timer_tick)
+        UnlinkNode(node);
+        FreeNode(node);
+      }
+      node = next;
+    }
+    task_manager->SendMessages(task_id, msgs.data(), num_msgs);
+  }
 
-    timers_.pop();
-    // #@@range_end(timer_tick)
+  if (has_callbacks) {
+    RaiseSoftIRQ(SoftIRQ::kTimerCallback);
   }
+}
 
-  return task_timer_timeout;
+TimerNode* TimerManager::NodeOf(const TimerHandle& handle) const {
+  TimerNode* node = handle.node_;
+  if (node == nullptr || node->generation != handle.generation_ ||
+      node->list == nullptr) {
+    return nullptr;
+  }
+  return node;
+}
+
+void TimerManager::LinkNode(TimerNode* node) {
+  const unsigned long timeout = node->timer.Timeout();
+  TimerNode** list;
+  node->level = -1;
+  if (node->high_res) {
+    TimerNode* prev = nullptr;
+    TimerNode** pos = &high_res_;
+    while (*pos && (*pos)->timer.Timeout() <= timeout) {
+      prev = *pos;
+      pos = &prev->next;
+    }
+    node->prev = prev;
+    node->next = *pos;
+    if (*pos) {
+      (*pos)->prev = node;
+    }
+    *pos = node;
+    node->list = &high_res_;
+    return;
+  }
+
+  if (timeout <= wheel_tick_) {
+    list = &expired_;
+  } else {
+    int level = 0;
+    while (level < kWheelLevels &&
+           (timeout >> (kWheelBits * (level + 1))) !=
+           (wheel_tick_ >> (kWheelBits * (level + 1)))) {
+      ++level;
+    }
+
+    if (level == kWheelLevels) {
+      list = &overflow_;
+    } else {
+      const int slot = (timeout >> (kWheelBits * level)) & (kWheelSlots - 1);
+      list = &wheel_[level][slot];
+      occupied_[level] |= uint64_t{1} << slot;
+      node->level = level;
+      node->slot = slot;
+    }
+  }
+
+  PushNode(list, node);
+}
+
+void TimerManager::PushNode(TimerNode** list, TimerNode* node) {
+  node->prev = nullptr;
+  node->next = *list;
+  if (*list) {
+    (*list)->prev = node;
+  }
+  *list = node;
+  node->list = list;
+}
+
+void TimerManager::UnlinkNode(TimerNode* node) {
+  if (node->prev) {
+    node->prev->next = node->next;
+  } else {
+    *node->list = node->next;
+  }
+  if (node->next) {
+    node->next->prev = node->prev;
+  }
+
+  if (node->level >= 0 && wheel_[node->level][node->slot] == nullptr) {
+    occupied_[node->level] &= ~(uint64_t{1} << node->slot);
+  }
+  node->prev = node->next = nullptr;
+  node->list = nullptr;
+}
+
+void TimerManager::FreeNode(TimerNode* node) {
+  node->list = nullptr;
+  ++node->generation;
+  node_pool_.Free(node);
+}
+
+unsigned long TimerManager::NextWheelEvent() const {
+  for (int level = 0; level < kWheelLevels; ++level) {
+    const int shift = kWheelBits * level;
+    const int current = (wheel_tick_ >> shift) & (kWheelSlots - 1);
+    if (current == kWheelSlots - 1) {
+      continue;
+    }
+    // 現在のスロットより前は，この階層の桁が繰り上がるまで使われない
+    const uint64_t later = occupied_[level] & (~uint64_t{0} << (current + 1));
+    if (later) {
+      const int upper_shift = shift + kWheelBits;
+      return ((wheel_tick_ >> upper_shift) << upper_shift) |
+             (static_cast<unsigned long>(__builtin_ctzll(later)) << shift);
+    }
+  }
+
+  if (overflow_) {
+    const int top_shift = kWheelBits * kWheelLevels;
+    return ((wheel_tick_ >> top_shift) + 1) << top_shift;
+  }
+  return std::numeric_limits<unsigned long>::max();
+}
+
+void TimerManager::AdvanceWheel(unsigned long tick) {
+  // 何もない tick は飛ばし，スロットの処理が必要な tick だけを順にたどる
+  while (true) {
+    const unsigned long next = NextWheelEvent();
+    if (next > tick) {
+      break;
+    }
+    wheel_tick_ = next;
+
+    const int top_shift = kWheelBits * kWheelLevels;
+    if ((wheel_tick_ & ((1ul << top_shift) - 1)) == 0) {
+      Cascade(overflow_);
+    }
+    for (int level = kWheelLevels - 1; level >= 0; --level) {
+      const int shift = kWheelBits * level;
+      if ((wheel_tick_ & ((1ul << shift) - 1)) != 0) {
+        continue;
+      }
+      const int slot = (wheel_tick_ >> shift) & (kWheelSlots - 1);
+      occupied_[level] &= ~(uint64_t{1} << slot);
+      Cascade(wheel_[level][slot]);
+    }
+  }
+
+  if (tick > wheel_tick_) {
+    wheel_tick_ = tick;
+  }
+}
+
+void TimerManager::Cascade(TimerNode*& list) {
+  TimerNode* node = list;
+  list = nullptr;
+  while (node) {
+    TimerNode* next = node->next;
+    LinkNode(node);
+    node = next;
+  }
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
 
 void LAPICTimerOnInterrupt() {
+  if (CurrentCPU() != kBSPCPU) {
+    // AP の LAPIC タイマ割り込みはタスク切り替えの時刻を表す
+    NotifyEndOfInterrupt();
+    task_manager->QuantumExpired();
+    return;
+  }
+
   const bool task_timer_timeout = timer_manager->Tick();
   NotifyEndOfInterrupt();
+  RunSoftIRQs(); // タスクを切り替える前にホイールを進める
 
   if (task_timer_timeout) {
-    task_manager->SwitchTask();
+    task_manager->QuantumExpired();
   }
 }
@@ -1,42 +1,238 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <queue>
-#include <vector>
 #include <limits>
 #include "message.hpp"
+#include "object_pool.hpp"
+#include "spinlock.hpp"
 
+/** @brief BSP の LAPIC タイマの周波数を求め，TimerManager を生成する。
+ *
+ * 周波数は CPUID 0x15，ハイパーバイザの CPUID 0x40000010 の順に記載を探し，
+ * なければ TSC を基準に測定する。InitializeTSC の後に呼ぶこと。
+ */
 void InitializeLAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
+/** @brief AP 上で呼び，その CPU の LAPIC タイマをワンショットモードで初期化する。
+ *
+ * 周波数は BSP で測定した値を使う。AP の LAPIC タイマはタスク切り替えにだけ使う。
+ */
+void InitializeLocalAPICTimer();
+/** @brief 実行中の AP の LAPIC タイマでタスク切り替え用のタイマを開始する。
+ *
+ * @param period  タスク切り替えまでの tick 数
+ */
+void StartLocalTaskTimer(bool restart, int period);
+/** @brief 実行中の AP のタスク切り替え用のタイマを止める。 */
+void StopLocalTaskTimer();
+
+/** @brief ソフト割り込み用のタスクで呼ばれるコールバック。timeout と value はタイマの値。 */
+using TimerCallback = void (unsigned long timeout, int value);
+
 class Timer {
  public:
-  Timer(unsigned long timeout, int value);
+  Timer() = default;
+  /** @brief タイムアウトすると task_id のタスクに kTimerTimeout を送るタイマ */
+  Timer(unsigned long timeout, int value, uint64_t task_id);
+  /** @brief タイムアウトするとソフト割り込み用のタスクで callback(timeout, value) を呼ぶタイマ */
+  Timer(unsigned long timeout, int value, TimerCallback* callback);
   unsigned long Timeout() const { return timeout_; }
   int Value() const { return value_; }
+  uint64_t TaskID() const { return task_id_; }
+  TimerCallback* Callback() const { return callback_; }
+  void SetTimeout(unsigned long timeout) { timeout_ = timeout; }
 
  private:
-  unsigned long timeout_;
-  int value_;
+  unsigned long timeout_{0};
+  int value_{0};
+  uint64_t task_id_{0};
+  TimerCallback* callback_{nullptr};
 };
 
-/** @brief タイマー優先度を比較する。タイムアウトが遠いほど優先度低。 */
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-}
+/** @brief タイミングホイールに登録されたタイマ。TimerManager があらかじめ確保しておく。 */
+struct TimerNode {
+  Timer timer{};
+  TimerNode* prev{nullptr};
+  TimerNode* next{nullptr};
+  /** @brief このノードが繋がっているリストの先頭。未使用なら nullptr。 */
+  TimerNode** list{nullptr};
+  /** @brief true なら timer のタイムアウトは tick ではなく NowNs() のナノ秒 */
+  bool high_res{false};
+  /** @brief ホイールの階層とスロット。ホイール外のリストにあれば level は -1。 */
+  int level{-1}, slot{0};
+  /** @brief ノードを再利用するたびに増やし，古いハンドルを無効にする */
+  uint32_t generation{0};
+};
+
+/** @brief TimerManager::AddTimer が返すタイマのハンドル。
+ *
+ * タイマが満了するか取り消されると無効になり，Cancel や Reschedule は false を返す。
+ */
+class TimerHandle {
+ public:
+  TimerHandle() = default;
+  bool Valid() const { return node_ != nullptr; }
+  /** @brief タイマを取り消す。既に満了していれば何もせず false を返す。 */
+  bool Cancel();
+  /** @brief タイムアウトを変更する。既に満了していれば何もせず false を返す。
+   *
+   * 高分解能タイマならタイムアウトはナノ秒で指定する。
+   */
+  bool Reschedule(unsigned long timeout);
+
+ private:
+  TimerHandle(TimerNode* node, uint32_t generation)
+      : node_{node}, generation_{generation} {}
+
+  TimerNode* node_{nullptr};
+  uint32_t generation_{0};
+
+  friend class TimerManager;
+};
 
+/** @brief タイマを管理し，BSP の LAPIC タイマをワンショットで駆動するクラス。
+ *
+ * BSP 以外から操作してはならない（LAPIC タイマは CPU ごとに別物のため）。
+ * LAPIC タイマは周期モードでは使わず，次に必要な時刻（最も近いタイマの
+ * タイムアウトか，タスク切り替えの時刻）にだけ割り込みが来るように設定する。
+ * 割り込みの間隔が空いても，経過した LAPIC のカウント数から tick を計算するので
+ * tick の値は周期モードと同じように進む。
+ *
+ * タイマは階層化タイミングホイールで管理する。ノードはあらかじめ確保しておくので，
+ * 追加と取り消しは O(1) でメモリ確保を伴わない。
+ * タスク切り替え用のタイマはホイールに入れず，専用の時刻 task_timer_deadline_ で扱う。
+ *
+ * tick より細かい期限が必要なら AddHighResTimer を使う。高分解能タイマは期限順の
+ * リストで管理し，tick の境界によらずその期限に LAPIC タイマ割り込みを設定する。
+ */
 class TimerManager {
  public:
+  /** @brief 同時に登録できるタイマの最大数 */
+  static const size_t kMaxTimers = 256;
+
+  /** @brief LAPIC タイマの周波数を測定した後に生成すること。 */
   TimerManager();
-  void AddTimer(const Timer& timer);
+  /** @brief タイマを追加する。内部で割り込みを禁止するのでタスクから直接呼べる。
+   *
+   * @return タイマのハンドル。kMaxTimers 個のタイマが登録済みなら無効なハンドル。
+   */
+  TimerHandle AddTimer(const Timer& timer);
+  /** @brief NowNs() が timer.Timeout()（ナノ秒）に達したら満了する高分解能タイマを追加する。
+   *
+   * 満了すると AddTimer のタイマと同じく通知される。
+   * そのメッセージの timeout には tick ではなくナノ秒の期限が入る。
+   * 高分解能タイマの数は少ないことを想定しており，追加は登録数に比例する時間がかかる。
+   */
+  TimerHandle AddHighResTimer(const Timer& timer);
+  /** @brief タイマを取り消す。handle が既に無効なら false を返す。 */
+  bool Cancel(TimerHandle& handle);
+  /** @brief タイマのタイムアウトを変更する。handle が既に無効なら false を返す。 */
+  bool Reschedule(TimerHandle& handle, unsigned long timeout);
+  /** @brief LAPIC タイマ割り込みで呼ぶ。
+   *
+   * 経過した tick を反映し，タイムアウトしたタイマがあれば SoftIRQ::kTimer を立てる。
+   * なければ次の割り込みを設定する。
+   *
+   * @return タスク切り替えの時刻になっていたら true
+   */
   bool Tick();
-  unsigned long CurrentTick() const { return tick_; }
+  /** @brief 現在の tick を返す。内部で割り込みを禁止するのでタスクから直接呼べる。 */
+  unsigned long CurrentTick();
+  /** @brief タイマのノード用のプールの統計情報 */
+  ObjectPoolStats NodePoolStats() const { return node_pool_.GetStats(); }
+
+  /** @brief タスク切り替え用のタイマを開始する。
+   *
+   * @param restart  true なら動作中でも今から period 後に設定し直す
+   * @param period  タスク切り替えまでの tick 数
+   */
+  void StartTaskTimer(bool restart, int period);
+  /** @brief タスク切り替え用のタイマを止める。切り替え先がないときに使う。 */
+  void StopTaskTimer();
+
+  /** @brief ホイールを現在の tick まで進め，満了したタイマを通知する。
+   *
+   * SoftIRQ::kTimer のハンドラ。Tick の後，同じ割り込みの出口で呼ばれる。
+   */
+  void ProcessExpired();
+  /** @brief 満了したタイマのコールバックを順に呼ぶ。SoftIRQ::kTimerCallback のハンドラ。 */
+  void RunCallbacks();
 
  private:
+  static const int kWheelBits = 6;
+  static const int kWheelSlots = 1 << kWheelBits;
+  static const int kWheelLevels = 4;
+
   volatile unsigned long tick_{0};
-  std::priority_queue<Timer> timers_{};
+
+  /** @brief ノードのプール。解放したノードの領域は TimerManager の中に残るので，
+   * 古いハンドルが指していても generation と list で無効と判定できる。 */
+  ObjectPool<TimerNode, kMaxTimers> node_pool_{};
+  /** @brief 階層 L のスロット S には，wheel_tick_ と L+1 階層目より上の桁が一致し，
+   * L 階層目の桁が S であるタイムアウトのタイマが入る。各階層は kWheelBits ビット分。 */
+  std::array<std::array<TimerNode*, kWheelSlots>, kWheelLevels> wheel_{};
+  /** @brief 空でないスロットのビットマップ */
+  std::array<uint64_t, kWheelLevels> occupied_{};
+  /** @brief ホイールに入りきらない遠いタイマ */
+  TimerNode* overflow_{nullptr};
+  /** @brief 満了してコールバックを待つタイマ */
+  TimerNode* callbacks_{nullptr};
+  SpinLock callbacks_lock_;
+  /** @brief 高分解能タイマ。期限の早い順に並ぶ。 */
+  TimerNode* high_res_{nullptr};
+  /** @brief 満了して通知を待つタイマ */
+  TimerNode* expired_{nullptr};
+  /** @brief ホイールが処理を終えた tick */
+  unsigned long wheel_tick_{0};
+
+  /** @brief タスク切り替えの時刻。0 ならタスク切り替え用のタイマは停止中。 */
+  unsigned long task_timer_deadline_{0};
+
+  /** @brief LAPIC タイマを設定した時点の tick */
+  unsigned long armed_tick_{0};
+  /** @brief LAPIC タイマを設定した時点で armed_tick_ から経過していたカウント数 */
+  unsigned long armed_offset_{0};
+  /** @brief LAPIC タイマに設定した初期カウント */
+  unsigned long armed_count_{0};
+  /** @brief 次の割り込みが来る予定の tick */
+  unsigned long next_interrupt_tick_{0};
+  /** @brief 設定した LAPIC タイマが 0 になる時刻（TSC）。
+   * 割り込みの処理が遅れても，次の期限をこの時刻から数えるために使う。 */
+  uint64_t deadline_tsc_{0};
+
+  /** @brief LAPIC タイマの経過カウントを tick_ に反映し，端数のカウント数を返す。
+   *
+   * カウンタが 0 まで進んでいれば，その後の経過は deadline_tsc_ からの TSC の差で補う。
+   */
+  unsigned long SyncTick();
+  /** @brief 次に必要な時刻に LAPIC タイマ割り込みが来るよう設定する。 */
+  void ProgramNextInterrupt();
+
+  /** @brief ハンドルが指すノードを返す。無効なハンドルなら nullptr。 */
+  TimerNode* NodeOf(const TimerHandle& handle) const;
+  TimerHandle AddNode(const Timer& timer, bool high_res);
+  /** @brief タイムアウトに応じてノードをホイールか満了リスト，高分解能タイマのリストに繋ぐ。 */
+  void LinkNode(TimerNode* node);
+  /** @brief ノードをリストの先頭に繋ぐ。 */
+  void PushNode(TimerNode** list, TimerNode* node);
+  void UnlinkNode(TimerNode* node);
+  void FreeNode(TimerNode* node);
+  /** @brief 次にスロットの処理（満了か下の階層への移し替え）が必要になる tick */
+  unsigned long NextWheelEvent() const;
+  /** @brief ホイールを tick まで進め，満了したタイマを expired_ に移す。 */
+  void AdvanceWheel(unsigned long tick);
+  /** @brief リストを取り外し，各ノードを現在の wheel_tick_ に合わせて繋ぎ直す。 */
+  void Cascade(TimerNode*& list);
+  /** @brief expired_ のタイマを通知する。
+   *
+   * メッセージは宛先のタスクごとにまとめて送り，タスクの起床は 1 回で済ませる。
+   * コールバックを持つタイマは callbacks_ に移して SoftIRQ::kTimerCallback を立てる。
+   */
+  void NotifyExpired();
 };
 
 extern TimerManager* timer_manager;
@@ -44,6 +240,5 @@ extern unsigned long lapic_timer_freq;
 const int kTimerFreq = 100;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::min();
 
 void LAPICTimerOnInterrupt();
@@ -0,0 +1,188 @@
+#include "tsc.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "hpet.hpp"
+#include "logger.hpp"
+
+namespace {
+  const uint64_t kNsPerSec = 1'000'000'000;
+  const int kMultShift = 32;
+  /** @brief 基準カウンタで測定するときの 1 回あたりの時間（マイクロ秒）と回数 */
+  const uint64_t kSampleMicros = 1000;
+  const int kNumSamples = 5;
+
+  uint64_t tsc_base;
+  /** @brief ns = cycles * ns_mult >> kMultShift */
+  uint64_t ns_mult;
+  /** @brief cycles = ns * tsc_mult >> kMultShift */
+  uint64_t tsc_mult;
+
+  uint64_t MulShift(uint64_t value, uint64_t mult) {
+    return static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(value) * mult) >> kMultShift);
+  }
+
+  /** @brief CPUID 0x15 で TSC の周波数を得る。分からなければ 0。 */
+  uint64_t CPUIDTSCFreq() {
+    uint32_t regs[4];
+    ReadCPUID(0, 0, regs);
+    if (regs[0] < 0x15) {
+      return 0;
+    }
+    ReadCPUID(0x15, 0, regs);
+    const uint32_t denominator = regs[0], numerator = regs[1];
+    if (denominator == 0 || numerator == 0) {
+      return 0;
+    }
+    const uint64_t crystal = CPUIDCrystalFreq();
+    return crystal * numerator / denominator;
+  }
+
+  /** @brief 基準カウンタ（HPET があれば HPET，なければ PM タイマ）の読み取りと，
+   * その直前直後の TSC */
+  struct RefSample {
+    uint64_t count;
+    uint64_t tsc_before, tsc_after;
+  };
+
+  uint64_t ReferenceFreq() {
+    return hpet::Available() ? hpet::Frequency() : acpi::kPMTimerFreq;
+  }
+
+  uint64_t ReferenceDiff(uint64_t start, uint64_t end) {
+    return hpet::Available() ? hpet::CounterDiff(start, end)
+                             : acpi::PMTimerDiff(start, end);
+  }
+
+  RefSample ReadRefSample() {
+    RefSample s;
+    s.tsc_before = ReadTSC();
+    s.count = hpet::Available() ? hpet::ReadCounter() : acpi::ReadPMTimer();
+    s.tsc_after = ReadTSC();
+    return s;
+  }
+
+  /** @brief 基準カウンタで kSampleMicros の間の TSC の増分を数え，周波数を求める。
+   *
+   * 基準カウンタの読み取りにかかった時間と量子化誤差を誤差として error に返す。
+   */
+  uint64_t MeasureTSCFreq(uint64_t& error) {
+    const uint64_t ref_freq = ReferenceFreq();
+    const uint64_t ref_ticks = ref_freq * kSampleMicros / 1'000'000;
+    const RefSample start = ReadRefSample();
+    RefSample end;
+    do {
+      end = ReadRefSample();
+    } while (ReferenceDiff(start.count, end.count) < ref_ticks);
+
+    const uint64_t elapsed_ref = ReferenceDiff(start.count, end.count);
+    const uint64_t mid_start = (start.tsc_before + start.tsc_after) / 2;
+    const uint64_t mid_end = (end.tsc_before + end.tsc_after) / 2;
+    const uint64_t uncertainty = (start.tsc_after - start.tsc_before) / 2 +
+                                 (end.tsc_after - end.tsc_before) / 2;
+    // 基準カウンタ自体の量子化誤差 1 カウント分も加える
+    error = (uncertainty + (mid_end - mid_start) / elapsed_ref) *
+            ref_freq / elapsed_ref;
+    return (mid_end - mid_start) * ref_freq / elapsed_ref;
+  }
+}
+
+uint64_t tsc_freq;
+
+void InitializeTSC() {
+  if (!TSCInvariant()) {
+    Log(kWarn, "TSC is not invariant: NowNs() may drift\n");
+  }
+
+  uint64_t hv_tsc, hv_lapic;
+  if ((tsc_freq = CPUIDTSCFreq()) != 0) {
+    Log(kWarn, "TSC: %lu kHz (CPUID 0x15)\n", tsc_freq / 1000);
+  } else if (HypervisorFreqs(hv_tsc, hv_lapic) && hv_tsc != 0) {
+    tsc_freq = hv_tsc;
+    Log(kWarn, "TSC: %lu kHz (hypervisor CPUID 0x40000010)\n", tsc_freq / 1000);
+  } else {
+    // 数回測定して中央値を取り，外れ値（測定中の SMI など）の影響を避ける
+    std::array<uint64_t, kNumSamples> freqs;
+    uint64_t max_error = 0;
+    for (auto& f : freqs) {
+      uint64_t error;
+      f = MeasureTSCFreq(error);
+      max_error = std::max(max_error, error);
+    }
+    std::sort(freqs.begin(), freqs.end());
+    tsc_freq = freqs[kNumSamples / 2];
+    Log(kWarn, "TSC: %lu kHz (%s, %d x %lu us, +/-%lu kHz, spread %lu kHz)\n",
+        tsc_freq / 1000, hpet::Available() ? "HPET" : "PM timer",
+        kNumSamples, kSampleMicros, max_error / 1000,
+        (freqs[kNumSamples - 1] - freqs[0]) / 1000);
+  }
+
+  ns_mult = (kNsPerSec << kMultShift) / tsc_freq;
+  // tsc_freq << kMultShift は 64 ビットに収まらないことがあるので整数部と端数に分ける
+  tsc_mult = ((tsc_freq / kNsPerSec) << kMultShift) +
+             ((tsc_freq % kNsPerSec) << kMultShift) / kNsPerSec;
+  tsc_base = ReadTSC();
+}
+
+bool TSCInvariant() {
+  uint32_t regs[4];
+  ReadCPUID(0x80000000, 0, regs);
+  if (regs[0] < 0x80000007) {
+    return false;
+  }
+  ReadCPUID(0x80000007, 0, regs);
+  return (regs[3] >> 8) & 1; // EDX bit 8: Invariant TSC
+}
+
+uint64_t CPUIDCrystalFreq() {
+  uint32_t regs[4];
+  ReadCPUID(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+  if (max_leaf < 0x15) {
+    return 0;
+  }
+  ReadCPUID(0x15, 0, regs);
+  const uint32_t denominator = regs[0], numerator = regs[1];
+  if (regs[2] != 0) {
+    return regs[2];
+  }
+  // 水晶の周波数が記載されていなければ，CPUID 0x16 の基本周波数から逆算する
+  if (max_leaf < 0x16 || denominator == 0 || numerator == 0) {
+    return 0;
+  }
+  ReadCPUID(0x16, 0, regs);
+  const uint64_t base_hz = uint64_t{regs[0]} * 1'000'000;
+  return base_hz * denominator / numerator;
+}
+
+bool HypervisorFreqs(uint64_t& tsc_hz, uint64_t& lapic_hz) {
+  uint32_t regs[4];
+  ReadCPUID(1, 0, regs);
+  if (((regs[2] >> 31) & 1) == 0) { // ECX bit 31: hypervisor present
+    return false;
+  }
+  ReadCPUID(0x40000000, 0, regs);
+  if (regs[0] < 0x40000010) {
+    return false;
+  }
+  ReadCPUID(0x40000010, 0, regs);
+  tsc_hz = uint64_t{regs[0]} * 1000;
+  lapic_hz = uint64_t{regs[1]} * 1000;
+  return tsc_hz != 0 || lapic_hz != 0;
+}
+
+uint64_t NowNs() {
+  return TSCToNs(ReadTSC() - tsc_base);
+}
+
+uint64_t TSCToNs(uint64_t cycles) {
+  return MulShift(cycles, ns_mult);
+}
+
+uint64_t NsToTSC(uint64_t ns) {
+  return MulShift(ns, tsc_mult);
+}
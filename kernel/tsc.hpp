@@ -0,0 +1,42 @@
+/**
+ * @file tsc.hpp
+ *
+ * TSC（タイムスタンプカウンタ）を使ったナノ秒単位の時刻源を提供する。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief TSC の周波数（Hz）。InitializeTSC 前は 0。 */
+extern uint64_t tsc_freq;
+
+/** @brief TSC の周波数を求める。hpet::Initialize の後に呼ぶこと。
+ *
+ * CPUID 0x15（と 0x16），ハイパーバイザの CPUID 0x40000010 の順に周波数の記載を探し，
+ * どちらもなければ HPET（なければ ACPI PM タイマ）で 1 ms ずつ数回測定した中央値を使う。
+ * 求めた周波数と方法はログに出力する。
+ *
+ * 不変（invariant）TSC でない CPU では警告を出す。その場合，省電力状態で
+ * TSC が止まったり周波数が変わったりして NowNs が狂うことがある。
+ */
+void InitializeTSC();
+/** @brief TSC が不変（CPU の周波数や省電力状態によらず一定の速さで進む）なら true */
+bool TSCInvariant();
+/** @brief CPUID 0x15（と 0x16）から求めたコア水晶の周波数（Hz）。分からなければ 0。
+ *
+ * この周波数を記載する CPU では，LAPIC タイマもこの周波数で動く。
+ */
+uint64_t CPUIDCrystalFreq();
+/** @brief ハイパーバイザの CPUID 0x40000010 から TSC と LAPIC タイマの周波数（Hz）を得る。
+ *
+ * @return 記載があれば true
+ */
+bool HypervisorFreqs(uint64_t& tsc_hz, uint64_t& lapic_hz);
+
+/** @brief InitializeTSC を呼んだ時点からの経過時間（ナノ秒）を返す。どの CPU からも呼べる。 */
+uint64_t NowNs();
+/** @brief TSC のカウント数をナノ秒に変換する。 */
+uint64_t TSCToNs(uint64_t cycles);
+/** @brief ナノ秒を TSC のカウント数に変換する。 */
+uint64_t NsToTSC(uint64_t ns);
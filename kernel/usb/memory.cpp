@@ -1,43 +1,330 @@
 #include "usb/memory.hpp"
 
-#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
 
 namespace {
   template <class T>
-  T Ceil(T value, unsigned int alignment) {
+  T Ceil(T value, size_t alignment) {
     return (value + alignment - 1) & ~static_cast<T>(alignment - 1);
   }
 
-  template <class T, class U>
-  T MaskBits(T value, U mask) {
-    return value & ~static_cast<T>(mask - 1);
+  size_t RoundUpPowerOfTwo(size_t value) {
+    return value <= 1 ? 1 : size_t{1} << (64 - __builtin_clzl(value - 1));
   }
 }
 
 namespace usb {
-  alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
+  int DMAPool::SizeClassOf(size_t block_bytes) {
+    int size_class = 0;
+    while ((kMinBlockBytes << size_class) < block_bytes) {
+      ++size_class;
+    }
+    return size_class;
+  }
 
-  void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
-    if (alignment > 0) {
-      alloc_ptr = Ceil(alloc_ptr, alignment);
+  void* DMAPool::Allocate(size_t size, unsigned int alignment, unsigned int boundary) {
+    if (size > std::numeric_limits<size_t>::max() / 4) {
+      ++failures_;
+      return nullptr;
     }
-    if (boundary > 0) {
-      auto next_boundary = Ceil(alloc_ptr, boundary);
-      if (next_boundary < alloc_ptr + size) {
-        alloc_ptr = next_boundary;
+    size = std::max<size_t>(size, 1);
+
+    // ブロックは自身の大きさに揃っているので，アライメントを含めて切り上げれば
+    // アライメントを満たす．size <= boundary ならブロックの大きさも boundary 以下になり，
+    // boundary を跨がない．
+    const size_t block_bytes = std::max(RoundUpPowerOfTwo(std::max<size_t>(size, alignment)),
+                                        kMinBlockBytes);
+    if (block_bytes > kBytesPerPage) {
+      return AllocateLarge(size, alignment, boundary);
+    }
+
+    const int size_class = SizeClassOf(block_bytes);
+    auto& c = classes_[size_class];
+    Span* page = c.partial;
+    if (page == nullptr) {
+      if (c.empty) {
+        page = c.empty;
+        c.empty = nullptr;
+      } else if ((page = NewPage(size_class)) == nullptr) {
+        ++failures_;
+        return nullptr;
+      } else {
+        ++c.stats.pages;
+        c.stats.free += kBytesPerPage / block_bytes;
       }
+      Link(c.partial, page);
+    }
+
+    FreeBlock* block = page->free_list;
+    page->free_list = block->next;
+    ++page->in_use;
+    if (page->free_list == nullptr) {
+      Unlink(c.partial, page);
+    }
+
+    ++c.stats.in_use;
+    --c.stats.free;
+    ++c.stats.allocs;
+    memset(block, 0, size);
+    return block;
+  }
+
+  void DMAPool::Free(void* p) {
+    if (p == nullptr) {
+      return;
+    }
+
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    Span* span = FindSpan(addr & ~(kBytesPerPage - 1));
+    if (span == nullptr || (span->size_class < 0 && span->base != addr)) {
+      Log(kError, "DMAPool::Free: invalid pointer %p\n", p);
+      return;
+    }
+
+    if (span->size_class < 0) {
+      RemoveSpan(span);
+      source_.free(p, span->num_frames);
+      --large_stats_.in_use;
+      large_stats_.frames_in_use -= span->num_frames;
+      ++large_stats_.frees;
+      DeleteSpan(span);
+      return;
+    }
+
+    const size_t block_bytes = kMinBlockBytes << span->size_class;
+    if ((addr - span->base) % block_bytes != 0) {
+      Log(kError, "DMAPool::Free: invalid pointer %p\n", p);
+      return;
+    }
+
+    auto& c = classes_[span->size_class];
+    auto block = reinterpret_cast<FreeBlock*>(p);
+    const bool was_full = span->free_list == nullptr;
+    block->next = span->free_list;
+    span->free_list = block;
+    --span->in_use;
+
+    --c.stats.in_use;
+    ++c.stats.free;
+    ++c.stats.frees;
+
+    if (was_full) {
+      Link(c.partial, span);
+    }
+    if (span->in_use > 0) {
+      return;
+    }
+
+    Unlink(c.partial, span);
+    if (c.empty == nullptr) {
+      c.empty = span;
+      return;
+    }
+    --c.stats.pages;
+    c.stats.free -= kBytesPerPage / block_bytes;
+    RemoveSpan(span);
+    source_.free(reinterpret_cast<void*>(span->base), 1);
+    DeleteSpan(span);
+  }
+
+  void DMAPool::Report() const {
+    for (int i = 0; i < kNumSizeClasses; ++i) {
+      const auto& stats = classes_[i].stats;
+      Log(kWarn, "dma %4lu B: pages %lu, in use %lu, free %lu, allocs %lu, frees %lu\n",
+          kMinBlockBytes << i, stats.pages, stats.in_use, stats.free,
+          stats.allocs, stats.frees);
+    }
+    Log(kWarn, "dma large: in use %lu (%lu frames), allocs %lu, frees %lu\n",
+        large_stats_.in_use, large_stats_.frames_in_use,
+        large_stats_.allocs, large_stats_.frees);
+    Log(kWarn, "dma metadata: %lu frames, failures %lu\n",
+        metadata_frames_, failures_);
+  }
+
+  void DMAPool::Link(Span*& head, Span* span) {
+    span->prev = nullptr;
+    span->next = head;
+    if (head) {
+      head->prev = span;
+    }
+    head = span;
+  }
+
+  void DMAPool::Unlink(Span*& head, Span* span) {
+    if (span->prev) {
+      span->prev->next = span->next;
+    } else {
+      head = span->next;
+    }
+    if (span->next) {
+      span->next->prev = span->prev;
+    }
+    span->prev = span->next = nullptr;
+  }
+
+  void* DMAPool::AllocateLarge(size_t size, size_t alignment, unsigned int boundary) {
+    // 先頭を align_bytes に揃えれば，アライメントを満たし，
+    // size <= boundary なら size 以上の 2 のべき乗に揃うので boundary を跨がない
+    size_t align_bytes = std::max(alignment, kBytesPerPage);
+    if (boundary != 0 && size <= boundary) {
+      align_bytes = std::max(align_bytes, RoundUpPowerOfTwo(size));
+    }
+    const size_t num_frames = (size + kBytesPerPage - 1) / kBytesPerPage;
+    const size_t extra_frames = align_bytes / kBytesPerPage - 1;
+
+    Span* span = NewSpan();
+    if (span == nullptr) {
+      ++failures_;
+      return nullptr;
     }
+    const auto frames = reinterpret_cast<uintptr_t>(source_.allocate(num_frames + extra_frames));
+    if (frames == 0) {
+      DeleteSpan(span);
+      ++failures_;
+      return nullptr;
+    }
+
+    // 揃えた位置の前後で余ったフレームを返す
+    const uintptr_t base = Ceil(frames, align_bytes);
+    const size_t head_frames = (base - frames) / kBytesPerPage;
+    if (head_frames > 0) {
+      source_.free(reinterpret_cast<void*>(frames), head_frames);
+    }
+    if (extra_frames > head_frames) {
+      source_.free(reinterpret_cast<void*>(base + num_frames * kBytesPerPage),
+                   extra_frames - head_frames);
+    }
+
+    span->base = base;
+    span->num_frames = num_frames;
+    span->size_class = -1;
+    span->in_use = 1;
+    span->free_list = nullptr;
+    span->prev = span->next = nullptr;
+    InsertSpan(span);
 
-    if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize
-        < alloc_ptr + size) {
+    ++large_stats_.in_use;
+    large_stats_.frames_in_use += num_frames;
+    ++large_stats_.allocs;
+    memset(reinterpret_cast<void*>(base), 0, size);
+    return reinterpret_cast<void*>(base);
+  }
+
+  DMAPool::Span* DMAPool::NewPage(int size_class) {
+    Span* span = NewSpan();
+    if (span == nullptr) {
       return nullptr;
     }
+    const auto frame = reinterpret_cast<uintptr_t>(source_.allocate(1));
+    if (frame == 0) {
+      DeleteSpan(span);
+      return nullptr;
+    }
+
+    const size_t block_bytes = kMinBlockBytes << size_class;
+    span->base = frame;
+    span->num_frames = 1;
+    span->size_class = size_class;
+    span->in_use = 0;
+    span->prev = span->next = nullptr;
+
+    // ブロックを先頭から順に取り出せるようにフリーリストを後ろから繋ぐ
+    span->free_list = nullptr;
+    for (size_t offset = kBytesPerPage; offset > 0; offset -= block_bytes) {
+      auto block = reinterpret_cast<FreeBlock*>(frame + offset - block_bytes);
+      block->next = span->free_list;
+      span->free_list = block;
+    }
+    InsertSpan(span);
+    return span;
+  }
 
-    auto p = alloc_ptr;
-    alloc_ptr += size;
-    return reinterpret_cast<void*>(p);
+  DMAPool::Span* DMAPool::NewSpan() {
+    if (free_spans_ == nullptr) {
+      // 管理情報用のフレームは返さずに使い回す
+      auto spans = reinterpret_cast<Span*>(source_.allocate(1));
+      if (spans == nullptr) {
+        return nullptr;
+      }
+      ++metadata_frames_;
+      for (size_t i = 0; i < kBytesPerPage / sizeof(Span); ++i) {
+        DeleteSpan(&spans[i]);
+      }
+    }
+    Span* span = free_spans_;
+    free_spans_ = span->hash_next;
+    return span;
   }
 
-  void FreeMem(void* p) {}
+  void DMAPool::DeleteSpan(Span* span) {
+    span->hash_next = free_spans_;
+    free_spans_ = span;
+  }
+
+  DMAPool::Span* DMAPool::FindSpan(uintptr_t base) const {
+    for (Span* span = spans_[base / kBytesPerPage % kNumBuckets];
+         span != nullptr; span = span->hash_next) {
+      if (span->base == base) {
+        return span;
+      }
+    }
+    return nullptr;
+  }
+
+  void DMAPool::InsertSpan(Span* span) {
+    auto& bucket = spans_[span->base / kBytesPerPage % kNumBuckets];
+    span->hash_next = bucket;
+    bucket = span;
+  }
+
+  void DMAPool::RemoveSpan(Span* span) {
+    Span** link = &spans_[span->base / kBytesPerPage % kNumBuckets];
+    while (*link != span) {
+      link = &(*link)->hash_next;
+    }
+    *link = span->hash_next;
+  }
+
+  namespace {
+    /** @brief DMA に使うフレームの上限（このフレームの手前まで）．SetDMAAddressLimit で設定する． */
+    size_t dma_frame_limit = std::numeric_limits<size_t>::max();
+
+    void* AllocateDMAFrames(size_t num_frames) {
+      const auto [ frame, err ] = AllocateFrames(num_frames, FrameID{dma_frame_limit});
+      return err ? nullptr : frame.Frame();
+    }
+
+    void FreeDMAFrames(void* p, size_t num_frames) {
+      FreeFrames(FrameID{reinterpret_cast<uintptr_t>(p) / kBytesPerFrame}, num_frames);
+    }
+
+    // 物理アドレスと仮想アドレスが一致しているので，フレームをそのまま DMA に使える
+    DMAPool dma_pool{FrameSource{AllocateDMAFrames, FreeDMAFrames}};
+    SpinLock dma_lock;
+  }
+
+  void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
+    SpinLockGuard guard{dma_lock};
+    return dma_pool.Allocate(size, alignment, boundary);
+  }
+
+  void FreeMem(void* p) {
+    SpinLockGuard guard{dma_lock};
+    dma_pool.Free(p);
+  }
+
+  void ReportMem() {
+    dma_pool.Report();
+  }
+
+  void SetDMAAddressLimit(uintptr_t limit) {
+    SpinLockGuard guard{dma_lock};
+    dma_frame_limit = limit / kBytesPerFrame;
+  }
 }
@@ -6,21 +6,139 @@
 
 #pragma once
 
+#include <array>
 #include <cstddef>
+#include <cstdint>
 
 namespace usb {
-  /** @brief 動的メモリ確保のためのメモリプールの最大容量（バイト） */
-  static const size_t kMemoryPoolSize = 4096 * 64;
+  /** @brief DMAPool が領域を得るためのフレームの確保，解放関数 */
+  struct FrameSource {
+    /** @brief 連続した num_frames 個のフレームを確保して先頭を返す．確保できなければ nullptr． */
+    void* (*allocate)(size_t num_frames);
+    /** @brief allocate で得たフレームのうち，p から num_frames 個を返す． */
+    void (*free)(void* p, size_t num_frames);
+  };
+
+  /** @brief DMA に使う領域をアライメントと境界の制約を守って割り当てるアロケータ．
+   *
+   * 大きさ（アライメントも含む）を 2 のべき乗に切り上げてサイズクラスに分け，
+   * サイズクラスごとに 1 フレームのページを同じ大きさのブロックに分けて割り当てる．
+   * ブロックはその大きさに揃った位置にあるので，アライメントを満たし，
+   * 大きさ以上の 2 のべき乗の境界を跨がない．
+   * 1 フレームを超える要求は制約を満たす連続したフレームを直接割り当てる．
+   *
+   * ページとフレームの管理情報はフレームの外に持つので，ブロックにヘッダはない．
+   * 空になったページはサイズクラスごとに 1 つだけ残し，それ以外はフレームを返す．
+   *
+   * 排他制御はしない．複数の文脈から使う場合は呼び出し側でロックを取ること．
+   */
+  class DMAPool {
+   public:
+    static constexpr size_t kBytesPerPage = 4096;
+    /** @brief 最小のブロックの大きさ（バイト）．xHCI の構造体のアライメントに合わせる． */
+    static constexpr size_t kMinBlockBytes = 64;
+    static constexpr int kNumSizeClasses = 7; // 64, 128, ..., 4096 バイト
+
+    /** @brief サイズクラスごとの統計情報 */
+    struct ClassStats {
+      size_t pages{0};     // 確保しているページ数
+      size_t in_use{0};    // 使用中のブロック数
+      size_t free{0};      // ページ上の空きブロック数
+      uint64_t allocs{0};  // これまでの割り当て回数
+      uint64_t frees{0};   // これまでの解放回数
+    };
+
+    /** @brief 1 フレームを超える割り当ての統計情報 */
+    struct LargeStats {
+      size_t in_use{0};        // 使用中の割り当て数
+      size_t frames_in_use{0}; // 使用中のフレーム数
+      uint64_t allocs{0};
+      uint64_t frees{0};
+    };
+
+    constexpr explicit DMAPool(FrameSource source) : source_{source} {}
+    DMAPool(const DMAPool&) = delete;
+    DMAPool& operator=(const DMAPool&) = delete;
+
+    /** @brief AllocMem と同じ制約で領域を割り当てる．領域は 0 で埋めて返す． */
+    void* Allocate(size_t size, unsigned int alignment, unsigned int boundary);
+    /** @brief Allocate で割り当てた領域を解放する．nullptr なら何もしない． */
+    void Free(void* p);
+
+    /** @brief 大きさ block_bytes のブロックを扱うサイズクラス */
+    static int SizeClassOf(size_t block_bytes);
+    ClassStats Stats(int size_class) const { return classes_[size_class].stats; }
+    LargeStats Large() const { return large_stats_; }
+    /** @brief 割り当てられなかった回数 */
+    uint64_t Failures() const { return failures_; }
+    /** @brief 管理情報のために確保したフレーム数 */
+    size_t MetadataFrames() const { return metadata_frames_; }
+    /** @brief 統計情報をログに出力する． */
+    void Report() const;
+
+   private:
+    struct FreeBlock {
+      FreeBlock* next;
+    };
+
+    /** @brief ページ，または 1 フレームを超える割り当ての管理情報 */
+    struct Span {
+      uintptr_t base;
+      size_t num_frames;
+      /** @brief ページならサイズクラス，1 フレームを超える割り当てなら -1 */
+      int size_class;
+      size_t in_use;
+      FreeBlock* free_list;
+      /** @brief SizeClass::partial のリスト */
+      Span* prev;
+      Span* next;
+      /** @brief spans_ の同じバケットのリスト．未使用の Span のリストにも使う． */
+      Span* hash_next;
+    };
+
+    struct SizeClass {
+      /** @brief 空きブロックが残っているページのリスト */
+      Span* partial{nullptr};
+      /** @brief 解放せずに残しておく空のページ */
+      Span* empty{nullptr};
+      ClassStats stats;
+    };
+
+    static constexpr size_t kNumBuckets = 256;
+
+    static void Link(Span*& head, Span* span);
+    static void Unlink(Span*& head, Span* span);
+
+    void* AllocateLarge(size_t size, size_t alignment, unsigned int boundary);
+    /** @brief 新しいページをフレームから確保してブロックに分ける． */
+    Span* NewPage(int size_class);
+    Span* NewSpan();
+    void DeleteSpan(Span* span);
+    /** @brief base から始まるページか割り当ての管理情報を探す．なければ nullptr． */
+    Span* FindSpan(uintptr_t base) const;
+    void InsertSpan(Span* span);
+    void RemoveSpan(Span* span);
+
+    FrameSource source_;
+    std::array<SizeClass, kNumSizeClasses> classes_{};
+    LargeStats large_stats_{};
+    uint64_t failures_{0};
+    size_t metadata_frames_{0};
+    /** @brief 使用中の Span を base で引くハッシュ表 */
+    std::array<Span*, kNumBuckets> spans_{};
+    Span* free_spans_{nullptr};
+  };
 
   /** @brief 指定されたバイト数のメモリ領域を確保して先頭ポインタを返す．
    *
    * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
    * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
    * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
+   * 確保したメモリ領域は 0 で埋めてある．
    *
    * @param size        確保するメモリ領域のサイズ（バイト単位）
-   * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．
-   * @param boundary    確保したメモリ領域が跨いではいけない境界．0 なら制約しない．
+   * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．2 のべき乗であること．
+   * @param boundary    確保したメモリ領域が跨いではいけない境界．0 なら制約しない．2 のべき乗であること．
    * @return 確保できなかった場合は nullptr
    */
   void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary);
@@ -31,9 +149,19 @@ namespace usb {
         AllocMem(sizeof(T) * num_obj, alignment, boundary));
   }
 
-  /** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+  /** @brief AllocMem で確保したメモリ領域を解放する．nullptr なら何もしない． */
   void FreeMem(void* p);
 
+  /** @brief AllocMem の統計情報をログに出力する． */
+  void ReportMem();
+
+  /** @brief AllocMem が使う物理アドレスを limit 未満に制限する．
+   *
+   * 64 ビットアドレスを扱えないコントローラのために 4 GiB を渡す．
+   * 既にプールにあるページは移さないので，最初の AllocMem より前に呼ぶこと．
+   */
+  void SetDMAAddressLimit(uintptr_t limit);
+
   /** @brief 標準コンテナ用のメモリアロケータ */
   template <class T, unsigned int Alignment = 64, unsigned int Boundary = 4096>
   class Allocator {
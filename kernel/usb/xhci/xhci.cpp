@@ -4,6 +4,8 @@
 #include "logger.hpp"
 #include "pci.hpp"
 #include "interrupt.hpp"
+#include "lapic.hpp"
+#include "memory_manager.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
@@ -346,6 +348,12 @@ namespace usb::xhci {
   }
 
   Error Controller::Initialize() {
+    // 64 ビットアドレスを扱えない（AC64 = 0）なら，コントローラに渡す構造体はすべて 4 GiB 未満に置く
+    if (!cap_->HCCPARAMS1.Read().bits.addressing_capability_64) {
+      Log(kWarn, "xHC supports only 32-bit addresses\n");
+      SetDMAAddressLimit(4_GiB);
+    }
+
     if (auto err = devmgr_.Initialize(kDeviceSize)) {
       return err;
     }
@@ -551,8 +559,7 @@ namespace usb::xhci {
       exit(1);
     }
 
-    const uint8_t bsp_local_apic_id =
-      *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
+    const uint32_t bsp_local_apic_id = LocalAPICID();
     pci::ConfigureMSIFixedDestination(
         *xhc_dev, bsp_local_apic_id,
         pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,